@@ -117,6 +117,68 @@ void intensity_norm(double *x0, double *x1, double *w, double *w_const, int n, d
 }
 
 
+//*********************************************************************
+// "hist2D" returns the 2D histogram of the baseline (bim) and follow-up 
+// (fim) intensities of nv voxels, weighted by the PIL brain cloud.  
+// Entry bim+(highb+1)*fim holds the sum of the weights, where highb and
+// highf receive the largest intensities within the cloud.
+//
+int *hist2D(short *bim, short *fim, short *PILbraincloud, int nv, int &highb, int &highf)
+{
+   int *hist;
+
+   highb=highf=0;
+
+   for(int i=0; i<nv; i++)
+   if(PILbraincloud[i]>0)
+   {
+      if(bim[i]>highb) highb=bim[i];
+      if(fim[i]>highf) highf=fim[i];
+   }
+
+   hist=(int *)calloc((highb+1)*(highf+1), sizeof(int));
+
+   for(int i=0; i<nv; i++)
+   if(PILbraincloud[i]>0)
+   {
+      hist[bim[i]+(highb+1)*fim[i]]+=PILbraincloud[i];
+   }
+
+   return hist;
+}
+
+//*********************************************************************
+// "fit_hist2D_line" fits a line through the origin to the points (x0,x1) 
+// of the 2D histogram with weights w_const by iteratively reweighted 
+// least squares (see intensity_norm).  w is the initial weights (1) and 
+// receives the final weights.  Returns the slope of the line, whose 
+// unit normal is u and distance from the origin d.
+//
+double fit_hist2D_line(double *x0, double *x1, double *w, double *w_const, int n, double *u, double &d)
+{
+   double slope=0.0;
+   double slope_tmp=0.0;
+   double x0a, x1a;         //The best fitting line is passing through [x0a,x1a] 
+
+   x0a=0;        // to pass through the origin
+   x1a=0;
+
+   for(int iter=0; iter<2000; iter++)
+   {
+      intensity_norm(x0, x1, w, w_const, n, u, d, x0a, x1a);
+      slope=(-u[0]/u[1]);            //The slope of the best fitting line
+
+      if(fabs(slope_tmp-slope)< 1.0e-5)       
+      {
+         if(opt_v) printf("\nNumber of iteration=%d  Slope=%lf\n",iter, slope);
+         break;
+      }
+      slope_tmp=slope;
+   }
+
+   return slope;
+}
+
 //*********************************************************************
 // "hist2D_line" plots the histogram of the baseline and follow-up image 
 // intensities and finds the best fitting line.
@@ -146,7 +208,6 @@ double hist2D_line(const char *bfile, const char *ffile, const char *PILbrainfil
    char fprefix[1024]="";  //follow-up image prefix
 
    double slope;           //The slope of the best fitting line
-   double slope_tmp;
 
 
    if(opt_v)   printf("-----------------------------------\n");
@@ -220,27 +281,13 @@ double hist2D_line(const char *bfile, const char *ffile, const char *PILbrainfil
       int *hist;
 
       double *x0, *x1, *w, *w_const;
-      double x0a, x1a;         //The best fitting line is passing through [x0a,x1a] 
       double u[2], d;
 
 
       int high_square;
       int rangex,rangey;
 
-      for(int i=0; i<PILbraincloud_dim.nv; i++)
-      if(PILbraincloud[i]>0)
-      {
-         if(bim[i]>highb) highb=bim[i];
-         if(fim[i]>highf) highf=fim[i];
-      }
-
-      hist=(int *)calloc((highb+1)*(highf+1), sizeof(int));
-
-      for(int i=0; i<PILbraincloud_dim.nv; i++)
-      if(PILbraincloud[i]>0)
-      {
-         hist[bim[i]+(highb+1)*fim[i]]+=PILbraincloud[i];
-      }
+      hist = hist2D(bim, fim, PILbraincloud, PILbraincloud_dim.nv, highb, highf);
 
       n=0;
       for(int i=0; i<(highb+1)*(highf+1); i++)
@@ -304,21 +351,7 @@ double hist2D_line(const char *bfile, const char *ffile, const char *PILbrainfil
 
       //////////////////////////////////////////////////////////////////////
       //Calculating the best fitting line
-      x0a=0;        // to pass through the origin
-      x1a=0;
-
-      for(int iter=0; iter<2000; iter++)
-      {
-         intensity_norm(x0, x1, w, w_const, n, u, d, x0a, x1a);
-         slope=(-u[0]/u[1]);            //The slope of the best fitting line
-
-         if(fabs(slope_tmp-slope)< 1.0e-5)       
-         {
-            if(opt_v) printf("\nNumber of iteration=%d  Slope=%lf\n",iter, slope);
-            break;
-         }
-         slope_tmp=slope;
-      }
+      slope = fit_hist2D_line(x0, x1, w, w_const, n, u, d);
 
       //////////////////////////////////////////////////////////////////////
       //Writing the plot file
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,6 +12,22 @@
 #include <time.h>
 #include <volume.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <nifti1_io.h>
 #include <niftiimage.h>
@@ -40,6 +57,96 @@
 #define TOLERANCE 1.e-7
 #endif
 
+// maximum number of iterations of the Gauss-Newton optimizer (-gn)
+#ifndef MAXGNITER
+#define MAXGNITER 100
+#endif
+
+// the Gauss-Newton optimizer stops when no parameter changes by more than this (degrees or mm)
+#ifndef GNMINSTEP
+#define GNMINSTEP 1.e-3
+#endif
+
+// maximum number of distinct $ARTHOME resources kept by the atlas cache
+#ifndef MAXATLAS
+#define MAXATLAS 16
+#endif
+
+// maximum number of input images that can be mapped at the same time (see map_nifti_image())
+#ifndef MAXIMAGEMAPS
+#define MAXIMAGEMAPS 16
+#endif
+
+// maximum number of outputs being written in the background at the same time
+#ifndef MAXOUTPUTS
+#define MAXOUTPUTS 16
+#endif
+
+// uncompressed bytes in each independently compressed gzip member of a .nii.gz output image
+#ifndef GZBLOCK
+#define GZBLOCK 262144
+#endif
+
+// alignment (bytes) of the data of every entry of an atlas pack
+#ifndef PACKALIGN
+#define PACKALIGN 4096
+#endif
+
+// seed of the random voxel subsets used with -sample
+#ifndef SAMPLE_SEED
+#define SAMPLE_SEED 12345
+#endif
+
+// maximum number of transformations evaluated together by the batched cost functions
+#ifndef MAXBATCH
+#define MAXBATCH 16
+#endif
+
+// maximum number of resolution levels (-pyramid); at level 4 a 1 mm image has 16 mm voxels
+#ifndef MAXPYRAMID
+#define MAXPYRAMID 5
+#endif
+
+// metrics and interpolators of the cost functions, selected with -cost
+#define COST_SSD 0
+#define COST_NCC 1
+#define COST_MI 2
+#define COST_NMI 3
+#define INTERP_TRILINEAR 0
+#define INTERP_NEAREST 1
+
+// number of intensity bins per image of the joint histogram of the MI cost functions
+#ifndef MIBINS
+#define MIBINS 32
+#endif
+
+// fixed-point scale of the partial-volume weights in the joint histogram
+#ifndef PVSCALE
+#define PVSCALE 65536
+#endif
+
+// maximum number of stages recorded with -profile
+#ifndef MAXSTAGES
+#define MAXSTAGES 1024
+#endif
+
+// maximum number of threads whose hardware counters are read with -counters
+#ifndef MAXCOUNTERTHREADS
+#define MAXCOUNTERTHREADS 256
+#endif
+
+// number of entries of the cost cache of coordinate_search(); must be a power of 2
+#ifndef COSTCACHE_SIZE
+#define COSTCACHE_SIZE 4096
+#endif
+
+// log2 of the edge (in interpolation cells) of the bricks of the -brick image layout
+#ifndef BRICKSHIFT
+#define BRICKSHIFT 3
+#endif
+#define BRICK (1<<BRICKSHIFT)
+#define BRICKSIZE ((BRICK+1)*(BRICK+1)*(BRICK+1))
+
 int opt;
 
 /////////////////////////////////////////////////////////////////////////
@@ -48,6 +155,21 @@ int opt;
 int opt_png=NO; // flag for outputing PNG images
 int opt_v=NO; // flag for verbose mode
 int opt_newPIL=YES;
+int opt_threads=1; // number of threads used in the cost function evaluations
+int opt_pyramid=1; // number of resolution levels used in registration
+int opt_simd=NO; // flag for using the fast row kernels in the cost functions
+int opt_gn=NO; // flag for using the Gauss-Newton optimizer instead of the grid search
+float4 opt_sample=1.0; // fraction of the masked voxels used in the first registration iterations
+int opt_fixed16=NO; // flag for interpolating 16-bit fixed-point images in the cost functions
+int opt_brick=NO; // flag for the bricked image layout in the cost functions
+int opt_metric=COST_SSD; // cost function metric
+int opt_interp=INTERP_TRILINEAR; // cost function interpolator
+int opt_halfway=NO; // flag for the single-pass halfway-space cost functions
+char opt_profile[1024]=""; // file receiving the per-stage timings (-profile)
+int opt_counters=NO; // flag for adding hardware performance counters to the profile
+char opt_pack[1024]=""; // precompiled atlas pack (-pack), $ARTHOME/kaiba.pack by default
+int opt_gz=NO; // flag for writing the output images as .nii.gz
+int opt_nosave=NO; // flag for not writing the transformations and images, only <prefix>.csv
 
 /////////////////////////////////////////////////////////////////////////
 
@@ -63,6 +185,20 @@ static struct option options[] =
    {"-f",1,'f'},   // follow-up image
    {"-blm",1,'l'},  // baseline landmark 
    {"-flm",1,'m'},  // folow-up landmark 
+   {"-threads",1,'t'},  // number of threads
+   {"-pyramid",1,'y'},  // number of resolution levels
+   {"-simd",0,'s'},  // fast (SIMD) cost function kernels
+   {"-gn",0,'G'},  // Gauss-Newton optimizer
+   {"-sample",1,'S'},  // initial voxel sample fraction
+   {"-fixed16",0,'x'},  // 16-bit fixed-point images in the cost functions
+   {"-brick",0,'k'},  // bricked image layout in the cost functions
+   {"-cost",1,'c'},  // cost function metric and interpolator
+   {"-halfway",0,'H'},  // halfway-space cost functions
+   {"-profile",1,'P'},  // per-stage timings file
+   {"-counters",0,'C'},  // hardware performance counters in the profile
+   {"-pack",1,'K'},  // precompiled atlas pack
+   {"-gz",0,'z'},  // gzipped output images
+   {"-nosave",0,'N'},  // no transformation and image outputs
    {0,0,0}
 };
 
@@ -79,603 +215,4939 @@ void print_help_and_exit()
    "   -f <follow-up>.nii: Follow-up T1W volume (NIFTI format)\n"
    "   -blm <filename>: Manually specifies AC/PC/RP landmarks at baseline\n"
    "   -flm <filename>: Manually specifies AC/PC/RP landmarks at follow-up\n"
+   "   -threads <N>: Number of threads used in image registration and in the parallel\n"
+   "   decompression of -gz inputs (default: 1)\n"
+   "   -pyramid <N>: Number of resolution levels used in image registration, each level\n"
+   "   halving the resolution of the previous one (default: 1, i.e., native resolution only;\n"
+   "   at most 5)\n"
+   "   -simd : Uses the fast row kernels in the registration cost functions (AVX-512, AVX2 or\n"
+   "   branch-free scalar, selected at run time)\n"
+   "   -gn : Uses a Gauss-Newton optimizer with analytic gradients instead of the grid search\n"
+   "   -sample <fraction>: Starts the registration on a random subset of this fraction of the masked\n"
+   "   voxels, doubling it each time the search converges until all voxels are used (default: 1.0)\n"
+   "   -fixed16 : Stores the normalized images interpolated by the cost functions as 16-bit\n"
+   "   fixed-point numbers, halving their memory traffic (implies -simd)\n"
+   "   -brick : Stores the images interpolated by the cost functions in 8x8x8 bricks, reducing\n"
+   "   cache and TLB misses for oblique transformations (implies -simd)\n"
+   "   -cost <metric>[:<interpolator>]: Registration cost function, where <metric> is ssd\n"
+   "   (default), ncc, mi or nmi (mutual information or normalized mutual information, for\n"
+   "   images with different contrasts) and <interpolator> is trilinear (default) or nearest.\n"
+   "   With mi and nmi, trilinear means partial-volume interpolation.\n"
+   "   -halfway : Compares the two images on the PIL brain cloud grid halfway between them, in\n"
+   "   one pass instead of a forward and an inverse pass (not with -gn; ignores -simd, -fixed16\n"
+   "   and -brick)\n"
+   "   -profile <file>: Writes the wall-clock time, CPU time, number of cost function evaluations,\n"
+   "   voxels processed and peak resident memory of every processing stage to <file> in the\n"
+   "   Chrome trace event (JSON) format\n"
+   "   -counters : Adds the CPU cycles, instructions, last-level cache misses, data TLB misses and\n"
+   "   branch misses of every stage to the -profile output (Linux perf_event_open, user space only,\n"
+   "   main thread and cost function threads only)\n"
+   "   -pack <file>: Maps the $ARTHOME atlases from a pack file compiled by kaiba_pack (default:\n"
+   "   $ARTHOME/kaiba.pack if it exists, otherwise the atlases are read from $ARTHOME)\n"
+   "   -gz : Writes the output images (<prefix>_PIL, _RHROI and _LHROI) as .nii.gz, compressed in\n"
+   "   the background while the processing continues.  Gzipped inputs written this way are\n"
+   "   decompressed in parallel by -threads threads.\n"
+   "   -nosave : Does not write the transformations (<prefix>_PIL.mrx) and images (<prefix>_PIL,\n"
+   "   _RHROI and _LHROI), only the HI values in <prefix>.csv.  Otherwise they are written in the\n"
+   "   background while the processing continues.\n"
    "\n");
 
    exit(0);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
-float8 ssd_cost_function(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, int2 *bmsk, int2 *fmsk)
-{
-   int kmin_f=0; 
-   int kmax_f=dimf.nz-1;
-   int jmin_f=0; 
-   int jmax_f=dimf.ny-1;
-   int imin_f=0; 
-   int imax_f=dimf.nx-1;
-   int kmin_b=0;
-   int kmax_b=dimb.nz-1;
-   int jmin_b=0;
-   int jmax_b=dimb.ny-1;
-   int imin_b=0;
-   int imax_b=dimb.nx-1;
-
-   float4 *invT;
-   float4 dif;
-   float8 cost=0.0;
-   int v, slice_offset, offset;
-   float4 Tmod[16]; //modified T
-   float4 invTmod[16]; //modified invT
-
-   float4 psub0, psub1, psub2;
-   float4 nxsub2, nysub2, nzsub2; 
+// Per-stage profiling (-profile)
+//
+// profile_begin() and profile_end() bracket a processing stage.  Stages nest; each records its 
+// wall-clock and CPU time (of all threads), the cost function evaluations and voxels processed
+// by the cost functions within it (including its sub-stages), and the peak resident memory of 
+// the process when it ends.  write_profile() saves them as "complete" events of the Chrome 
+// trace event format, which chrome://tracing and Perfetto display as a timeline and which is 
+// plain JSON for aggregating many runs.
+//
+// With -counters, each stage also records the hardware performance counters of COUNTER_NAMES,
+// summed over the main thread and the OpenMP threads of the cost functions.  These tell whether
+// a stage is limited by memory (cache and TLB misses per instruction) or by compute 
+// (instructions per cycle).  Other threads are not counted: the background output threads 
+// (queue_output_image()), or OpenMP threads beyond those of the first team of opt_threads.  
+// Each event of the trace says so in its "counted" argument.
+//////////////////////////////////////////////////////////////////////////////////////////////////
 
-   float4 ptrg0, ptrg1, ptrg2;
-   float4 nxtrg2, nytrg2, nztrg2;
+#define NCOUNTERS 5
 
-   invT = inv4(T);
+static const char *COUNTER_NAMES[NCOUNTERS] = 
+{"cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"};
 
-   nxsub2 = (dimf.nx-1)/2.0;
-   nysub2 = (dimf.ny-1)/2.0;
-   nzsub2 = (dimf.nz-1)/2.0;
+int counter_fd[MAXCOUNTERTHREADS][NCOUNTERS]; // perf_event_open descriptors, per thread
+int counter_nthread=0;
 
-   nxtrg2 = (dimb.nx-1)/2.0;
-   nytrg2 = (dimb.ny-1)/2.0;
-   nztrg2 = (dimb.nz-1)/2.0;
+#ifdef __linux__
+// Opens the counters of COUNTER_NAMES for the calling thread in counter_fd[t].
+static int open_thread_counters(int t)
+{
+   struct perf_event_attr attr;
+   unsigned int type[NCOUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, 
+   PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+   unsigned long long config[NCOUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, 
+   PERF_COUNT_HW_CACHE_MISSES, 
+   PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16), 
+   PERF_COUNT_HW_BRANCH_MISSES};
+
+   for(int c=0; c<NCOUNTERS; c++)
+   {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type[c];
+      attr.config = config[c];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+
+      counter_fd[t][c] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+      if(counter_fd[t][c]<0) return(0);
+   }
 
-   ////////////////////////////////////////
-   Tmod[0] = T[0]*dimf.dx/dimb.dx;
-   Tmod[1] = T[1]*dimf.dy/dimb.dx;
-   Tmod[2] = T[2]*dimf.dz/dimb.dx;
-   Tmod[3] = T[3]/dimb.dx + nxtrg2;
+   return(1);
+}
+#endif
 
-   Tmod[4] = T[4]*dimf.dx/dimb.dy;
-   Tmod[5] = T[5]*dimf.dy/dimb.dy;
-   Tmod[6] = T[6]*dimf.dz/dimb.dy;
-   Tmod[7] = T[7]/dimb.dy + nytrg2;
+// Opens the counters of the main thread and of the opt_threads OpenMP threads.  The OpenMP 
+// runtime keeps the threads it starts for the main thread between parallel regions of 
+// opt_threads, so the counters follow the threads of the cost functions.  Counters inherited by
+// new threads (attr.inherit) would not do: their counts reach the parent only when the threads
+// exit, and the OpenMP threads live until the end of the process.  Returns 0 if the counters 
+// are not available.
+int open_counters()
+{
+   int ok=YES;
 
-   Tmod[8] = T[8]*dimf.dx/dimb.dz;
-   Tmod[9] = T[9]*dimf.dy/dimb.dz;
-   Tmod[10] = T[10]*dimf.dz/dimb.dz;
-   Tmod[11] = T[11]/dimb.dz + nztrg2;
-   ////////////////////////////////////////
-   invTmod[0] = invT[0]*dimb.dx/dimf.dx;
-   invTmod[1] = invT[1]*dimb.dy/dimf.dx;
-   invTmod[2] = invT[2]*dimb.dz/dimf.dx;
-   invTmod[3] = invT[3]/dimf.dx + nxsub2;
+#ifdef __linux__
+   int nthread = opt_threads;
+   if(nthread > MAXCOUNTERTHREADS-1) nthread = MAXCOUNTERTHREADS-1;
 
-   invTmod[4] = invT[4]*dimb.dx/dimf.dy;
-   invTmod[5] = invT[5]*dimb.dy/dimf.dy;
-   invTmod[6] = invT[6]*dimb.dz/dimf.dy;
-   invTmod[7] = invT[7]/dimf.dy + nysub2;
+   for(int t=0; t<=nthread; t++)
+   for(int c=0; c<NCOUNTERS; c++)
+      counter_fd[t][c] = -1;
 
-   invTmod[8] = invT[8]*dimb.dx/dimf.dz;
-   invTmod[9] = invT[9]*dimb.dy/dimf.dz;
-   invTmod[10] = invT[10]*dimb.dz/dimf.dz;
-   invTmod[11] = invT[11]/dimf.dz + nzsub2;
-   ////////////////////////////////////////
-   
-   float4 t2, t6, t10;
-   float4 t1, t5, t9;
+   ok = open_thread_counters(0);
 
-   for(int k=kmin_f; k<=kmax_f; k++)
+   // the main thread is thread 0 of the team too, so it is skipped there
+   #pragma omp parallel num_threads(nthread)
    {
-      slice_offset = k*dimf.np;
-      psub2 = (k-nzsub2);
-      t2  = Tmod[2]*psub2  + Tmod[3];
-      t6  = Tmod[6]*psub2  + Tmod[7];
-      t10 = Tmod[10]*psub2 + Tmod[11];
-      for(int j=jmin_f; j<=jmax_f; j++)
+      int t=0;
+#ifdef _OPENMP
+      t = omp_get_thread_num();
+#endif
+      if(t>0 && !open_thread_counters(t+1))
       {
-         offset = slice_offset + j*dimf.nx;
-         psub1 = (j-nysub2);
-         t1 = Tmod[1]*psub1;
-         t5 = Tmod[5]*psub1;
-         t9 = Tmod[9]*psub1;
-         for(int i=imin_f; i<=imax_f; i++)
-         {
-            v = offset + i;
+         #pragma omp atomic write
+         ok = NO;
+      }
+   }
 
-            if( fmsk[v]>0)
-            {
-               psub0 = (i-nxsub2);
+   counter_nthread = nthread+1;
+#else
+   ok = NO;
+#endif
 
-               ptrg0 = Tmod[0]*psub0 + t1 + t2;
-               ptrg1 = Tmod[4]*psub0 + t5 + t6;
-               ptrg2 = Tmod[8]*psub0 + t9 + t10;
+   return(ok);
+}
 
-               dif = sclfim[v] - linearInterpolator(ptrg0, ptrg1, ptrg2, sclbim, dimb.nx, dimb.ny, dimb.nz, dimb.np);
-               cost += (dif*dif);
-            }
-         }
-      }
-   }
+// Returns in count[] the counters summed over all threads.
+static void read_counters(long long *count)
+{
+   long long value;
 
-   for(int k=kmin_b; k<=kmax_b; k++)
+   for(int c=0; c<NCOUNTERS; c++) count[c]=0;
+
+   for(int t=0; t<counter_nthread; t++)
+   for(int c=0; c<NCOUNTERS; c++)
    {
-      slice_offset = k*dimb.np;
-      ptrg2 = (k-nztrg2);
-      t2  = invTmod[2]*ptrg2  + invTmod[3];
-      t6  = invTmod[6]*ptrg2  + invTmod[7];
-      t10 = invTmod[10]*ptrg2 + invTmod[11];
-      for(int j=jmin_b; j<=jmax_b; j++)
-      {
-         offset = slice_offset + j*dimb.nx;
-         ptrg1 = (j-nytrg2);
-         t1 = invTmod[1]*ptrg1;
-         t5 = invTmod[5]*ptrg1;
-         t9 = invTmod[9]*ptrg1;
-         for(int i=imin_b; i<=imax_b; i++)
-         {
-            v = offset + i;
+      if( counter_fd[t][c]>=0 && read(counter_fd[t][c], &value, sizeof(value))==sizeof(value) )
+         count[c] += value;
+   }
+}
 
-            if( bmsk[v]>0)
-            {
-               ptrg0 = (i-nxtrg2);
+struct STAGE
+{
+   char name[64];
+   int depth;
+   double start;  // wall-clock time at the beginning, in s since the first stage
+   double wall;   // s
+   double cpu;    // s
+   long long evals, voxels;
+   long peakrss;  // kB
+   long long counter[NCOUNTERS]; // with -counters
+};
 
-               psub0 = invTmod[0]*ptrg0 + t1 + t2;
-               psub1 = invTmod[4]*ptrg0 + t5 + t6;
-               psub2 = invTmod[8]*ptrg0 + t9 + t10;
+STAGE profile_stage[MAXSTAGES];
+int profile_nstage=0;
+int profile_depth=0;
+long long profile_evals=0; // cost function evaluations so far
+long long profile_voxels=0; // voxels processed by the cost functions so far
+double profile_t0=-1.0; // wall-clock time of the first stage
 
-               dif = sclbim[v] - linearInterpolator(psub0, psub1, psub2, sclfim, dimf.nx, dimf.ny, dimf.nz, dimf.np);
-               cost += (dif*dif);
-            }
-         }
-      }
-   }
+static double profile_clock(clockid_t id)
+{
+   struct timespec t;
 
-   free(invT);
-   return(cost);
+   clock_gettime(id, &t);
+   return( t.tv_sec + 1.0e-9*t.tv_nsec );
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////
-
-float8 ncc_cost_function(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, int2 *bmsk, int2 *fmsk)
+// Starts a stage named by the printf-style format and returns its index for profile_end(), or
+// -1 when -profile is not used or the stage table is full.
+int profile_begin(const char *format, ...)
 {
-   int kmin_f=0; 
-   int kmax_f=dimf.nz-1;
-   int jmin_f=0; 
-   int jmax_f=dimf.ny-1;
-   int imin_f=0; 
-   int imax_f=dimf.nx-1;
-   int kmin_b=0;
-   int kmax_b=dimb.nz-1;
-   int jmin_b=0;
-   int jmax_b=dimb.ny-1;
-   int imin_b=0;
-   int imax_b=dimb.nx-1;
+   STAGE *s;
+   va_list args;
 
-   int n=0; // number of voxels that take part in the NCC calculation
-   float8 sum1, sum2, sum11, sum22, sum12;
-   float4 subject_image_value, target_image_value;
+   if( opt_profile[0]=='\0' || profile_nstage>=MAXSTAGES ) return(-1);
 
-   float4 *invT;
-   float4 dif;
-   float8 cost=0.0;
-   int v, slice_offset, offset;
-   float4 Tmod[16]; //modified T
-   float4 invTmod[16]; //modified invT
+   s = profile_stage + profile_nstage;
 
-   float4 psub0, psub1, psub2;
-   float4 nxsub2, nysub2, nzsub2; 
+   va_start(args, format);
+   vsnprintf(s->name, sizeof(s->name), format, args);
+   va_end(args);
 
-   float4 ptrg0, ptrg1, ptrg2;
-   float4 nxtrg2, nytrg2, nztrg2;
+   if(profile_t0<0.0) profile_t0 = profile_clock(CLOCK_MONOTONIC);
 
-   invT = inv4(T);
+   s->depth = profile_depth++;
+   s->start = profile_clock(CLOCK_MONOTONIC) - profile_t0;
+   s->cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+   s->evals = profile_evals;
+   s->voxels = profile_voxels;
 
-   nxsub2 = (dimf.nx-1)/2.0;
-   nysub2 = (dimf.ny-1)/2.0;
-   nzsub2 = (dimf.nz-1)/2.0;
+   if(opt_counters) read_counters(s->counter);
 
-   nxtrg2 = (dimb.nx-1)/2.0;
-   nytrg2 = (dimb.ny-1)/2.0;
-   nztrg2 = (dimb.nz-1)/2.0;
+   return(profile_nstage++);
+}
 
-   ////////////////////////////////////////
-   Tmod[0] = T[0]*dimf.dx/dimb.dx;
-   Tmod[1] = T[1]*dimf.dy/dimb.dx;
-   Tmod[2] = T[2]*dimf.dz/dimb.dx;
-   Tmod[3] = T[3]/dimb.dx + nxtrg2;
+void profile_end(int n)
+{
+   STAGE *s;
+   struct rusage usage;
 
-   Tmod[4] = T[4]*dimf.dx/dimb.dy;
-   Tmod[5] = T[5]*dimf.dy/dimb.dy;
-   Tmod[6] = T[6]*dimf.dz/dimb.dy;
-   Tmod[7] = T[7]/dimb.dy + nytrg2;
+   if(n<0) return;
 
-   Tmod[8] = T[8]*dimf.dx/dimb.dz;
-   Tmod[9] = T[9]*dimf.dy/dimb.dz;
-   Tmod[10] = T[10]*dimf.dz/dimb.dz;
-   Tmod[11] = T[11]/dimb.dz + nztrg2;
-   ////////////////////////////////////////
-   invTmod[0] = invT[0]*dimb.dx/dimf.dx;
-   invTmod[1] = invT[1]*dimb.dy/dimf.dx;
-   invTmod[2] = invT[2]*dimb.dz/dimf.dx;
-   invTmod[3] = invT[3]/dimf.dx + nxsub2;
+   s = profile_stage + n;
 
-   invTmod[4] = invT[4]*dimb.dx/dimf.dy;
-   invTmod[5] = invT[5]*dimb.dy/dimf.dy;
-   invTmod[6] = invT[6]*dimb.dz/dimf.dy;
-   invTmod[7] = invT[7]/dimf.dy + nysub2;
+   s->wall = profile_clock(CLOCK_MONOTONIC) - profile_t0 - s->start;
+   s->cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID) - s->cpu;
+   s->evals = profile_evals - s->evals;
+   s->voxels = profile_voxels - s->voxels;
 
-   invTmod[8] = invT[8]*dimb.dx/dimf.dz;
-   invTmod[9] = invT[9]*dimb.dy/dimf.dz;
-   invTmod[10] = invT[10]*dimb.dz/dimf.dz;
-   invTmod[11] = invT[11]/dimf.dz + nzsub2;
-   ////////////////////////////////////////
-   
-   float4 t2, t6, t10;
-   float4 t1, t5, t9;
+   if(opt_counters)
+   {
+      long long count[NCOUNTERS];
 
-   // initialize sums to zero
-   sum1=sum2=sum11=sum22=sum12=0.0;
+      read_counters(count);
+      for(int c=0; c<NCOUNTERS; c++) s->counter[c] = count[c] - s->counter[c];
+   }
 
-   for(int k=kmin_f; k<=kmax_f; k++)
+   getrusage(RUSAGE_SELF, &usage);
+   s->peakrss = usage.ru_maxrss;
+
+   profile_depth--;
+}
+
+// Writes the stages recorded so far to filename; times are in microseconds as the format requires.
+void write_profile(const char *filename)
+{
+   FILE *fp;
+   STAGE *s;
+
+   fp = fopen(filename,"w");
+   if(fp==NULL)
    {
-      slice_offset = k*dimf.np;
-      psub2 = (k-nzsub2);
-      t2  = Tmod[2]*psub2  + Tmod[3];
-      t6  = Tmod[6]*psub2  + Tmod[7];
-      t10 = Tmod[10]*psub2 + Tmod[11];
+      printf("Warning: cound not write to %s\n", filename);
+      return;
+   }
+
+   fprintf(fp,"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   for(int n=0; n<profile_nstage; n++)
+   {
+      s = profile_stage + n;
+      fprintf(fp,"{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, \"ts\": %.0f, \"dur\": %.0f, ",
+      s->name, (int)getpid(), 1.0e6*s->start, 1.0e6*s->wall);
+      fprintf(fp,"\"args\": {\"depth\": %d, \"cpu_us\": %.0f, \"cost_evals\": %lld, \"voxels\": %lld, \"peak_rss_kb\": %ld, \"threads\": %d",
+      s->depth, 1.0e6*s->cpu, s->evals, s->voxels, s->peakrss, opt_threads);
+      if(opt_counters)
+      {
+         for(int c=0; c<NCOUNTERS; c++) fprintf(fp,", \"%s\": %lld", COUNTER_NAMES[c], s->counter[c]);
+         fprintf(fp,", \"ipc\": %.3f", s->counter[0]>0 ? (double)s->counter[1]/s->counter[0] : 0.0);
+         fprintf(fp,", \"counted\": \"main thread and cost function team (%d threads)\"", counter_nthread);
+      }
+      fprintf(fp,"}}%s\n", n<profile_nstage-1 ? "," : "");
+   }
+   fprintf(fp,"]}\n");
+
+   fclose(fp);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// $ARTHOME atlas resources
+//
+// atlas_image() and atlas_model() read a volume (PILbrain.nii, lhc3.nii, ...) or a landmark 
+// model (lhc3.mdl, ...) from $ARTHOME the first time it is asked for, and return the same 
+// in-memory copy on every later call, so each resource is read and parsed at most once per
+// process.  The returned resources are shared and must not be modified or freed.  The cache 
+// is not thread safe; it is used from the main thread only.
+//
+// If an atlas pack is open (open_atlas_pack()), the resources are instead views of the pack, 
+// which is mapped read-only and shared: processes using the same pack share a single copy in
+// the page cache, and nothing is read or parsed at startup.  A pack is compiled from $ARTHOME 
+// by kaiba_pack (write_atlas_pack()).  It holds a header, a table of entries and the data of 
+// each entry at a multiple of PACKALIGN bytes: the voxels of a volume, with its NIFTI header 
+// (including the ROI offsets in dim[5..7]) in the entry, or the centers of mass and reference
+// spheres of a landmark model.  It also holds the PIL brain cloud thresholded at CLOUD_THRESH
+// (atlas_brain_mask()).  The pack is in the native byte order and structure layout of the 
+// machine that compiled it; an entry whose $ARTHOME file has changed since is not used.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the $ARTHOME resources used by KAIBA, which kaiba_pack compiles into a pack
+static const char *ATLAS_IMAGES[] = {"PILbrain.nii", "lhc3.nii", "rhc3.nii", NULL};
+static const char *ATLAS_MODELS[] = {"lhc3.mdl", "rhc3.mdl", NULL};
+
+struct ATLASIMAGE
+{
+   char filename[1024];
+   nifti_1_header hdr;
+   int2 *v;
+   int mapped; // v points into the atlas pack
+};
+
+// a landmark model: NLM landmarks, each searched within radius R of its expected location cm 
+// by matching spheres of radius r (of nref voxels) to its reference sphere ref
+struct LMMODEL
+{
+   char filename[1024];
+   int NLM, r, R;
+   int nref;
+   int *cm;     // 3*NLM
+   float4 *ref; // nref*NLM
+   int mapped;  // cm and ref point into the atlas pack
+};
+
+ATLASIMAGE atlas_images[MAXATLAS];
+int atlas_nimage=0;
+LMMODEL atlas_models[MAXATLAS];
+int atlas_nmodel=0;
+ATLASIMAGE atlas_mask; // thresholded PIL brain cloud, v==NULL until first needed
+
+#define PACK_MAGIC "KAIBAPK"
+#define PACK_VERSION 1
+#define PACK_BYTEORDER 0x01020304
+#define PACK_IMAGE 1
+#define PACK_MODEL 2
+#define PACK_MASK 3
+
+struct PACKHEADER
+{
+   char magic[8];
+   int version;
+   int byteorder;  // PACK_BYTEORDER as written by the compiling machine
+   int entrysize;  // sizeof(PACKENTRY)
+   int nentry;
+   long long filesize;
+};
+
+struct PACKENTRY
+{
+   char name[64];   // $ARTHOME file name
+   int type;        // PACK_IMAGE, PACK_MODEL or PACK_MASK
+   int thresh;      // CLOUD_THRESH of a PACK_MASK
+   int NLM, r, R, nref; // PACK_MODEL
+   long long mtime; // modification time of the $ARTHOME file
+   long long offset, size; // data, in bytes from the beginning of the pack
+   nifti_1_header hdr; // PACK_IMAGE and PACK_MASK
+};
+
+char *atlas_pack=NULL; // the mapped pack
+size_t atlas_pack_size=0;
+
+// Returns the modification time of $ARTHOME/name, or -1 if it does not exist.
+static long long atlas_mtime(const char *name)
+{
+   char filename[1024];
+   struct stat st;
+
+   sprintf(filename,"%s/%s",ARTHOME,name);
+   if( stat(filename, &st)!=0 ) return(-1);
+
+   return( (long long)st.st_mtime );
+}
+
+// Maps the atlas pack filename.  Returns 0 if it cannot be opened or is not a valid pack for
+// this machine.
+int open_atlas_pack(const char *filename)
+{
+   int fd;
+   struct stat st;
+   char *p;
+   PACKHEADER *h;
+   PACKENTRY *e;
+   int ok;
+
+   fd = open(filename, O_RDONLY);
+   if(fd<0) return(0);
+
+   if( fstat(fd, &st)!=0 || (size_t)st.st_size < sizeof(PACKHEADER) )
+   {
+      close(fd);
+      return(0);
+   }
+
+   p = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(p==MAP_FAILED) return(0);
+
+   h = (PACKHEADER *)p;
+   e = (PACKENTRY *)(p + sizeof(PACKHEADER));
+
+   ok = memcmp(h->magic, PACK_MAGIC, sizeof(h->magic))==0 && h->version==PACK_VERSION && 
+   h->byteorder==PACK_BYTEORDER && h->entrysize==(int)sizeof(PACKENTRY) && h->filesize==(long long)st.st_size &&
+   h->nentry>=0 && sizeof(PACKHEADER) + (size_t)h->nentry*sizeof(PACKENTRY) <= (size_t)st.st_size;
+
+   for(int n=0; ok && n<h->nentry; n++)
+      ok = e[n].offset>=0 && e[n].size>=0 && e[n].offset%PACKALIGN==0 && e[n].offset+e[n].size<=h->filesize;
+
+   if(!ok)
+   {
+      munmap(p, st.st_size);
+      return(0);
+   }
+
+   atlas_pack = p;
+   atlas_pack_size = st.st_size;
+
+   return(1);
+}
+
+// number of voxels of a NIFTI volume, including all its 3D volumes
+static long long nifti_voxels(nifti_1_header &hdr)
+{
+   long long nv = (long long)hdr.dim[1]*hdr.dim[2]*hdr.dim[3];
+
+   if( hdr.dim[0]>=4 && hdr.dim[4]>1 ) nv *= hdr.dim[4];
+
+   return(nv);
+}
+
+// offset of the reference spheres from the centers of mass of a model of NLM landmarks in a pack
+static inline long long pack_ref_offset(int NLM)
+{
+   return( ((3LL*NLM*sizeof(int) + 63)/64)*64 );
+}
+
+// Returns 1 if the size of the data of entry e matches its contents, so that every access to
+// the data stays within it.
+static int valid_pack_entry(PACKENTRY &e)
+{
+   nifti_1_header &hdr = e.hdr;
+
+   if( e.type==PACK_IMAGE || e.type==PACK_MASK )
+   {
+      if( hdr.dim[0]<3 || hdr.dim[0]>7 || hdr.dim[1]<1 || hdr.dim[2]<1 || hdr.dim[3]<1 ) return(0);
+      if( hdr.dim[0]>=4 && hdr.dim[4]<0 ) return(0);
+
+      if( e.type==PACK_IMAGE ) return( e.size == nifti_voxels(hdr)*(long long)sizeof(int2) );
+
+      return( e.size == (long long)hdr.dim[1]*hdr.dim[2]*hdr.dim[3]*sizeof(int2) );
+   }
+
+   if( e.type==PACK_MODEL )
+   {
+      if( e.NLM<1 || e.r<0 || e.R<0 || e.nref<1 ) return(0);
+      if( e.size != pack_ref_offset(e.NLM) + (long long)e.nref*e.NLM*sizeof(float4) ) return(0);
+
+      // a sphere of radius r has more than r^3 voxels; this bounds r before SPH is built
+      if( (long long)e.r*e.r*e.r > e.nref ) return(0);
+
+      SPH refsph(e.r);
+      return( refsph.n == e.nref );
+   }
+
+   return(0);
+}
+
+// Returns the entry of the open atlas pack for $ARTHOME/name of the given type, or NULL if
+// there is none, it is invalid or the file has changed since the pack was compiled.
+static PACKENTRY *pack_entry(const char *name, int type)
+{
+   PACKHEADER *h;
+   PACKENTRY *e;
+   long long mtime;
+
+   if(atlas_pack==NULL) return(NULL);
+
+   h = (PACKHEADER *)atlas_pack;
+   e = (PACKENTRY *)(atlas_pack + sizeof(PACKHEADER));
+
+   for(int n=0; n<h->nentry; n++)
+   {
+      if( memchr(e[n].name, '\0', sizeof(e[n].name))==NULL ) continue;
+      if( e[n].type!=type || strcmp(e[n].name, name)!=0 ) continue;
+
+      if( !valid_pack_entry(e[n]) )
+      {
+         printf("Warning: the atlas pack entry of %s is invalid, reading $ARTHOME/%s instead\n", name, name);
+         return(NULL);
+      }
+
+      mtime = atlas_mtime(name);
+      if( mtime>=0 && mtime!=e[n].mtime )
+      {
+         printf("Warning: $ARTHOME/%s has changed since the atlas pack was compiled, reading it instead\n", name);
+         return(NULL);
+      }
+
+      return(e+n);
+   }
+
+   return(NULL);
+}
+
+// Returns $ARTHOME/name, read on the first call.  Aborts if it cannot be read.
+const ATLASIMAGE *atlas_image(const char *name)
+{
+   char filename[1024];
+   ATLASIMAGE *a;
+   int stage;
+
+   sprintf(filename,"%s/%s",ARTHOME,name);
+
+   for(int n=0; n<atlas_nimage; n++)
+      if( strcmp(atlas_images[n].filename, filename)==0 ) return(atlas_images+n);
+
+   if(atlas_nimage>=MAXATLAS)
+   {
+      printf("Too many atlas resources (MAXATLAS=%d), aborting ...\n", MAXATLAS);
+      exit(1);
+   }
+
+   a = atlas_images + atlas_nimage;
+
+   PACKENTRY *e = pack_entry(name, PACK_IMAGE);
+   if(e!=NULL)
+   {
+      a->hdr = e->hdr;
+      a->v = (int2 *)(atlas_pack + e->offset);
+      a->mapped = YES;
+   }
+   else
+   {
+      stage = profile_begin("read atlas %s", name);
+      a->v = (int2 *)read_nifti_image(filename, &a->hdr);
+      a->mapped = NO;
+      profile_end(stage);
+   }
+
+   if(a->v==NULL)
+   {
+      printf("Error reading %s, aborting ...\n", filename);
+      exit(1);
+   }
+
+   sprintf(a->filename,"%s",filename);
+   atlas_nimage++;
+
+   return(a);
+}
+
+// Returns the landmark model $ARTHOME/name, read on the first call.  Aborts if it cannot be read.
+const LMMODEL *atlas_model(const char *name)
+{
+   char filename[1024];
+   LMMODEL *m;
+   FILE *fp;
+   int ok;
+   int stage;
+
+   sprintf(filename,"%s/%s",ARTHOME,name);
+
+   for(int n=0; n<atlas_nmodel; n++)
+      if( strcmp(atlas_models[n].filename, filename)==0 ) return(atlas_models+n);
+
+   if(atlas_nmodel>=MAXATLAS)
+   {
+      printf("Too many atlas resources (MAXATLAS=%d), aborting ...\n", MAXATLAS);
+      exit(1);
+   }
+
+   m = atlas_models + atlas_nmodel;
+
+   PACKENTRY *e = pack_entry(name, PACK_MODEL);
+   if(e!=NULL)
+   {
+      m->NLM = e->NLM;
+      m->r = e->r;
+      m->R = e->R;
+      m->nref = e->nref;
+      m->cm = (int *)(atlas_pack + e->offset);
+      m->ref = (float4 *)(atlas_pack + e->offset + pack_ref_offset(e->NLM));
+      m->mapped = YES;
+
+      sprintf(m->filename,"%s",filename);
+      atlas_nmodel++;
+
+      return(m);
+   }
+
+   fp=fopen(filename, "r");
+
+   if(fp==NULL) 
+   {
+      printf("Could not find %s, aborting ...\n",filename);
+      exit(0);
+   }
+
+   m->mapped = NO;
+
+   stage = profile_begin("read atlas %s", name);
+
+   ok = fread(&m->NLM, sizeof(int), 1, fp)==1;
+   ok = ok && fread(&m->r, sizeof(int), 1, fp)==1;
+   ok = ok && fread(&m->R, sizeof(int), 1, fp)==1;
+
+   if(ok)
+   {
+      SPH refsph(m->r);
+
+      m->nref = refsph.n;
+      m->cm = (int *)calloc(3*m->NLM, sizeof(int));
+      m->ref = (float4 *)calloc((size_t)m->nref*m->NLM, sizeof(float4));
+
+      for(int n=0; n<m->NLM && ok; n++)
+      {
+         ok = fread(m->cm+3*n, sizeof(int), 3, fp)==3;
+         ok = ok && fread(m->ref+(size_t)n*m->nref, sizeof(float4), m->nref, fp)==(size_t)m->nref;
+      }
+   }
+
+   fclose(fp);
+   profile_end(stage);
+
+   if(!ok)
+   {
+      printf("Error reading %s, aborting ...\n", filename);
+      exit(1);
+   }
+
+   sprintf(m->filename,"%s",filename);
+   atlas_nmodel++;
+
+   return(m);
+}
+
+// Returns PILbrain.nii thresholded at CLOUD_THRESH: the voxels below the threshold are 0.
+const ATLASIMAGE *atlas_brain_mask()
+{
+   const ATLASIMAGE *cloud;
+   PACKENTRY *e;
+   int nv;
+
+   if(atlas_mask.v != NULL) return(&atlas_mask);
+
+   e = pack_entry(ATLAS_IMAGES[0], PACK_MASK);
+   if( e!=NULL && e->thresh==CLOUD_THRESH )
+   {
+      atlas_mask.hdr = e->hdr;
+      atlas_mask.v = (int2 *)(atlas_pack + e->offset);
+      atlas_mask.mapped = YES;
+   }
+   else
+   {
+      cloud = atlas_image(ATLAS_IMAGES[0]);
+
+      atlas_mask.hdr = cloud->hdr;
+      nv = cloud->hdr.dim[1]*cloud->hdr.dim[2]*cloud->hdr.dim[3];
+      atlas_mask.v = (int2 *)calloc(nv, sizeof(int2));
+      atlas_mask.mapped = NO;
+
+      for(int v=0; v<nv; v++) 
+         if(cloud->v[v]>=CLOUD_THRESH) atlas_mask.v[v]=cloud->v[v];
+   }
+
+   sprintf(atlas_mask.filename,"%s/%s",ARTHOME,ATLAS_IMAGES[0]);
+
+   return(&atlas_mask);
+}
+
+// Frees all cached atlas resources and unmaps the atlas pack.
+void free_atlases()
+{
+   for(int n=0; n<atlas_nimage; n++) 
+      if(!atlas_images[n].mapped) free(atlas_images[n].v);
+
+   for(int n=0; n<atlas_nmodel; n++) 
+      if(!atlas_models[n].mapped) { free(atlas_models[n].cm); free(atlas_models[n].ref); }
+
+   if(!atlas_mask.mapped) free(atlas_mask.v);
+   atlas_mask.v = NULL;
+
+   atlas_nimage = atlas_nmodel = 0;
+
+   if(atlas_pack!=NULL) munmap(atlas_pack, atlas_pack_size);
+   atlas_pack = NULL;
+}
+
+// Writes the data of an entry at the next multiple of PACKALIGN after offset and advances offset.
+// Returns 0 if the data could not be written.
+static int write_pack_data(FILE *fp, PACKENTRY &e, long long &offset, const void *data, long long size)
+{
+   e.offset = ((offset + PACKALIGN-1)/PACKALIGN)*PACKALIGN;
+   e.size = size;
+   offset = e.offset + size;
+
+   if( fseek(fp, e.offset, SEEK_SET)!=0 ) return(0);
+
+   return( fwrite(data, 1, size, fp) == (size_t)size );
+}
+
+// Compiles the resources of ATLAS_IMAGES and ATLAS_MODELS in $ARTHOME, and the thresholded
+// PIL brain cloud, into the atlas pack filename.  The pack is written to a temporary file that
+// is then renamed, so processes that have the previous pack mapped keep a consistent copy.
+void write_atlas_pack(const char *filename, int verbose)
+{
+   PACKHEADER h;
+   PACKENTRY e[2*MAXATLAS];
+   int n=0;
+   int ok=1;
+   long long offset;
+   char tmpfile[1024];
+   FILE *fp;
+
+   sprintf(tmpfile,"%s.tmp%d",filename,(int)getpid());
+
+   fp = fopen(tmpfile,"wb");
+   if(fp==NULL) file_open_error(tmpfile);
+
+   memset(e, 0, sizeof(e));
+   offset = sizeof(PACKHEADER) + sizeof(e);
+
+   for(int i=0; ATLAS_IMAGES[i]!=NULL; i++, n++)
+   {
+      const ATLASIMAGE *a = atlas_image(ATLAS_IMAGES[i]);
+
+      sprintf(e[n].name,"%s",ATLAS_IMAGES[i]);
+      e[n].type = PACK_IMAGE;
+      e[n].mtime = atlas_mtime(ATLAS_IMAGES[i]);
+      e[n].hdr = a->hdr;
+      ok = write_pack_data(fp, e[n], offset, a->v, nifti_voxels(e[n].hdr)*sizeof(int2)) && ok;
+
+      if(verbose) printf("%s: %d x %d x %d voxels\n", e[n].name, e[n].hdr.dim[1], e[n].hdr.dim[2], e[n].hdr.dim[3]);
+   }
+
+   {
+      const ATLASIMAGE *a = atlas_brain_mask();
+
+      sprintf(e[n].name,"%s",ATLAS_IMAGES[0]);
+      e[n].type = PACK_MASK;
+      e[n].thresh = CLOUD_THRESH;
+      e[n].mtime = atlas_mtime(ATLAS_IMAGES[0]);
+      e[n].hdr = a->hdr;
+      ok = write_pack_data(fp, e[n], offset, a->v, (long long)a->hdr.dim[1]*a->hdr.dim[2]*a->hdr.dim[3]*sizeof(int2)) && ok;
+
+      if(verbose) printf("%s thresholded at %d\n", e[n].name, CLOUD_THRESH);
+      n++;
+   }
+
+   for(int i=0; ATLAS_MODELS[i]!=NULL; i++, n++)
+   {
+      const LMMODEL *m = atlas_model(ATLAS_MODELS[i]);
+      long long refoffset = pack_ref_offset(m->NLM);
+      long long size = refoffset + (long long)m->nref*m->NLM*sizeof(float4);
+      char *data = (char *)calloc(size, 1);
+
+      memcpy(data, m->cm, 3*m->NLM*sizeof(int));
+      memcpy(data + refoffset, m->ref, (size_t)m->nref*m->NLM*sizeof(float4));
+
+      sprintf(e[n].name,"%s",ATLAS_MODELS[i]);
+      e[n].type = PACK_MODEL;
+      e[n].mtime = atlas_mtime(ATLAS_MODELS[i]);
+      e[n].NLM = m->NLM;
+      e[n].r = m->r;
+      e[n].R = m->R;
+      e[n].nref = m->nref;
+      ok = write_pack_data(fp, e[n], offset, data, size) && ok;
+
+      free(data);
+
+      if(verbose) printf("%s: %d landmarks\n", e[n].name, m->NLM);
+   }
+
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+   h.version = PACK_VERSION;
+   h.byteorder = PACK_BYTEORDER;
+   h.entrysize = sizeof(PACKENTRY);
+   h.nentry = n;
+   h.filesize = offset;
+
+   ok = ok && fseek(fp, 0, SEEK_SET)==0 && fwrite(&h, sizeof(h), 1, fp)==1 && 
+   fwrite(e, sizeof(PACKENTRY), n, fp)==(size_t)n;
+
+   if( fclose(fp)!=0 ) ok = 0;
+
+   if( !ok || rename(tmpfile, filename)!=0 )
+   {
+      printf("Error writing %s, aborting ...\n", filename);
+      remove(tmpfile);
+      exit(1);
+   }
+
+   if(verbose) printf("Atlas pack: %s (%lld bytes)\n", filename, offset);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Parallel gzip
+//
+// write_nifti_gz() writes a .nii.gz image as a series of gzip members, one for the header and 
+// one for every GZBLOCK bytes of voxels, compressed in parallel by the given number of threads.
+// A series of members is a standard gzip file (RFC 1952), which gunzip, zlib and the NIFTI 
+// libraries read as a whole.  As in the BGZF format, each member has an extra field (subfield 
+// "KB") holding its size, so that gunzip_file() finds the members of such a file without 
+// decompressing it and inflates them in parallel.  Other gzip files are inflated in a single 
+// pass while the kernel reads them ahead.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define GZHEADER 20 // bytes of a member header with the "KB" extra field
+#define GZTRAILER 8 // CRC-32 and size of the uncompressed data
+
+static inline void put_le32(unsigned char *p, unsigned int x)
+{
+   p[0]=x; p[1]=x>>8; p[2]=x>>16; p[3]=x>>24;
+}
+
+static inline unsigned int get_le32(const unsigned char *p)
+{
+   return( p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24) );
+}
+
+// Compresses the size bytes of data into a gzip member with the "KB" extra field.  Returns the 
+// member (allocated) and its size in *msize, or NULL on error.
+static unsigned char *gz_member(const unsigned char *data, size_t size, size_t *msize)
+{
+   z_stream z;
+   unsigned char *m;
+   size_t room = GZHEADER + compressBound(size) + GZTRAILER;
+
+   m = (unsigned char *)malloc(room);
+   if(m==NULL) return(NULL);
+
+   memset(&z, 0, sizeof(z));
+   if( deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+   {
+      free(m);
+      return(NULL);
+   }
+
+   z.next_in = (Bytef *)data;
+   z.avail_in = size;
+   z.next_out = m + GZHEADER;
+   z.avail_out = room - GZHEADER - GZTRAILER;
+
+   if( deflate(&z, Z_FINISH) != Z_STREAM_END )
+   {
+      deflateEnd(&z);
+      free(m);
+      return(NULL);
+   }
+
+   *msize = GZHEADER + z.total_out + GZTRAILER;
+   deflateEnd(&z);
+
+   memset(m, 0, GZHEADER);
+   m[0]=0x1f; m[1]=0x8b; m[2]=Z_DEFLATED; m[3]=4; // FEXTRA
+   m[9]=255; // unknown OS
+   m[10]=8;  // extra field length
+   m[12]='K'; m[13]='B'; m[14]=4;
+   put_le32(m+16, *msize);
+
+   put_le32(m + *msize - 8, crc32(0L, data, size));
+   put_le32(m + *msize - 4, size);
+
+   return(m);
+}
+
+// Writes the int2 image v with header hdr to the .nii.gz file filename, compressing it with 
+// nthreads threads.  Returns 0 if the file could not be written.  It does not report errors or 
+// exit, so that it can run in a background thread.
+int write_nifti_gz(const char *filename, int2 *v, nifti_1_header *hdr, int nthreads)
+{
+   nifti_1_header h = *hdr;
+   unsigned char niihdr[352]; // header and empty extension
+   size_t voxbytes;
+   int nblock;
+   unsigned char **member;
+   size_t *msize;
+   int error=NO;
+   FILE *fp;
+
+   h.sizeof_hdr = 348;
+   h.dim[0] = 3;
+   h.datatype = DT_INT16;
+   h.bitpix = 16;
+   h.vox_offset = 352;
+   memcpy(h.magic, "n+1", 4);
+
+   memset(niihdr, 0, sizeof(niihdr));
+   memcpy(niihdr, &h, sizeof(h));
+
+   voxbytes = (size_t)h.dim[1]*h.dim[2]*h.dim[3]*sizeof(int2);
+   nblock = 1 + (voxbytes + GZBLOCK-1)/GZBLOCK;
+
+   member = (unsigned char **)calloc(nblock, sizeof(unsigned char *));
+   msize = (size_t *)calloc(nblock, sizeof(size_t));
+
+   #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+   for(int b=0; b<nblock; b++)
+   {
+      if(b==0)
+         member[b] = gz_member(niihdr, sizeof(niihdr), msize+b);
+      else
+      {
+         size_t offset = (size_t)(b-1)*GZBLOCK;
+         size_t size = voxbytes-offset < GZBLOCK ? voxbytes-offset : GZBLOCK;
+
+         member[b] = gz_member((unsigned char *)v + offset, size, msize+b);
+      }
+
+      if(member[b]==NULL)
+      {
+         #pragma omp atomic write
+         error = YES;
+      }
+   }
+
+   fp = NULL;
+   if(!error) 
+   {
+      fp = fopen(filename, "wb");
+      if(fp==NULL) error=YES;
+   }
+
+   for(int b=0; b<nblock; b++)
+   {
+      if(!error && fwrite(member[b], 1, msize[b], fp)!=msize[b]) error=YES;
+      free(member[b]);
+   }
+
+   if( fp!=NULL && fclose(fp)!=0 ) error=YES;
+
+   free(member);
+   free(msize);
+
+   return(!error);
+}
+
+// Returns the size of the member with the "KB" extra field at p, of at most left bytes, or 0 if
+// there is none.
+static size_t kb_member(const unsigned char *p, size_t left)
+{
+   size_t n;
+
+   if( left < GZHEADER+GZTRAILER ) return(0);
+   if( p[0]!=0x1f || p[1]!=0x8b || p[2]!=Z_DEFLATED || p[3]!=4 ) return(0);
+   if( p[10]!=8 || p[11]!=0 || p[12]!='K' || p[13]!='B' || p[14]!=4 || p[15]!=0 ) return(0);
+
+   n = get_le32(p+16);
+   if( n < GZHEADER+GZTRAILER || n > left ) return(0);
+
+   return(n);
+}
+
+// Inflates the members of a file written by write_nifti_gz() in parallel.  Returns NULL if p is
+// not such a file or cannot be decompressed.
+static unsigned char *gunzip_members(const unsigned char *p, size_t size, size_t *outsize)
+{
+   int nmember=0;
+   size_t pos, n;
+   size_t *moffset, *uoffset;
+   unsigned char *out;
+   int error=NO;
+
+   for(pos=0; pos<size; pos+=n, nmember++)
+      if( (n=kb_member(p+pos, size-pos))==0 ) return(NULL);
+
+   if(nmember==0) return(NULL);
+
+   moffset = (size_t *)calloc(nmember+1, sizeof(size_t));
+   uoffset = (size_t *)calloc(nmember+1, sizeof(size_t));
+
+   for(int m=0; m<nmember; m++)
+   {
+      n = kb_member(p+moffset[m], size-moffset[m]);
+      moffset[m+1] = moffset[m] + n;
+      uoffset[m+1] = uoffset[m] + get_le32(p+moffset[m+1]-4);
+   }
+
+   out = (unsigned char *)malloc(uoffset[nmember]>0 ? uoffset[nmember] : 1);
+
+   #pragma omp parallel for schedule(dynamic) num_threads(opt_threads)
+   for(int m=0; m<nmember; m++)
+   {
+      z_stream z;
+      const unsigned char *q = p + moffset[m];
+      size_t usize = uoffset[m+1]-uoffset[m];
+      int ok;
+
+      memset(&z, 0, sizeof(z));
+      ok = out!=NULL && inflateInit2(&z, -15)==Z_OK;
+
+      if(ok)
+      {
+         z.next_in = (Bytef *)q + GZHEADER;
+         z.avail_in = moffset[m+1] - moffset[m] - GZHEADER - GZTRAILER;
+         z.next_out = out + uoffset[m];
+         z.avail_out = usize;
+
+         ok = inflate(&z, Z_FINISH)==Z_STREAM_END && z.avail_out==0 && 
+         crc32(0L, out+uoffset[m], usize)==get_le32(q + moffset[m+1]-moffset[m] - 8);
+
+         inflateEnd(&z);
+      }
+
+      if(!ok)
+      {
+         #pragma omp atomic write
+         error = YES;
+      }
+   }
+
+   *outsize = uoffset[nmember];
+
+   free(moffset);
+   free(uoffset);
+
+   if(error)
+   {
+      free(out);
+      return(NULL);
+   }
+
+   return(out);
+}
+
+// Inflates the gzip file p, of one or more members, in a single pass.  Returns NULL on error.
+static unsigned char *gunzip_stream(const unsigned char *p, size_t size, size_t *outsize)
+{
+   z_stream z;
+   unsigned char *out;
+   size_t room;
+   size_t n=0;
+   int ret;
+
+   if(size < 18) return(NULL);
+
+   // the size of the last member, which is all of the data of most files
+   room = get_le32(p+size-4);
+   if(room < 352) room = 352;
+
+   out = (unsigned char *)malloc(room);
+   if(out==NULL) return(NULL);
+
+   memset(&z, 0, sizeof(z));
+   if( inflateInit2(&z, 15+16)!=Z_OK )
+   {
+      free(out);
+      return(NULL);
+   }
+
+   z.next_in = (Bytef *)p;
+   z.avail_in = size;
+
+   for(;;)
+   {
+      if(n==room)
+      {
+         unsigned char *grown = (unsigned char *)realloc(out, 2*room);
+         if(grown==NULL) break;
+         out = grown;
+         room *= 2;
+      }
+
+      z.next_out = out + n;
+      z.avail_out = room - n;
+
+      ret = inflate(&z, Z_NO_FLUSH);
+      n = z.next_out - out;
+
+      if(ret==Z_STREAM_END)
+      {
+         // a following member
+         if( z.avail_in>=2 && z.next_in[0]==0x1f && z.next_in[1]==0x8b )
+         {
+            inflateReset(&z);
+            continue;
+         }
+
+         inflateEnd(&z);
+         *outsize = n;
+         return(out);
+      }
+
+      if( ret!=Z_OK && !(ret==Z_BUF_ERROR && n==room) ) break;
+   }
+
+   inflateEnd(&z);
+   free(out);
+
+   return(NULL);
+}
+
+// Decompresses the gzip file p of size bytes.  Returns the data (allocated) and its size in
+// *outsize, or NULL on error.
+unsigned char *gunzip_file(const unsigned char *p, size_t size, size_t *outsize)
+{
+   unsigned char *out;
+
+   out = gunzip_members(p, size, outsize);
+   if(out==NULL) out = gunzip_stream(p, size, outsize);
+
+   return(out);
+}
+
+// Writes the output image v: with write_nifti_gz() on nthreads threads if filename ends with .gz 
+// (-gz), otherwise with save_nifti_image().  Returns 0 if it could not be written.
+int save_output_image(const char *filename, int2 *v, nifti_1_header *hdr, int nthreads)
+{
+   size_t n = strlen(filename);
+   struct stat st;
+
+   if( n>3 && strcmp(filename+n-3, ".gz")==0 )
+      return( write_nifti_gz(filename, v, hdr, nthreads) );
+
+   // save_nifti_image() does not return a status: the new file must hold the header and all 
+   // voxels
+   remove(filename);
+   save_nifti_image(filename, v, hdr);
+
+   return( stat(filename, &st)==0 && S_ISREG(st.st_mode) && 
+   (long long)st.st_size >= 348 + (long long)hdr->dim[1]*hdr->dim[2]*hdr->dim[3]*sizeof(int2) );
+}
+
+// Sets filename to the name of the output image <prefix><suffix>.nii, or .nii.gz with -gz.
+void output_image_name(char *filename, const char *prefix, const char *suffix)
+{
+   sprintf(filename, "%s%s.nii%s", prefix, suffix, opt_gz ? ".gz" : "");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Asynchronous outputs
+//
+// The transformations (<prefix>_PIL.mrx) and images (<prefix>_PIL, _RHROI and _LHROI) saved by 
+// KAIBA are results for the user: the later stages of a run receive them in memory and never 
+// read them back.  queue_output_matrix() and queue_output_image() copy an output and write it
+// in a thread of its own while the run continues, and finish_outputs() waits until all of them
+// are written and reports those that could not be.  With -nosave they are not written at all.
+//
+// An output thread compresses a .nii.gz image on a single thread: several outputs are written at
+// once, and an OpenMP team of opt_threads started from each of them would compete with each
+// other and with the team of the main thread.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct OUTPUTJOB
+{
+   char filename[1024];
+   char comment[1024]; // first line of a matrix file
+   float4 T[16];
+   int2 *v;            // voxels of an image, or NULL for a matrix
+   nifti_1_header hdr;
+   int threads;        // threads compressing a .nii.gz image
+   int error;          // set if the output could not be written
+   pthread_t thread;
+};
+
+OUTPUTJOB *output_jobs[MAXOUTPUTS];
+int output_njob=0;
+
+static void *write_output(void *arg)
+{
+   OUTPUTJOB *job = (OUTPUTJOB *)arg;
+   FILE *fp;
+
+   if(job->v != NULL)
+   {
+      if( !save_output_image(job->filename, job->v, &job->hdr, job->threads) ) job->error=YES;
+      return(NULL);
+   }
+
+   fp = fopen(job->filename,"w");
+   if(fp == NULL)
+   {
+      job->error=YES;
+      return(NULL);
+   }
+
+   fprintf(fp,"%s",job->comment);
+   printMatrix(job->T, 4, 4, "", fp);
+   if( ferror(fp) ) job->error=YES;
+   if( fclose(fp)!=0 ) job->error=YES;
+
+   return(NULL);
+}
+
+// Waits until all queued outputs are written.  Exits if any of them could not be written.
+void finish_outputs()
+{
+   int error=NO;
+
+   for(int n=0; n<output_njob; n++)
+   {
+      pthread_join(output_jobs[n]->thread, NULL);
+
+      if(output_jobs[n]->error)
+      {
+         printf("Error writing %s\n", output_jobs[n]->filename);
+         error=YES;
+      }
+
+      free(output_jobs[n]->v);
+      free(output_jobs[n]);
+   }
+
+   output_njob=0;
+
+   if(error)
+   {
+      printf("Could not write all outputs, aborting ...\n");
+      exit(1);
+   }
+}
+
+static void start_output(OUTPUTJOB *job)
+{
+   if(output_njob >= MAXOUTPUTS) finish_outputs();
+
+   job->threads = 1;
+   if( pthread_create(&job->thread, NULL, write_output, job) != 0 )
+   {
+      // written now instead, on the main thread
+      job->threads = opt_threads;
+      write_output(job);
+
+      if(job->error)
+      {
+         printf("Error writing %s, aborting ...\n", job->filename);
+         exit(1);
+      }
+
+      free(job->v);
+      free(job);
+      return;
+   }
+
+   output_jobs[output_njob++] = job;
+}
+
+// Writes the 4x4 matrix T to filename, after the line comment, in the background.
+void queue_output_matrix(const char *filename, const char *comment, float4 *T)
+{
+   OUTPUTJOB *job;
+
+   if(opt_nosave) return;
+
+   job = (OUTPUTJOB *)calloc(1, sizeof(OUTPUTJOB));
+   sprintf(job->filename,"%s",filename);
+   sprintf(job->comment,"%s",comment);
+   for(int i=0; i<16; i++) job->T[i]=T[i];
+
+   start_output(job);
+}
+
+// Writes the image v with header hdr to filename (see save_output_image()) in the background.
+// v may be changed or freed as soon as this returns.
+void queue_output_image(const char *filename, int2 *v, nifti_1_header *hdr)
+{
+   OUTPUTJOB *job;
+   size_t nv;
+
+   if(opt_nosave) return;
+
+   nv = (size_t)hdr->dim[1]*hdr->dim[2]*hdr->dim[3];
+
+   job = (OUTPUTJOB *)calloc(1, sizeof(OUTPUTJOB));
+   sprintf(job->filename,"%s",filename);
+   job->hdr = *hdr;
+   job->v = (int2 *)malloc(nv*sizeof(int2));
+   memcpy(job->v, v, nv*sizeof(int2));
+
+   start_output(job);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Memory-mapped input images
+//
+// map_nifti_image() returns the voxels of an uncompressed single-file NIFTI image (.nii) of 
+// int2 voxels in the native byte order directly from a mapping of the file, starting at 
+// vox_offset, so they are neither read nor copied.  Read-only views of the same file share a 
+// single mapping: the baseline and follow-up images, which are opened several times in a run, 
+// are mapped once.  A writable view is a private copy-on-write mapping of its own, in which only
+// the pages the caller modifies are copied; the file is never changed.  
+//
+// A gzipped image (.nii.gz) is decompressed by gunzip_file() once per run: its data is kept in
+// the table until free_image_maps(), read-only views share it, and a writable view is a copy.
+// Any other image (.hdr/.img, other datatypes or byte order, scaled voxels) is read with 
+// read_nifti_image().  Every view is released with release_nifti_image().  The table is not 
+// thread safe; it is used from the main thread only.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct IMAGEMAP
+{
+   dev_t dev;
+   ino_t ino;
+   long long mtime;
+   long long filesize;
+   char *base;  // the mapped file, or the decompressed data of a gzipped file
+   size_t size; // bytes at base
+   int2 *v;     // the voxels, at base + vox_offset
+   int shared;  // read-only data shared by nref views; otherwise a private writable view
+   int gz;      // decompressed data, kept until free_image_maps()
+   int nref;
+};
+
+IMAGEMAP image_maps[MAXIMAGEMAPS];
+int image_nmap=0;
+
+// Returns 1 if hdr, read from the beginning of a file of size bytes, is the header of a 
+// single-file NIFTI-1 image whose int2 voxels can be used as they are in the file.
+static int mappable_nifti_header(nifti_1_header &hdr, size_t size)
+{
+   int offset;
+
+   if( hdr.sizeof_hdr != 348 ) return(0); // compressed or in the other byte order
+   if( memcmp(hdr.magic, "n+1", 4) != 0 ) return(0);
+   if( hdr.datatype != DT_INT16 || hdr.bitpix != 16 ) return(0);
+   if( hdr.scl_slope != 0.0 && (hdr.scl_slope != 1.0 || hdr.scl_inter != 0.0) ) return(0);
+   if( hdr.dim[0]<3 || hdr.dim[0]>7 || hdr.dim[1]<1 || hdr.dim[2]<1 || hdr.dim[3]<1 ) return(0);
+
+   offset = (int)hdr.vox_offset;
+   if( offset != hdr.vox_offset || offset < 352 || offset%sizeof(int2) != 0 ) return(0);
+
+   return( offset + nifti_voxels(hdr)*sizeof(int2) <= size );
+}
+
+// Returns a writable copy of the voxels of m.
+static int2 *copy_image_map(IMAGEMAP *m)
+{
+   size_t n = m->size - ((char *)m->v - m->base);
+   int2 *v = (int2 *)malloc(n);
+
+   if(v!=NULL) memcpy(v, m->v, n);
+
+   return(v);
+}
+
+// Adds a view of base to the table and returns it.
+static IMAGEMAP *add_image_map(struct stat &st, char *base, size_t size, nifti_1_header &hdr, int shared, int gz)
+{
+   IMAGEMAP *m = image_maps + image_nmap++;
+
+   m->dev = st.st_dev;
+   m->ino = st.st_ino;
+   m->mtime = (long long)st.st_mtime;
+   m->filesize = (long long)st.st_size;
+   m->base = base;
+   m->size = size;
+   m->v = (int2 *)(base + (int)hdr.vox_offset);
+   m->shared = shared;
+   m->gz = gz;
+   m->nref = 0;
+
+   return(m);
+}
+
+// Returns the voxels of the NIFTI image filename and its header in hdr, or NULL if it cannot be
+// read.  The voxels must not be modified unless writable is YES.
+int2 *map_nifti_image(const char *filename, nifti_1_header *hdr, int writable)
+{
+   int fd;
+   struct stat st;
+   IMAGEMAP *m;
+   char *p;
+
+   fd = open(filename, O_RDONLY);
+
+   if( fd>=0 && fstat(fd, &st)==0 && (size_t)st.st_size >= 18 )
+   {
+      for(int n=0; n<image_nmap; n++)
+      {
+         m = image_maps + n;
+
+         if( !m->shared || m->dev!=st.st_dev || m->ino!=st.st_ino || m->mtime!=(long long)st.st_mtime || 
+         m->filesize!=(long long)st.st_size ) continue;
+
+         if( writable && !m->gz ) continue;
+
+         close(fd);
+         memcpy(hdr, m->base, sizeof(nifti_1_header));
+
+         if(writable) return( copy_image_map(m) );
+
+         m->nref++;
+         return(m->v);
+      }
+
+      if(image_nmap<MAXIMAGEMAPS)
+      {
+         if(writable)
+            p = (char *)mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+         else
+            p = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      }
+      else p = (char *)MAP_FAILED;
+
+      if( p!=MAP_FAILED && (unsigned char)p[0]==0x1f && (unsigned char)p[1]==0x8b )
+      {
+         unsigned char *data;
+         size_t size;
+
+         madvise(p, st.st_size, MADV_SEQUENTIAL);
+         madvise(p, st.st_size, MADV_WILLNEED);
+
+         data = gunzip_file((unsigned char *)p, st.st_size, &size);
+         munmap(p, st.st_size);
+         p = (char *)MAP_FAILED;
+
+         if( data!=NULL && size>=348 )
+         {
+            memcpy(hdr, data, sizeof(nifti_1_header));
+
+            if( mappable_nifti_header(*hdr, size) )
+            {
+               close(fd);
+
+               m = add_image_map(st, (char *)data, size, *hdr, YES, YES);
+
+               if(writable) return( copy_image_map(m) );
+
+               m->nref++;
+               return(m->v);
+            }
+         }
+
+         free(data);
+      }
+
+      if(p!=MAP_FAILED)
+      {
+         if( (size_t)st.st_size >= 348 ) memcpy(hdr, p, sizeof(nifti_1_header));
+
+         if( (size_t)st.st_size >= 348 && mappable_nifti_header(*hdr, st.st_size) )
+         {
+            close(fd);
+
+            m = add_image_map(st, p, st.st_size, *hdr, !writable, NO);
+            m->nref = 1;
+
+            // the whole image is used; start reading it in the background
+            madvise(p, st.st_size, MADV_WILLNEED);
+
+            return(m->v);
+         }
+
+         munmap(p, st.st_size);
+      }
+   }
+
+   if(fd>=0) close(fd);
+
+   return( (int2 *)read_nifti_image(filename, hdr) );
+}
+
+// Releases v, returned by map_nifti_image().
+void release_nifti_image(int2 *v)
+{
+   IMAGEMAP *m;
+
+   if(v==NULL) return;
+
+   for(int n=0; n<image_nmap; n++)
+   {
+      m = image_maps + n;
+
+      if(m->v != v) continue;
+
+      if( --m->nref > 0 || m->gz ) return;
+
+      munmap(m->base, m->size);
+      image_maps[n] = image_maps[--image_nmap];
+      return;
+   }
+
+   free(v);
+}
+
+// Frees the decompressed images kept by map_nifti_image() and any views not yet released.
+void free_image_maps()
+{
+   for(int n=0; n<image_nmap; n++)
+   {
+      if(image_maps[n].gz) free(image_maps[n].base);
+      else munmap(image_maps[n].base, image_maps[n].size);
+   }
+
+   image_nmap = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// partial sums of one slice in the NCC cost function
+struct NCCSUMS
+{
+   float8 sum1, sum2, sum11, sum22, sum12;
+   int n;
+};
+
+// A run of consecutive masked voxels (i0,j,k) to (i1,j,k) on one row of an image.
+struct SPAN
+{
+   int j;
+   int i0, i1;
+   int vstart; // index of voxel (i0,j,k) in MASKSPANS::val
+};
+
+// An image as sampled by the fast row kernels: the float image im and, with -fixed16, its 16-bit
+// fixed-point copy qim (im = qscale*qim).  With -brick, im and qim are stored in the bricked 
+// layout of brick_image() and nbx, nby give the number of bricks along x and y; otherwise
+// nbx=nby=0 and the layout is that of the original image.
+struct ROWSOURCE
+{
+   DIM dim;
+   float4 *im;
+   int2 *qim;
+   float4 qscale;
+   int nbx, nby;
+};
+
+// Run-length representation of the masked voxels of an image, computed once per registration 
+// so that the cost functions visit only the masked voxels.  Spans are stored in k, j, i order
+// and slice k owns spans first[k] to first[k+1]-1.  val holds the image intensities of the 
+// masked voxels packed in span order.  The prefix sums give the sums of val and val^2 over 
+// any part of a span in closed form.  src is the image the spans were built from; its
+// buffers are not owned by the spans.
+struct MASKSPANS
+{
+   int nz;
+   int nspan;
+   int nval;
+   int *first; // nz+1 entries
+   SPAN *span;
+   float4 *val;
+   float4 max;    // largest value of val
+   float8 *sum;   // sum[n] = val[0] + ... + val[n-1] (nval+1 entries)
+   float8 *sumsq; // the same for val^2
+   int *order;    // slices in the order visited by the bounded SSD (see ssd_cost_function_batch())
+   ROWSOURCE src;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Computes the prefix sums of s.val
+static void mask_span_prefix_sums(MASKSPANS &s)
+{
+   s.sum = (float8 *)calloc(s.nval+1, sizeof(float8));
+   s.sumsq = (float8 *)calloc(s.nval+1, sizeof(float8));
+
+   for(int n=0; n<s.nval; n++)
+   {
+      s.sum[n+1] = s.sum[n] + s.val[n];
+      s.sumsq[n+1] = s.sumsq[n] + s.val[n]*s.val[n];
+   }
+}
+
+// Builds the spans of voxels with msk>0 and packs the corresponding intensities of im.
+void build_mask_spans(int2 *msk, float4 *im, DIM dim, MASKSPANS &s)
+{
+   int v;
+
+   // count spans and masked voxels
+   s.nspan = s.nval = 0;
+   for(int k=0; k<dim.nz; k++)
+   for(int j=0; j<dim.ny; j++)
+   for(int i=0; i<dim.nx; i++)
+   {
+      v = k*dim.np + j*dim.nx + i;
+      if( msk[v]>0 )
+      {
+         s.nval++;
+         if( i==0 || msk[v-1]<=0 ) s.nspan++;
+      }
+   }
+
+   s.nz = dim.nz;
+   s.first = (int *)calloc(dim.nz+1, sizeof(int));
+   s.span = (SPAN *)calloc(s.nspan>0 ? s.nspan : 1, sizeof(SPAN));
+   s.val = (float4 *)calloc(s.nval>0 ? s.nval : 1, sizeof(float4));
+
+   s.nspan = s.nval = 0;
+   for(int k=0; k<dim.nz; k++)
+   {
+      s.first[k] = s.nspan;
+      for(int j=0; j<dim.ny; j++)
+      for(int i=0; i<dim.nx; i++)
+      {
+         v = k*dim.np + j*dim.nx + i;
+         if( msk[v]>0 )
+         {
+            if( i==0 || msk[v-1]<=0 )
+            {
+               s.span[s.nspan].j = j;
+               s.span[s.nspan].i0 = i;
+               s.span[s.nspan].vstart = s.nval;
+               s.nspan++;
+            }
+            s.span[s.nspan-1].i1 = i;
+            s.val[s.nval++] = im[v];
+         }
+      }
+   }
+   s.first[dim.nz] = s.nspan;
+
+   s.max = 0.0;
+   for(int n=0; n<s.nval; n++) if(s.val[n]>s.max) s.max=s.val[n];
+
+   s.src.dim = dim;
+   s.src.im = im;
+   s.src.qim = NULL;
+   s.src.qscale = 1.0;
+   s.src.nbx = s.src.nby = 0;
+
+   s.order = (int *)calloc(dim.nz, sizeof(int));
+   for(int k=0; k<dim.nz; k++) s.order[k]=k;
+
+   mask_span_prefix_sums(s);
+}
+
+void free_mask_spans(MASKSPANS &s)
+{
+   free(s.first);
+   free(s.span);
+   free(s.val);
+   free(s.sum);
+   free(s.sumsq);
+   free(s.order);
+}
+
+// Returns a 16-bit fixed-point copy q of image im, such that im[v] = scale*q[v] within scale/2.
+// q has one voxel of padding after the end of the image, set to 0.
+int2 *fixed16_image(float4 *im, DIM dim, float4 &scale)
+{
+   int2 *q;
+   float4 max=0.0;
+
+   for(int v=0; v<dim.nv; v++) 
+      if( fabsf(im[v]) > max ) max = fabsf(im[v]);
+
+   scale = (max>0.0) ? max/32767.0 : 1.0;
+
+   q = (int2 *)calloc(dim.nv+1, sizeof(int2));
+   for(int v=0; v<dim.nv; v++) q[v] = (int2)lrintf(im[v]/scale);
+
+   return(q);
+}
+
+// Index in the bricked layout of brick_image() of the first corner, voxel (i,j,k), of cell (i,j,k)
+static inline int brick_index(int i, int j, int k, int nbx, int nby)
+{
+   int brick = ((k>>BRICKSHIFT)*nby + (j>>BRICKSHIFT))*nbx + (i>>BRICKSHIFT);
+   int cell = ((k&(BRICK-1))*(BRICK+1) + (j&(BRICK-1)))*(BRICK+1) + (i&(BRICK-1));
+
+   return( brick*BRICKSIZE + cell );
+}
+
+// Returns a copy of image im in a bricked layout.  The interpolation cells of the image are 
+// grouped in bricks of BRICKxBRICKxBRICK cells, and each brick stores the (BRICK+1)^3 voxels of 
+// its cells contiguously, so the 8 corners of any cell are in the same brick at the fixed 
+// offsets 1, BRICK+1 and (BRICK+1)^2.  Points sampled along an oblique line then stay within
+// a few pages.  Voxels beyond the image are 0, and the copy has one voxel of padding.
+template <class T>
+T *brick_image(T *im, DIM dim, int &nbx, int &nby)
+{
+   int nbz;
+   T *b;
+
+   nbx = (dim.nx + BRICK-1)/BRICK;
+   nby = (dim.ny + BRICK-1)/BRICK;
+   nbz = (dim.nz + BRICK-1)/BRICK;
+
+   b = (T *)calloc((size_t)nbx*nby*nbz*BRICKSIZE+1, sizeof(T));
+
+   for(int bk=0; bk<nbz; bk++)
+   for(int bj=0; bj<nby; bj++)
+   for(int bi=0; bi<nbx; bi++)
+   {
+      T *brick = b + ((size_t)(bk*nby + bj)*nbx + bi)*BRICKSIZE;
+
+      for(int k=0; k<=BRICK; k++)
+      for(int j=0; j<=BRICK; j++)
+      for(int i=0; i<=BRICK; i++)
+      {
+         int x = bi*BRICK+i, y = bj*BRICK+j, z = bk*BRICK+k;
+
+         if( x<dim.nx && y<dim.ny && z<dim.nz )
+            brick[(k*(BRICK+1) + j)*(BRICK+1) + i] = im[z*dim.np + y*dim.nx + x];
+      }
+   }
+
+   return(b);
+}
+
+// Converts the images of src to the bricked layout.  The bricked buffers are allocated here
+// and must be freed by the caller, along with any fixed-point image.
+void brick_row_source(ROWSOURCE &src)
+{
+   int2 *q;
+
+   src.im = brick_image(src.im, src.dim, src.nbx, src.nby);
+
+   if(src.qim != NULL)
+   {
+      q = src.qim;
+      src.qim = brick_image(q, src.dim, src.nbx, src.nby);
+      free(q);
+   }
+}
+
+// Builds the spans of the voxels of im within msk that the cost functions visit, with the
+// fixed-point (-fixed16) and bricked (-brick) copies of im if selected.
+void build_cost_spans(int2 *msk, float4 *im, DIM dim, MASKSPANS &s)
+{
+   build_mask_spans(msk, im, dim, s);
+
+   if(opt_fixed16) s.src.qim = fixed16_image(im, dim, s.src.qscale);
+   if(opt_brick) brick_row_source(s.src);
+}
+
+// Frees the spans built by build_cost_spans() from image im.
+void free_cost_spans(MASKSPANS &s, float4 *im)
+{
+   if(s.src.im != im) free(s.src.im);
+   free(s.src.qim);
+   free_mask_spans(s);
+}
+
+// Returns a pseudo-random number in [0,1) that depends only on seed and n.
+static inline float8 voxel_random(unsigned int seed, unsigned int n)
+{
+   unsigned int h;
+
+   h = n*2654435761u ^ seed;
+   h ^= h>>16;
+   h *= 0x85ebca6bu;
+   h ^= h>>13;
+   h *= 0xc2b2ae35u;
+   h ^= h>>16;
+
+   return( h/4294967296.0 );
+}
+
+// Builds in sample the spans of a fixed random subset of about fraction*s.nval of the masked 
+// voxels in s.  The subset depends only on seed, and the subset for a given fraction contains 
+// those of all smaller fractions.
+void sample_mask_spans(MASKSPANS &s, float4 fraction, unsigned int seed, MASKSPANS &sample)
+{
+   int n, prev;
+
+   // count spans and voxels of the sample
+   sample.nspan = sample.nval = 0;
+   for(int sp=0; sp<s.nspan; sp++)
+   {
+      prev=NO;
+      for(int i=s.span[sp].i0; i<=s.span[sp].i1; i++)
+      {
+         n = s.span[sp].vstart + i - s.span[sp].i0;
+         if( voxel_random(seed, n) < fraction )
+         {
+            sample.nval++;
+            if(!prev) sample.nspan++;
+            prev=YES;
+         }
+         else prev=NO;
+      }
+   }
+
+   sample.nz = s.nz;
+   sample.first = (int *)calloc(s.nz+1, sizeof(int));
+   sample.span = (SPAN *)calloc(sample.nspan>0 ? sample.nspan : 1, sizeof(SPAN));
+   sample.val = (float4 *)calloc(sample.nval>0 ? sample.nval : 1, sizeof(float4));
+
+   sample.nspan = sample.nval = 0;
+   for(int k=0; k<s.nz; k++)
+   {
+      sample.first[k] = sample.nspan;
+      for(int sp=s.first[k]; sp<s.first[k+1]; sp++)
+      {
+         prev=NO;
+         for(int i=s.span[sp].i0; i<=s.span[sp].i1; i++)
+         {
+            n = s.span[sp].vstart + i - s.span[sp].i0;
+            if( voxel_random(seed, n) < fraction )
+            {
+               if(!prev)
+               {
+                  sample.span[sample.nspan].j = s.span[sp].j;
+                  sample.span[sample.nspan].i0 = i;
+                  sample.span[sample.nspan].vstart = sample.nval;
+                  sample.nspan++;
+               }
+               sample.span[sample.nspan-1].i1 = i;
+               sample.val[sample.nval++] = s.val[n];
+               prev=YES;
+            }
+            else prev=NO;
+         }
+      }
+   }
+   sample.first[s.nz] = sample.nspan;
+   sample.src = s.src;
+   sample.max = s.max;
+
+   sample.order = (int *)calloc(s.nz, sizeof(int));
+   for(int k=0; k<s.nz; k++) sample.order[k]=k;
+
+   mask_span_prefix_sums(sample);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Fast row kernels
+//
+// With -simd, each span of the cost functions is handled by a row kernel.  A row kernel first
+// clips the span analytically to the voxels whose transformed coordinates fall inside the other
+// image (clip_row), adds the contribution of the voxels outside in closed form from the prefix 
+// sums of the span list, and then interpolates the inside voxels without any bounds checks:
+// 8 (AVX2) or 16 (AVX-512) at a time, where the trilinear corners are gathered, blended and
+// accumulated in vector registers.  The instruction set is chosen at run time, so the same
+// binary runs on CPUs without these extensions, using a branch-free scalar row kernel instead.
+//
+// A row kernel samples the source image src at the voxels i=i0..i1 of a span, at coordinates 
+// x = A[0]*(i-c) + B[0], y = A[1]*(i-c) + B[1], z = A[2]*(i-c) + B[2], with the 
+// same convention as linearInterpolator(): points outside [0,nx-1]x[0,ny-1]x[0,nz-1] give 0.
+// If src->qim is not NULL (-fixed16), the kernel samples the 16-bit fixed-point copy of the 
+// image, which halves the memory traffic of the interpolation.  The corner pairs (v, v+1) 
+// are then read together, 32 bits at a time.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Sums accumulated by an NCC row kernel: sum1 and sum11 refer to the packed intensities,
+// sum2 and sum22 to the interpolated intensities and sum12 to their product.
+typedef void (*NCCROWKERNEL)(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src, NCCSUMS &r);
+typedef float8 (*SSDROWKERNEL)(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src);
+
+// NULL selects the reference code, which calls linearInterpolator() for every voxel
+SSDROWKERNEL ssd_row_kernel=NULL;
+NCCROWKERNEL ncc_row_kernel=NULL;
+
+// Adds the sums r of a row kernel to the sums s of a cost function.  When the packed
+// intensities belong to the target image (subject=NO) the roles of the two images are swapped.
+static inline void add_row_sums(NCCSUMS &s, NCCSUMS &r, int subject)
+{
+   s.n += r.n;
+   s.sum12 += r.sum12;
+   if(subject)
+   {
+      s.sum1 += r.sum1; s.sum11 += r.sum11;
+      s.sum2 += r.sum2; s.sum22 += r.sum22;
+   }
+   else
+   {
+      s.sum1 += r.sum2; s.sum11 += r.sum22;
+      s.sum2 += r.sum1; s.sum22 += r.sum11;
+   }
+}
+
+// returns 1 if the coordinates of voxel i of a row are inside the image
+static inline int row_voxel_inside(int i, float4 c, float4 *A, float4 *B, DIM dim)
+{
+   float4 p = i-c;
+   float4 x = A[0]*p + B[0];
+   float4 y = A[1]*p + B[1];
+   float4 z = A[2]*p + B[2];
+
+   return( x>=0.0 && x<=dim.nx-1.0 && y>=0.0 && y<=dim.ny-1.0 && z>=0.0 && z<=dim.nz-1.0 );
+}
+
+// Finds the voxels ilo..ihi of row i0..i1 whose coordinates fall inside the image by intersecting
+// the line with the image box.  The end points are then checked (and moved if necessary) with 
+// the same float arithmetic used by the row kernels.  Returns 0 if no voxel is inside.
+static int clip_row(int i0, int i1, float4 c, float4 *A, float4 *B, DIM dim, int &ilo, int &ihi)
+{
+   float8 lo=i0, hi=i1;
+   float8 t0, t1, dum;
+   float8 n[3];
+
+   n[0]=dim.nx-1.0; n[1]=dim.ny-1.0; n[2]=dim.nz-1.0;
+
+   // 0 <= A[d]*(i-c) + B[d] <= n[d]
+   for(int d=0; d<3; d++)
+   {
+      if(A[d]==0.0)
+      {
+         if( B[d]<0.0 || B[d]>n[d] ) return(0);
+         continue;
+      }
+
+      t0 = c - B[d]/A[d];
+      t1 = c + (n[d]-B[d])/A[d];
+      if(t0>t1) { dum=t0; t0=t1; t1=dum; }
+      if(t0>lo) lo=t0;
+      if(t1<hi) hi=t1;
+   }
+
+   if(lo>hi+1.0) return(0);
+
+   ilo = (int)ceil(lo);
+   ihi = (int)floor(hi);
+   if(ilo<i0) ilo=i0;
+   if(ihi>i1) ihi=i1;
+
+   // correct the end points for rounding
+   while( ilo>i0 && row_voxel_inside(ilo-1, c, A, B, dim) ) ilo--;
+   while( ilo<=ihi && !row_voxel_inside(ilo, c, A, B, dim) ) ilo++;
+   while( ihi<i1 && row_voxel_inside(ihi+1, c, A, B, dim) ) ihi++;
+   while( ihi>=ilo && !row_voxel_inside(ihi, c, A, B, dim) ) ihi--;
+
+   return( ilo<=ihi );
+}
+
+// Adds to r the NCC sums of voxels a..b of a span whose interpolated values are all 0.
+static inline void outside_ncc_sums(SPAN *span, MASKSPANS *s, int a, int b, NCCSUMS &r)
+{
+   if(a>b) return;
+   r.n += b-a+1;
+   r.sum1 += s->sum[span->vstart + b - span->i0 + 1] - s->sum[span->vstart + a - span->i0];
+   r.sum11 += s->sumsq[span->vstart + b - span->i0 + 1] - s->sumsq[span->vstart + a - span->i0];
+}
+
+// Returns the SSD of voxels a..b of a span whose interpolated values are all 0.
+static inline float8 outside_ssd(SPAN *span, MASKSPANS *s, int a, int b)
+{
+   if(a>b) return(0.0);
+   return( s->sumsq[span->vstart + b - span->i0 + 1] - s->sumsq[span->vstart + a - span->i0] );
+}
+
+// Returns the index v of the first corner of interpolation cell (i,j,k) of src, and the offsets
+// ox, oy and oz of its x, y and z neighbours.
+static inline int source_cell(ROWSOURCE *src, int i, int j, int k, int &ox, int &oy, int &oz)
+{
+   if(src->nbx > 0)
+   {
+      ox = 1; oy = BRICK+1; oz = (BRICK+1)*(BRICK+1);
+      return( brick_index(i, j, k, src->nbx, src->nby) );
+   }
+
+   // zero on the last row/column/slice where the weight is zero anyway
+   ox = (i<src->dim.nx-1) ? 1 : 0;
+   oy = (j<src->dim.ny-1) ? src->dim.nx : 0;
+   oz = (k<src->dim.nz-1) ? src->dim.np : 0;
+
+   return( k*src->dim.np + j*src->dim.nx + i );
+}
+
+// Trilinear interpolation in the cell of image im with corner v and neighbour offsets ox, oy, oz.
+template <class T>
+static inline float4 trilinear_cell(T *im, int v, int ox, int oy, int oz, float4 u, float4 t, float4 w)
+{
+   float4 c00, c10, c01, c11;
+
+   c00 = im[v] + u*((float4)im[v+ox] - im[v]);
+   c10 = im[v+oy] + u*((float4)im[v+oy+ox] - im[v+oy]);
+   c01 = im[v+oz] + u*((float4)im[v+oz+ox] - im[v+oz]);
+   c11 = im[v+oz+oy] + u*((float4)im[v+oz+oy+ox] - im[v+oz+oy]);
+
+   c00 += t*(c10-c00);
+   c01 += t*(c11-c01);
+
+   return( c00 + w*(c01-c00) );
+}
+
+// Trilinear interpolation of src at a point known to be inside the image.  The coordinates
+// are clamped anyway, so that rounding can never cause an out-of-bounds read.
+static inline float4 trilinear_inside(float4 x, float4 y, float4 z, ROWSOURCE *src)
+{
+   int i, j, k, v;
+   int ox, oy, oz;
+   float4 u, w, t;
+
+   x = x<0.0 ? 0.0 : (x>src->dim.nx-1.0 ? src->dim.nx-1.0 : x);
+   y = y<0.0 ? 0.0 : (y>src->dim.ny-1.0 ? src->dim.ny-1.0 : y);
+   z = z<0.0 ? 0.0 : (z>src->dim.nz-1.0 ? src->dim.nz-1.0 : z);
+
+   i = (int)x; j = (int)y; k = (int)z;
+   u = x-i; t = y-j; w = z-k;
+
+   v = source_cell(src, i, j, k, ox, oy, oz);
+
+   // qim has one voxel of padding, so v+1 can always be read; its weight u is 0 on the last column
+   if(src->qim != NULL)
+      return( src->qscale*trilinear_cell(src->qim, v, 1, oy, oz, u, t, w) );
+
+   return( trilinear_cell(src->im, v, ox, oy, oz, u, t, w) );
+}
+
+static float8 ssd_row_scalar(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src)
+{
+   float4 *val = s->val + span->vstart;
+   float4 p, dif;
+   float8 sum;
+   int ilo, ihi;
+
+   if( !clip_row(span->i0, span->i1, c, A, B, src->dim, ilo, ihi) ) 
+      return( outside_ssd(span, s, span->i0, span->i1) );
+
+   sum = outside_ssd(span, s, span->i0, ilo-1) + outside_ssd(span, s, ihi+1, span->i1);
+
+   for(int i=ilo; i<=ihi; i++)
+   {
+      p = i-c;
+      dif = val[i-span->i0] - trilinear_inside(A[0]*p + B[0], A[1]*p + B[1], A[2]*p + B[2], src);
+      sum += dif*dif;
+   }
+
+   return(sum);
+}
+
+static void ncc_row_scalar(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src, NCCSUMS &r)
+{
+   float4 *val = s->val + span->vstart;
+   float4 p, pi;
+   int ilo, ihi;
+
+   r.n=0;
+   r.sum1=r.sum2=r.sum11=r.sum22=r.sum12=0.0;
+
+   if( !clip_row(span->i0, span->i1, c, A, B, src->dim, ilo, ihi) ) 
+   {
+      outside_ncc_sums(span, s, span->i0, span->i1, r);
+      return;
+   }
+
+   outside_ncc_sums(span, s, span->i0, ilo-1, r);
+   outside_ncc_sums(span, s, ihi+1, span->i1, r);
+
+   for(int i=ilo; i<=ihi; i++)
+   {
+      p = i-c;
+      pi = trilinear_inside(A[0]*p + B[0], A[1]*p + B[1], A[2]*p + B[2], src);
+      r.n++;
+      r.sum1 += val[i-span->i0];
+      r.sum2 += pi;
+      r.sum11 += val[i-span->i0]*val[i-span->i0];
+      r.sum22 += pi*pi;
+      r.sum12 += val[i-span->i0]*pi;
+   }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// source_cell() for 8 cells
+__attribute__((target("avx2")))
+static inline __m256i source_cell_avx2(__m256i xi, __m256i yi, __m256i zi, ROWSOURCE *src, __m256i &ox, __m256i &oy, __m256i &oz)
+{
+   const __m256i one = _mm256_set1_epi32(1);
+   const __m256i low = _mm256_set1_epi32(BRICK-1);
+   __m256i brick, cell;
+
+   if(src->nbx > 0)
+   {
+      ox = one;
+      oy = _mm256_set1_epi32(BRICK+1);
+      oz = _mm256_set1_epi32((BRICK+1)*(BRICK+1));
+
+      brick = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(
+              _mm256_srli_epi32(zi, BRICKSHIFT), _mm256_set1_epi32(src->nby)), _mm256_srli_epi32(yi, BRICKSHIFT)), 
+              _mm256_set1_epi32(src->nbx)), _mm256_srli_epi32(xi, BRICKSHIFT));
+      cell = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(
+             _mm256_and_si256(zi, low), oy), _mm256_and_si256(yi, low)), oy), _mm256_and_si256(xi, low));
+
+      return( _mm256_add_epi32(_mm256_mullo_epi32(brick, _mm256_set1_epi32(BRICKSIZE)), cell) );
+   }
+
+   // zero on the last row/column/slice where the weight is zero anyway
+   ox = _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(src->dim.nx-1), xi), one);
+   oy = _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(src->dim.ny-1), yi), _mm256_set1_epi32(src->dim.nx));
+   oz = _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(src->dim.nz-1), zi), _mm256_set1_epi32(src->dim.np));
+
+   return( _mm256_add_epi32(_mm256_mullo_epi32(zi, _mm256_set1_epi32(src->dim.np)), 
+           _mm256_add_epi32(_mm256_mullo_epi32(yi, _mm256_set1_epi32(src->dim.nx)), xi)) );
+}
+
+// Interpolates src->im at 8 points inside the image; lanes outside lanemask give 0.
+__attribute__((target("avx2")))
+static inline __m256 trilinear_avx2(__m256 x, __m256 y, __m256 z, __m256 lanemask, ROWSOURCE *src)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   float4 *im = src->im;
+   __m256i xi, yi, zi, base, ox, oy, oz;
+   __m256 u, v, w;
+   __m256 c000, c100, c010, c110, c001, c101, c011, c111;
+
+   // clamp, so that rounding can never cause an out-of-bounds read
+   x = _mm256_min_ps(_mm256_max_ps(x, zero), _mm256_set1_ps(src->dim.nx-1.0));
+   y = _mm256_min_ps(_mm256_max_ps(y, zero), _mm256_set1_ps(src->dim.ny-1.0));
+   z = _mm256_min_ps(_mm256_max_ps(z, zero), _mm256_set1_ps(src->dim.nz-1.0));
+
+   xi = _mm256_cvttps_epi32(x);
+   yi = _mm256_cvttps_epi32(y);
+   zi = _mm256_cvttps_epi32(z);
+
+   u = _mm256_sub_ps(x, _mm256_cvtepi32_ps(xi));
+   v = _mm256_sub_ps(y, _mm256_cvtepi32_ps(yi));
+   w = _mm256_sub_ps(z, _mm256_cvtepi32_ps(zi));
+
+   base = source_cell_avx2(xi, yi, zi, src, ox, oy, oz);
+
+   c000 = _mm256_mask_i32gather_ps(zero, im, base, lanemask, 4);
+   c100 = _mm256_mask_i32gather_ps(zero, im, _mm256_add_epi32(base, ox), lanemask, 4);
+   base = _mm256_add_epi32(base, oy);
+   c010 = _mm256_mask_i32gather_ps(zero, im, base, lanemask, 4);
+   c110 = _mm256_mask_i32gather_ps(zero, im, _mm256_add_epi32(base, ox), lanemask, 4);
+   base = _mm256_add_epi32(base, oz);
+   c011 = _mm256_mask_i32gather_ps(zero, im, base, lanemask, 4);
+   c111 = _mm256_mask_i32gather_ps(zero, im, _mm256_add_epi32(base, ox), lanemask, 4);
+   base = _mm256_sub_epi32(base, oy);
+   c001 = _mm256_mask_i32gather_ps(zero, im, base, lanemask, 4);
+   c101 = _mm256_mask_i32gather_ps(zero, im, _mm256_add_epi32(base, ox), lanemask, 4);
+
+   c000 = _mm256_add_ps(c000, _mm256_mul_ps(u, _mm256_sub_ps(c100, c000)));
+   c010 = _mm256_add_ps(c010, _mm256_mul_ps(u, _mm256_sub_ps(c110, c010)));
+   c001 = _mm256_add_ps(c001, _mm256_mul_ps(u, _mm256_sub_ps(c101, c001)));
+   c011 = _mm256_add_ps(c011, _mm256_mul_ps(u, _mm256_sub_ps(c111, c011)));
+
+   c000 = _mm256_add_ps(c000, _mm256_mul_ps(v, _mm256_sub_ps(c010, c000)));
+   c001 = _mm256_add_ps(c001, _mm256_mul_ps(v, _mm256_sub_ps(c011, c001)));
+
+   c000 = _mm256_add_ps(c000, _mm256_mul_ps(w, _mm256_sub_ps(c001, c000)));
+
+   return( _mm256_and_ps(c000, lanemask) );
+}
+
+// Interpolates the fixed-point image src->qscale*src->qim at 8 points inside the image.  Each 
+// 32-bit gather returns the x-neighbours qim[v] (low half) and qim[v+1] (high half) together.
+__attribute__((target("avx2")))
+static inline __m256 trilinear_fixed16_avx2(__m256 x, __m256 y, __m256 z, __m256 lanemask, ROWSOURCE *src)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256i izero = _mm256_setzero_si256();
+   int2 *qim = src->qim;
+   __m256i xi, yi, zi, base, ox, oy, oz, maski;
+   __m256i g00, g10, g01, g11;
+   __m256 u, v, w;
+   __m256 c00, c10, c01, c11;
+
+   // clamp, so that rounding can never cause an out-of-bounds read
+   x = _mm256_min_ps(_mm256_max_ps(x, zero), _mm256_set1_ps(src->dim.nx-1.0));
+   y = _mm256_min_ps(_mm256_max_ps(y, zero), _mm256_set1_ps(src->dim.ny-1.0));
+   z = _mm256_min_ps(_mm256_max_ps(z, zero), _mm256_set1_ps(src->dim.nz-1.0));
+
+   xi = _mm256_cvttps_epi32(x);
+   yi = _mm256_cvttps_epi32(y);
+   zi = _mm256_cvttps_epi32(z);
+
+   u = _mm256_sub_ps(x, _mm256_cvtepi32_ps(xi));
+   v = _mm256_sub_ps(y, _mm256_cvtepi32_ps(yi));
+   w = _mm256_sub_ps(z, _mm256_cvtepi32_ps(zi));
+
+   // ox is not used: qim has one voxel of padding and the weight of v+1 is 0 on the last column
+   base = source_cell_avx2(xi, yi, zi, src, ox, oy, oz);
+
+   maski = _mm256_castps_si256(lanemask);
+   g00 = _mm256_mask_i32gather_epi32(izero, (const int *)qim, base, maski, 2);
+   g10 = _mm256_mask_i32gather_epi32(izero, (const int *)qim, _mm256_add_epi32(base, oy), maski, 2);
+   base = _mm256_add_epi32(base, oz);
+   g01 = _mm256_mask_i32gather_epi32(izero, (const int *)qim, base, maski, 2);
+   g11 = _mm256_mask_i32gather_epi32(izero, (const int *)qim, _mm256_add_epi32(base, oy), maski, 2);
+
+   // sign-extend the two 16-bit halves and interpolate along x
+#define LERP_PAIR_AVX2(g) \
+   _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g, 16), 16)), _mm256_mul_ps(u, \
+   _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(g, 16)), _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g, 16), 16)))))
+   c00 = LERP_PAIR_AVX2(g00);
+   c10 = LERP_PAIR_AVX2(g10);
+   c01 = LERP_PAIR_AVX2(g01);
+   c11 = LERP_PAIR_AVX2(g11);
+#undef LERP_PAIR_AVX2
+
+   c00 = _mm256_add_ps(c00, _mm256_mul_ps(v, _mm256_sub_ps(c10, c00)));
+   c01 = _mm256_add_ps(c01, _mm256_mul_ps(v, _mm256_sub_ps(c11, c01)));
+
+   c00 = _mm256_add_ps(c00, _mm256_mul_ps(w, _mm256_sub_ps(c01, c00)));
+
+   return( _mm256_and_ps(_mm256_mul_ps(c00, _mm256_set1_ps(src->qscale)), lanemask) );
+}
+
+__attribute__((target("avx2")))
+static inline float8 hsum_avx2(__m256d a)
+{
+   __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+   return( _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s))) );
+}
+
+// Loads the values of voxels i..i+7 of a row and interpolates them; lanes beyond ihi are masked.
+#define ROW_SETUP_AVX2 \
+   __m256i lanei = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); \
+   __m256i maski = _mm256_cmpgt_epi32(_mm256_set1_epi32(ihi-i+1), lanei); \
+   __m256 lanemask = _mm256_castsi256_ps(maski); \
+   __m256 p = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(i), lanei)), _mm256_set1_ps(c)); \
+   __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(A[0]), p), _mm256_set1_ps(B[0])); \
+   __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(A[1]), p), _mm256_set1_ps(B[1])); \
+   __m256 z = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(A[2]), p), _mm256_set1_ps(B[2])); \
+   __m256 pv = _mm256_maskload_ps(val+(i-span->i0), maski); \
+   __m256 pi = (src->qim != NULL) ? trilinear_fixed16_avx2(x, y, z, lanemask, src) : \
+               trilinear_avx2(x, y, z, lanemask, src);
+
+// adds the 8 lanes of float vector a to the 4 lanes of double accumulator acc
+#define ACCUMULATE_AVX2(acc, a) \
+   acc = _mm256_add_pd(acc, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(a)), _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1))));
+
+__attribute__((target("avx2")))
+static float8 ssd_row_avx2(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src)
+{
+   float4 *val = s->val + span->vstart;
+   __m256d acc = _mm256_setzero_pd();
+   int ilo, ihi;
+
+   if( !clip_row(span->i0, span->i1, c, A, B, src->dim, ilo, ihi) ) 
+      return( outside_ssd(span, s, span->i0, span->i1) );
+
+   for(int i=ilo; i<=ihi; i+=8)
+   {
+      ROW_SETUP_AVX2
+      __m256 dif = _mm256_sub_ps(pv, pi);
+      ACCUMULATE_AVX2(acc, _mm256_mul_ps(dif, dif))
+   }
+
+   return( hsum_avx2(acc) + outside_ssd(span, s, span->i0, ilo-1) + outside_ssd(span, s, ihi+1, span->i1) );
+}
+
+__attribute__((target("avx2")))
+static void ncc_row_avx2(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src, NCCSUMS &r)
+{
+   float4 *val = s->val + span->vstart;
+   __m256d a1 = _mm256_setzero_pd();
+   __m256d a2 = _mm256_setzero_pd();
+   __m256d a11 = _mm256_setzero_pd();
+   __m256d a22 = _mm256_setzero_pd();
+   __m256d a12 = _mm256_setzero_pd();
+   int ilo, ihi;
+
+   r.n=0;
+   r.sum1=r.sum2=r.sum11=r.sum22=r.sum12=0.0;
+
+   if( !clip_row(span->i0, span->i1, c, A, B, src->dim, ilo, ihi) ) 
+   {
+      outside_ncc_sums(span, s, span->i0, span->i1, r);
+      return;
+   }
+
+   for(int i=ilo; i<=ihi; i+=8)
+   {
+      ROW_SETUP_AVX2
+      ACCUMULATE_AVX2(a1, pv)
+      ACCUMULATE_AVX2(a2, pi)
+      ACCUMULATE_AVX2(a11, _mm256_mul_ps(pv, pv))
+      ACCUMULATE_AVX2(a22, _mm256_mul_ps(pi, pi))
+      ACCUMULATE_AVX2(a12, _mm256_mul_ps(pv, pi))
+   }
+
+   r.n = ihi-ilo+1;
+   r.sum1 = hsum_avx2(a1);
+   r.sum2 = hsum_avx2(a2);
+   r.sum11 = hsum_avx2(a11);
+   r.sum22 = hsum_avx2(a22);
+   r.sum12 = hsum_avx2(a12);
+
+   outside_ncc_sums(span, s, span->i0, ilo-1, r);
+   outside_ncc_sums(span, s, ihi+1, span->i1, r);
+}
+
+// source_cell() for 16 cells
+__attribute__((target("avx512f")))
+static inline __m512i source_cell_avx512(__m512i xi, __m512i yi, __m512i zi, ROWSOURCE *src, __m512i &ox, __m512i &oy, __m512i &oz)
+{
+   const __m512i izero = _mm512_setzero_si512();
+   const __m512i low = _mm512_set1_epi32(BRICK-1);
+   __m512i brick, cell;
+
+   if(src->nbx > 0)
+   {
+      ox = _mm512_set1_epi32(1);
+      oy = _mm512_set1_epi32(BRICK+1);
+      oz = _mm512_set1_epi32((BRICK+1)*(BRICK+1));
+
+      brick = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_add_epi32(_mm512_mullo_epi32(
+              _mm512_srli_epi32(zi, BRICKSHIFT), _mm512_set1_epi32(src->nby)), _mm512_srli_epi32(yi, BRICKSHIFT)), 
+              _mm512_set1_epi32(src->nbx)), _mm512_srli_epi32(xi, BRICKSHIFT));
+      cell = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_add_epi32(_mm512_mullo_epi32(
+             _mm512_and_si512(zi, low), oy), _mm512_and_si512(yi, low)), oy), _mm512_and_si512(xi, low));
+
+      return( _mm512_add_epi32(_mm512_mullo_epi32(brick, _mm512_set1_epi32(BRICKSIZE)), cell) );
+   }
+
+   // zero on the last row/column/slice where the weight is zero anyway
+   ox = _mm512_mask_mov_epi32(izero, _mm512_cmplt_epi32_mask(xi, _mm512_set1_epi32(src->dim.nx-1)), _mm512_set1_epi32(1));
+   oy = _mm512_mask_mov_epi32(izero, _mm512_cmplt_epi32_mask(yi, _mm512_set1_epi32(src->dim.ny-1)), _mm512_set1_epi32(src->dim.nx));
+   oz = _mm512_mask_mov_epi32(izero, _mm512_cmplt_epi32_mask(zi, _mm512_set1_epi32(src->dim.nz-1)), _mm512_set1_epi32(src->dim.np));
+
+   return( _mm512_add_epi32(_mm512_mullo_epi32(zi, _mm512_set1_epi32(src->dim.np)), 
+           _mm512_add_epi32(_mm512_mullo_epi32(yi, _mm512_set1_epi32(src->dim.nx)), xi)) );
+}
+
+// Interpolates src->im at 16 points inside the image; lanes outside lanemask give 0.
+__attribute__((target("avx512f")))
+static inline __m512 trilinear_avx512(__m512 x, __m512 y, __m512 z, __mmask16 lanemask, ROWSOURCE *src)
+{
+   const __m512 zero = _mm512_setzero_ps();
+   float4 *im = src->im;
+   __m512i xi, yi, zi, base, ox, oy, oz;
+   __m512 u, v, w;
+   __m512 c000, c100, c010, c110, c001, c101, c011, c111;
+
+   // clamp, so that rounding can never cause an out-of-bounds read
+   x = _mm512_min_ps(_mm512_max_ps(x, zero), _mm512_set1_ps(src->dim.nx-1.0));
+   y = _mm512_min_ps(_mm512_max_ps(y, zero), _mm512_set1_ps(src->dim.ny-1.0));
+   z = _mm512_min_ps(_mm512_max_ps(z, zero), _mm512_set1_ps(src->dim.nz-1.0));
+
+   xi = _mm512_cvttps_epi32(x);
+   yi = _mm512_cvttps_epi32(y);
+   zi = _mm512_cvttps_epi32(z);
+
+   u = _mm512_sub_ps(x, _mm512_cvtepi32_ps(xi));
+   v = _mm512_sub_ps(y, _mm512_cvtepi32_ps(yi));
+   w = _mm512_sub_ps(z, _mm512_cvtepi32_ps(zi));
+
+   base = source_cell_avx512(xi, yi, zi, src, ox, oy, oz);
+
+   c000 = _mm512_mask_i32gather_ps(zero, lanemask, base, im, 4);
+   c100 = _mm512_mask_i32gather_ps(zero, lanemask, _mm512_add_epi32(base, ox), im, 4);
+   base = _mm512_add_epi32(base, oy);
+   c010 = _mm512_mask_i32gather_ps(zero, lanemask, base, im, 4);
+   c110 = _mm512_mask_i32gather_ps(zero, lanemask, _mm512_add_epi32(base, ox), im, 4);
+   base = _mm512_add_epi32(base, oz);
+   c011 = _mm512_mask_i32gather_ps(zero, lanemask, base, im, 4);
+   c111 = _mm512_mask_i32gather_ps(zero, lanemask, _mm512_add_epi32(base, ox), im, 4);
+   base = _mm512_sub_epi32(base, oy);
+   c001 = _mm512_mask_i32gather_ps(zero, lanemask, base, im, 4);
+   c101 = _mm512_mask_i32gather_ps(zero, lanemask, _mm512_add_epi32(base, ox), im, 4);
+
+   c000 = _mm512_add_ps(c000, _mm512_mul_ps(u, _mm512_sub_ps(c100, c000)));
+   c010 = _mm512_add_ps(c010, _mm512_mul_ps(u, _mm512_sub_ps(c110, c010)));
+   c001 = _mm512_add_ps(c001, _mm512_mul_ps(u, _mm512_sub_ps(c101, c001)));
+   c011 = _mm512_add_ps(c011, _mm512_mul_ps(u, _mm512_sub_ps(c111, c011)));
+
+   c000 = _mm512_add_ps(c000, _mm512_mul_ps(v, _mm512_sub_ps(c010, c000)));
+   c001 = _mm512_add_ps(c001, _mm512_mul_ps(v, _mm512_sub_ps(c011, c001)));
+
+   c000 = _mm512_add_ps(c000, _mm512_mul_ps(w, _mm512_sub_ps(c001, c000)));
+
+   return( _mm512_maskz_mov_ps(lanemask, c000) );
+}
+
+// Interpolates the fixed-point image qscale*qim at 16 points inside the image (see above).
+__attribute__((target("avx512f")))
+static inline __m512 trilinear_fixed16_avx512(__m512 x, __m512 y, __m512 z, __mmask16 lanemask, ROWSOURCE *src)
+{
+   const __m512 zero = _mm512_setzero_ps();
+   const __m512i izero = _mm512_setzero_si512();
+   int2 *qim = src->qim;
+   __m512i xi, yi, zi, base, ox, oy, oz;
+   __m512i g00, g10, g01, g11;
+   __m512 u, v, w;
+   __m512 c00, c10, c01, c11;
+
+   // clamp, so that rounding can never cause an out-of-bounds read
+   x = _mm512_min_ps(_mm512_max_ps(x, zero), _mm512_set1_ps(src->dim.nx-1.0));
+   y = _mm512_min_ps(_mm512_max_ps(y, zero), _mm512_set1_ps(src->dim.ny-1.0));
+   z = _mm512_min_ps(_mm512_max_ps(z, zero), _mm512_set1_ps(src->dim.nz-1.0));
+
+   xi = _mm512_cvttps_epi32(x);
+   yi = _mm512_cvttps_epi32(y);
+   zi = _mm512_cvttps_epi32(z);
+
+   u = _mm512_sub_ps(x, _mm512_cvtepi32_ps(xi));
+   v = _mm512_sub_ps(y, _mm512_cvtepi32_ps(yi));
+   w = _mm512_sub_ps(z, _mm512_cvtepi32_ps(zi));
+
+   // ox is not used: qim has one voxel of padding and the weight of v+1 is 0 on the last column
+   base = source_cell_avx512(xi, yi, zi, src, ox, oy, oz);
+
+   g00 = _mm512_mask_i32gather_epi32(izero, lanemask, base, qim, 2);
+   g10 = _mm512_mask_i32gather_epi32(izero, lanemask, _mm512_add_epi32(base, oy), qim, 2);
+   base = _mm512_add_epi32(base, oz);
+   g01 = _mm512_mask_i32gather_epi32(izero, lanemask, base, qim, 2);
+   g11 = _mm512_mask_i32gather_epi32(izero, lanemask, _mm512_add_epi32(base, oy), qim, 2);
+
+   // sign-extend the two 16-bit halves and interpolate along x
+#define LERP_PAIR_AVX512(g) \
+   _mm512_add_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(g, 16), 16)), _mm512_mul_ps(u, \
+   _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(g, 16)), _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(g, 16), 16)))))
+   c00 = LERP_PAIR_AVX512(g00);
+   c10 = LERP_PAIR_AVX512(g10);
+   c01 = LERP_PAIR_AVX512(g01);
+   c11 = LERP_PAIR_AVX512(g11);
+#undef LERP_PAIR_AVX512
+
+   c00 = _mm512_add_ps(c00, _mm512_mul_ps(v, _mm512_sub_ps(c10, c00)));
+   c01 = _mm512_add_ps(c01, _mm512_mul_ps(v, _mm512_sub_ps(c11, c01)));
+
+   c00 = _mm512_add_ps(c00, _mm512_mul_ps(w, _mm512_sub_ps(c01, c00)));
+
+   return( _mm512_maskz_mov_ps(lanemask, _mm512_mul_ps(c00, _mm512_set1_ps(src->qscale))) );
+}
+
+// Loads the values of voxels i..i+15 of a row and interpolates them; lanes beyond ihi are masked.
+#define ROW_SETUP_AVX512 \
+   __m512i lanei = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); \
+   __mmask16 lanemask = _mm512_cmplt_epi32_mask(lanei, _mm512_set1_epi32(ihi-i+1)); \
+   __m512 p = _mm512_sub_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(_mm512_set1_epi32(i), lanei)), _mm512_set1_ps(c)); \
+   __m512 x = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(A[0]), p), _mm512_set1_ps(B[0])); \
+   __m512 y = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(A[1]), p), _mm512_set1_ps(B[1])); \
+   __m512 z = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(A[2]), p), _mm512_set1_ps(B[2])); \
+   __m512 pv = _mm512_maskz_loadu_ps(lanemask, val+(i-span->i0)); \
+   __m512 pi = (src->qim != NULL) ? trilinear_fixed16_avx512(x, y, z, lanemask, src) : \
+               trilinear_avx512(x, y, z, lanemask, src);
+
+// adds the 16 lanes of float vector a to the 8 lanes of double accumulator acc
+#define ACCUMULATE_AVX512(acc, a) \
+   acc = _mm512_add_pd(acc, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(a)), \
+   _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_shuffle_f32x4(a, a, _MM_SHUFFLE(3,2,3,2))))));
+
+__attribute__((target("avx512f")))
+static float8 ssd_row_avx512(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src)
+{
+   float4 *val = s->val + span->vstart;
+   __m512d acc = _mm512_setzero_pd();
+   int ilo, ihi;
+
+   if( !clip_row(span->i0, span->i1, c, A, B, src->dim, ilo, ihi) ) 
+      return( outside_ssd(span, s, span->i0, span->i1) );
+
+   for(int i=ilo; i<=ihi; i+=16)
+   {
+      ROW_SETUP_AVX512
+      __m512 dif = _mm512_sub_ps(pv, pi);
+      ACCUMULATE_AVX512(acc, _mm512_mul_ps(dif, dif))
+   }
+
+   return( _mm512_reduce_add_pd(acc) + outside_ssd(span, s, span->i0, ilo-1) + outside_ssd(span, s, ihi+1, span->i1) );
+}
+
+__attribute__((target("avx512f")))
+static void ncc_row_avx512(SPAN *span, MASKSPANS *s, float4 c, float4 *A, float4 *B, ROWSOURCE *src, NCCSUMS &r)
+{
+   float4 *val = s->val + span->vstart;
+   __m512d a1 = _mm512_setzero_pd();
+   __m512d a2 = _mm512_setzero_pd();
+   __m512d a11 = _mm512_setzero_pd();
+   __m512d a22 = _mm512_setzero_pd();
+   __m512d a12 = _mm512_setzero_pd();
+   int ilo, ihi;
+
+   r.n=0;
+   r.sum1=r.sum2=r.sum11=r.sum22=r.sum12=0.0;
+
+   if( !clip_row(span->i0, span->i1, c, A, B, src->dim, ilo, ihi) ) 
+   {
+      outside_ncc_sums(span, s, span->i0, span->i1, r);
+      return;
+   }
+
+   for(int i=ilo; i<=ihi; i+=16)
+   {
+      ROW_SETUP_AVX512
+      ACCUMULATE_AVX512(a1, pv)
+      ACCUMULATE_AVX512(a2, pi)
+      ACCUMULATE_AVX512(a11, _mm512_mul_ps(pv, pv))
+      ACCUMULATE_AVX512(a22, _mm512_mul_ps(pi, pi))
+      ACCUMULATE_AVX512(a12, _mm512_mul_ps(pv, pi))
+   }
+
+   r.n = ihi-ilo+1;
+   r.sum1 = _mm512_reduce_add_pd(a1);
+   r.sum2 = _mm512_reduce_add_pd(a2);
+   r.sum11 = _mm512_reduce_add_pd(a11);
+   r.sum22 = _mm512_reduce_add_pd(a22);
+   r.sum12 = _mm512_reduce_add_pd(a12);
+
+   outside_ncc_sums(span, s, span->i0, ilo-1, r);
+   outside_ncc_sums(span, s, ihi+1, span->i1, r);
+}
+
+#endif
+
+// Selects the widest row kernels supported by this CPU.  Returns the name of the
+// selected instruction set.
+const char *select_row_kernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+
+   if( __builtin_cpu_supports("avx512f") )
+   {
+      ssd_row_kernel = ssd_row_avx512;
+      ncc_row_kernel = ncc_row_avx512;
+      return("AVX-512");
+   }
+
+   if( __builtin_cpu_supports("avx2") )
+   {
+      ssd_row_kernel = ssd_row_avx2;
+      ncc_row_kernel = ncc_row_avx2;
+      return("AVX2");
+   }
+#endif
+
+   ssd_row_kernel = ssd_row_scalar;
+   ncc_row_kernel = ncc_row_scalar;
+   return("scalar");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Converts T, which takes the mm coordinates of a follow-up point to baseline mm coordinates,
+// into Tmod and invTmod which take voxel indices of one grid to voxel indices of the other grid.
+void voxel_transformations(float4 *T, DIM dimb, DIM dimf, float4 *Tmod, float4 *invTmod)
+{
+   float4 *invT;
+   float4 nxsub2, nysub2, nzsub2; 
+   float4 nxtrg2, nytrg2, nztrg2;
+
+   invT = inv4(T);
+
+   nxsub2 = (dimf.nx-1)/2.0;
+   nysub2 = (dimf.ny-1)/2.0;
+   nzsub2 = (dimf.nz-1)/2.0;
+
+   nxtrg2 = (dimb.nx-1)/2.0;
+   nytrg2 = (dimb.ny-1)/2.0;
+   nztrg2 = (dimb.nz-1)/2.0;
+
+   ////////////////////////////////////////
+   Tmod[0] = T[0]*dimf.dx/dimb.dx;
+   Tmod[1] = T[1]*dimf.dy/dimb.dx;
+   Tmod[2] = T[2]*dimf.dz/dimb.dx;
+   Tmod[3] = T[3]/dimb.dx + nxtrg2;
+
+   Tmod[4] = T[4]*dimf.dx/dimb.dy;
+   Tmod[5] = T[5]*dimf.dy/dimb.dy;
+   Tmod[6] = T[6]*dimf.dz/dimb.dy;
+   Tmod[7] = T[7]/dimb.dy + nytrg2;
+
+   Tmod[8] = T[8]*dimf.dx/dimb.dz;
+   Tmod[9] = T[9]*dimf.dy/dimb.dz;
+   Tmod[10] = T[10]*dimf.dz/dimb.dz;
+   Tmod[11] = T[11]/dimb.dz + nztrg2;
+   ////////////////////////////////////////
+   invTmod[0] = invT[0]*dimb.dx/dimf.dx;
+   invTmod[1] = invT[1]*dimb.dy/dimf.dx;
+   invTmod[2] = invT[2]*dimb.dz/dimf.dx;
+   invTmod[3] = invT[3]/dimf.dx + nxsub2;
+
+   invTmod[4] = invT[4]*dimb.dx/dimf.dy;
+   invTmod[5] = invT[5]*dimb.dy/dimf.dy;
+   invTmod[6] = invT[6]*dimb.dz/dimf.dy;
+   invTmod[7] = invT[7]/dimf.dy + nysub2;
+
+   invTmod[8] = invT[8]*dimb.dx/dimf.dz;
+   invTmod[9] = invT[9]*dimb.dy/dimf.dz;
+   invTmod[10] = invT[10]*dimb.dz/dimf.dz;
+   invTmod[11] = invT[11]/dimf.dz + nzsub2;
+   ////////////////////////////////////////
+
+   free(invT);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Cost function engine
+//
+// The registration cost compares every masked follow-up (subject) voxel with the baseline 
+// (target) image sampled at T, and every masked baseline voxel with the follow-up image sampled
+// at inverse(T).  cost_engine() evaluates this for a batch of transformations and is specialized
+// at compile time on
+//
+//    METRIC: the sums accumulated and the cost computed from them (SSDMETRIC, NCCMETRIC, MIMETRIC)
+//    INTERP: the interpolator used to sample the other image (TRILINEAR, NEAREST)
+//
+// so that the per-voxel work inlines into the slice loops.  The mask needs no specialization:
+// it is given by the span lists, which simply cover whole rows when nothing is masked out.
+// With -simd, trilinear rows are handled by the fast row kernels of the metric.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Trilinear interpolation with the convention of linearInterpolator(): points outside 
+// [0,nx-1]x[0,ny-1]x[0,nz-1] give 0.
+struct TRILINEAR
+{
+   static const int rowkernels = YES;
+
+   static inline float4 sample(float4 x, float4 y, float4 z, float4 *im, DIM &dim)
+   {
+      int i, j, k;
+      int ox, oy, oz;
+
+      if( x<0.0 || x>dim.nx-1.0 || y<0.0 || y>dim.ny-1.0 || z<0.0 || z>dim.nz-1.0 ) return(0.0);
+
+      i = (int)x; j = (int)y; k = (int)z;
+
+      // zero on the last row/column/slice where the weight is zero anyway
+      ox = (i<dim.nx-1) ? 1 : 0;
+      oy = (j<dim.ny-1) ? dim.nx : 0;
+      oz = (k<dim.nz-1) ? dim.np : 0;
+
+      return( trilinear_cell(im, k*dim.np + j*dim.nx + i, ox, oy, oz, x-i, y-j, z-k) );
+   }
+
+   // Returns the number of corners of the cell containing (x,y,z), 0 outside the image, and 
+   // their values and trilinear weights, for partial-volume interpolation.
+   static inline int corners(float4 x, float4 y, float4 z, float4 *im, DIM &dim, float4 *value, float4 *weight)
+   {
+      int i, j, k, v;
+      int ox, oy, oz;
+      float4 u, t, w;
+
+      if( x<0.0 || x>dim.nx-1.0 || y<0.0 || y>dim.ny-1.0 || z<0.0 || z>dim.nz-1.0 ) return(0);
+
+      i = (int)x; j = (int)y; k = (int)z;
+      u = x-i; t = y-j; w = z-k;
+
+      ox = (i<dim.nx-1) ? 1 : 0;
+      oy = (j<dim.ny-1) ? dim.nx : 0;
+      oz = (k<dim.nz-1) ? dim.np : 0;
+
+      v = k*dim.np + j*dim.nx + i;
+
+      value[0] = im[v];          weight[0] = (1.0f-u)*(1.0f-t)*(1.0f-w);
+      value[1] = im[v+ox];       weight[1] = u*(1.0f-t)*(1.0f-w);
+      value[2] = im[v+oy];       weight[2] = (1.0f-u)*t*(1.0f-w);
+      value[3] = im[v+oy+ox];    weight[3] = u*t*(1.0f-w);
+      value[4] = im[v+oz];       weight[4] = (1.0f-u)*(1.0f-t)*w;
+      value[5] = im[v+oz+ox];    weight[5] = u*(1.0f-t)*w;
+      value[6] = im[v+oz+oy];    weight[6] = (1.0f-u)*t*w;
+      value[7] = im[v+oz+oy+ox]; weight[7] = u*t*w;
+
+      return(8);
+   }
+};
+
+// Nearest neighbour interpolation, with the same extent as TRILINEAR.
+struct NEAREST
+{
+   static const int rowkernels = NO;
+
+   static inline float4 sample(float4 x, float4 y, float4 z, float4 *im, DIM &dim)
+   {
+      if( x<0.0 || x>dim.nx-1.0 || y<0.0 || y>dim.ny-1.0 || z<0.0 || z>dim.nz-1.0 ) return(0.0);
+
+      return( im[(int)(z+0.5)*dim.np + (int)(y+0.5)*dim.nx + (int)(x+0.5)] );
+   }
+
+   static inline int corners(float4 x, float4 y, float4 z, float4 *im, DIM &dim, float4 *value, float4 *weight)
+   {
+      if( x<0.0 || x>dim.nx-1.0 || y<0.0 || y>dim.ny-1.0 || z<0.0 || z>dim.nz-1.0 ) return(0);
+
+      value[0] = im[(int)(z+0.5)*dim.np + (int)(y+0.5)*dim.nx + (int)(x+0.5)];
+      weight[0] = 1.0;
+
+      return(1);
+   }
+};
+
+// Sum of squared differences.  The partial sums only grow, so a batch can abandon a 
+// transformation as soon as its partial sum exceeds a bound.
+struct SSDMETRIC
+{
+   typedef float8 SUMS;
+   static const int bounded = YES;
+   static const int slicewise = YES;
+
+   SSDMETRIC(MASKSPANS *bspans, MASKSPANS *fspans) {}
+
+   static inline void add(SUMS &s, float4 subject, float4 target)
+   {
+      float4 dif = subject - target;
+      s += (dif*dif);
+   }
+
+   static inline int row_kernel() { return( ssd_row_kernel != NULL ); }
+
+   static inline void add_row(SUMS &s, SPAN *span, MASKSPANS *spans, float4 c, float4 *A, float4 *B, ROWSOURCE *src, int subject)
+   {
+      s += ssd_row_kernel(span, spans, c, A, B, src);
+   }
+
+   static inline void merge(SUMS &s, SUMS &slice) { s += slice; }
+
+   static inline float8 partial(SUMS &s) { return(s); }
+
+   static inline float8 cost(SUMS &s) { return(s); }
+};
+
+// Normalized cross-correlation, negated since the search minimizes the cost.
+struct NCCMETRIC
+{
+   typedef NCCSUMS SUMS;
+   static const int bounded = NO;
+   static const int slicewise = YES;
+
+   NCCMETRIC(MASKSPANS *bspans, MASKSPANS *fspans) {}
+
+   static inline void add(SUMS &s, float4 subject, float4 target)
+   {
+      s.n++;
+      s.sum1 += subject;
+      s.sum2 += target;
+      s.sum12 += (subject*target);
+      s.sum11 += (subject*subject);
+      s.sum22 += (target*target);
+   }
+
+   static inline int row_kernel() { return( ncc_row_kernel != NULL ); }
+
+   static inline void add_row(SUMS &s, SPAN *span, MASKSPANS *spans, float4 c, float4 *A, float4 *B, ROWSOURCE *src, int subject)
+   {
+      NCCSUMS r;
+      ncc_row_kernel(span, spans, c, A, B, src, r);
+      add_row_sums(s, r, subject);
+   }
+
+   static inline void merge(SUMS &s, SUMS &slice)
+   {
+      s.n += slice.n;
+      s.sum1 += slice.sum1;
+      s.sum2 += slice.sum2;
+      s.sum11 += slice.sum11;
+      s.sum22 += slice.sum22;
+      s.sum12 += slice.sum12;
+   }
+
+   static inline float8 partial(SUMS &s) { return(0.0); }
+
+   static inline float8 cost(SUMS &s)
+   {
+      float8 cost=0.0;
+
+      if( s.n > 0 )
+      {
+         cost = -(s.sum12 - s.sum1*s.sum2/s.n);  // since it is a minimization problem
+         cost /= sqrt( s.sum11 - s.sum1*s.sum1/s.n ); 
+         cost /= sqrt( s.sum22 - s.sum2*s.sum2/s.n ); 
+      }
+
+      return(cost);
+   }
+};
+
+// Joint histogram of the MI metrics, with the follow-up (subject) intensity bin first.  The 
+// entries are integer multiples of 1/PVSCALE, so they add up to the same values in any order.
+struct MIHIST
+{
+   long long h[MIBINS][MIBINS];
+};
+
+// Mutual information (NORMALIZED=NO) or normalized mutual information (H(A)+H(B))/H(A,B)
+// (NORMALIZED=YES), negated since the search minimizes the cost, for registering images whose
+// intensities are not linearly related.  Both the forward and the inverse pass add to one 
+// joint histogram, with partial-volume interpolation: the masked voxel is binned with each 
+// corner of the cell around the sampled point, weighted by its trilinear weight.  Points
+// outside the other image are left out.  The histograms are private to each thread and
+// merged at the end instead of being kept per slice.
+template <int NORMALIZED>
+struct MIMETRIC
+{
+   typedef MIHIST SUMS;
+   static const int bounded = NO;
+   static const int slicewise = NO;
+
+   float4 fscale, bscale; // bin = intensity*scale
+
+   MIMETRIC(MASKSPANS *bspans, MASKSPANS *fspans)
+   {
+      fscale = (fspans->max > 0.0) ? MIBINS/fspans->max : 1.0;
+      bscale = (bspans->max > 0.0) ? MIBINS/bspans->max : 1.0;
+   }
+
+   static inline int bin(float4 v, float4 scale)
+   {
+      int b = (int)(v*scale);
+      return( b<0 ? 0 : (b>MIBINS-1 ? MIBINS-1 : b) );
+   }
+
+   // adds one pair of interpolated intensities with weight 1 (see halfway_engine())
+   inline void add(SUMS &s, float4 subject, float4 target)
+   {
+      s.h[bin(subject, fscale)][bin(target, bscale)] += PVSCALE;
+   }
+
+   inline void add_corners(SUMS &s, float4 val, float4 *value, float4 *weight, int nc, int subject)
+   {
+      int a;
+
+      if(subject)
+      {
+         a = bin(val, fscale);
+         for(int c=0; c<nc; c++) s.h[a][bin(value[c], bscale)] += (long long)(weight[c]*PVSCALE + 0.5f);
+      }
+      else
+      {
+         a = bin(val, bscale);
+         for(int c=0; c<nc; c++) s.h[bin(value[c], fscale)][a] += (long long)(weight[c]*PVSCALE + 0.5f);
+      }
+   }
+
+   static inline int row_kernel() { return(NO); }
+
+   static inline void add_row(SUMS &s, SPAN *span, MASKSPANS *spans, float4 c, float4 *A, float4 *B, ROWSOURCE *src, int subject) {}
+
+   static inline void merge(SUMS &s, SUMS &slice)
+   {
+      for(int a=0; a<MIBINS; a++)
+      for(int b=0; b<MIBINS; b++)
+         s.h[a][b] += slice.h[a][b];
+   }
+
+   static inline float8 partial(SUMS &s) { return(0.0); }
+
+   static inline float8 cost(SUMS &s)
+   {
+      float8 n=0.0, p;
+      float8 ha=0.0, hb=0.0, hab=0.0;
+      float8 pa[MIBINS], pb[MIBINS];
+
+      for(int a=0; a<MIBINS; a++) pa[a]=pb[a]=0.0;
+
+      for(int a=0; a<MIBINS; a++)
+      for(int b=0; b<MIBINS; b++)
+      {
+         n += s.h[a][b];
+         pa[a] += s.h[a][b];
+         pb[b] += s.h[a][b];
+      }
+
+      if( n <= 0.0 ) return(0.0);
+
+      for(int a=0; a<MIBINS; a++)
+      for(int b=0; b<MIBINS; b++)
+      if( s.h[a][b] > 0 )
+      {
+         p = s.h[a][b]/n;
+         hab -= p*log(p);
+      }
+
+      for(int a=0; a<MIBINS; a++)
+      {
+         if( pa[a] > 0.0 ) ha -= (pa[a]/n)*log(pa[a]/n);
+         if( pb[a] > 0.0 ) hb -= (pb[a]/n)*log(pb[a]/n);
+      }
+
+      if(NORMALIZED) return( hab > 0.0 ? -(ha+hb)/hab : 0.0 );
+
+      return( -(ha+hb-hab) );
+   }
+};
+
+// Samples im at (x,y,z) with INTERP and adds the intensity pair of a masked voxel of value val
+// to the sums s of a metric (subject is YES if the masked voxel belongs to the follow-up image).
+template <class INTERP, class METRIC>
+static inline void add_sample(METRIC &metric, typename METRIC::SUMS &s, float4 x, float4 y, float4 z, float4 *im, DIM &dim, float4 val, int subject)
+{
+   float4 sampled = INTERP::sample(x, y, z, im, dim);
+
+   if(subject) metric.add(s, val, sampled);
+   else metric.add(s, sampled, val);
+}
+
+// The same with partial-volume interpolation for the MI metrics
+template <class INTERP, int NORMALIZED>
+static inline void add_sample(MIMETRIC<NORMALIZED> &metric, MIHIST &s, float4 x, float4 y, float4 z, float4 *im, DIM &dim, float4 val, int subject)
+{
+   float4 value[8], weight[8];
+   int nc;
+
+   nc = INTERP::corners(x, y, z, im, dim, value, weight);
+   metric.add_corners(s, val, value, weight, nc, subject);
+}
+
+// Returns the number of masked voxels in slice k of s.
+static inline int slice_voxels(MASKSPANS *s, int k)
+{
+   SPAN *a, *b;
+
+   if( s->first[k] == s->first[k+1] ) return(0);
+
+   a = s->span + s->first[k];
+   b = s->span + s->first[k+1] - 1;
+
+   return( b->vstart + (b->i1 - b->i0 + 1) - a->vstart );
+}
+
+// Sorts the n slices of order[] in decreasing order of cost[]; ties keep the slice order.
+static void sort_slices(int *order, float8 *cost, int n)
+{
+   int k, l;
+
+   for(int i=0; i<n; i++) order[i]=i;
+
+   for(int i=1; i<n; i++)
+   {
+      k = order[i];
+      for(l=i; l>0 && cost[order[l-1]] < cost[k]; l--) order[l] = order[l-1];
+      order[l] = k;
+   }
+}
+
+// Adds to sum[m] the METRIC sums of slice k of the masked voxels in spans, whose image is 
+// compared with image im sampled at the K transformations Tmod (voxel indices to voxel 
+// indices, see voxel_transformations()).  Transformations with active[m]=NO are skipped.
+// subject is YES if spans belong to the follow-up image.
+template <class METRIC, class INTERP>
+static inline void cost_slice(METRIC &metric, int k, MASKSPANS *spans, DIM &dim, float4 (*Tmod)[16], int K, int *active, 
+float4 *im, DIM &imdim, ROWSOURCE *src, int subject, typename METRIC::SUMS *sum)
+{
+   SPAN *span;
+   float4 *val;
+   float4 p0, p1, p2;
+   float4 t2[MAXBATCH], t6[MAXBATCH], t10[MAXBATCH];
+   float4 t1[MAXBATCH], t5[MAXBATCH], t9[MAXBATCH];
+   float4 nx2, ny2, nz2;
+   int rows = INTERP::rowkernels && metric.row_kernel();
+
+   nx2 = (dim.nx-1)/2.0;
+   ny2 = (dim.ny-1)/2.0;
+   nz2 = (dim.nz-1)/2.0;
+
+   p2 = (k-nz2);
+   for(int m=0; m<K; m++)
+   {
+      t2[m]  = Tmod[m][2]*p2  + Tmod[m][3];
+      t6[m]  = Tmod[m][6]*p2  + Tmod[m][7];
+      t10[m] = Tmod[m][10]*p2 + Tmod[m][11];
+   }
+
+   for(int s=spans->first[k]; s<spans->first[k+1]; s++)
+   {
+      span = spans->span + s;
+      val = spans->val + span->vstart;
+      p1 = (span->j-ny2);
+      for(int m=0; m<K; m++)
+      {
+         t1[m] = Tmod[m][1]*p1;
+         t5[m] = Tmod[m][5]*p1;
+         t9[m] = Tmod[m][9]*p1;
+      }
+
+      if(rows)
+      {
+         for(int m=0; m<K; m++)
+         if(active[m])
+         {
+            float4 A[3]={Tmod[m][0], Tmod[m][4], Tmod[m][8]};
+            float4 B[3]={t1[m]+t2[m], t5[m]+t6[m], t9[m]+t10[m]};
+            metric.add_row(sum[m], span, spans, nx2, A, B, src, subject);
+         }
+         continue;
+      }
+
+      for(int i=span->i0; i<=span->i1; i++)
+      {
+         p0 = (i-nx2);
+
+         for(int m=0; m<K; m++)
+         if(active[m])
+         {
+            add_sample<INTERP>(metric, sum[m], Tmod[m][0]*p0 + t1[m] + t2[m], Tmod[m][4]*p0 + t5[m] + t6[m],
+            Tmod[m][8]*p0 + t9[m] + t10[m], im, imdim, val[i-span->i0], subject);
+         }
+      }
+   }
+}
+
+// Evaluates the METRIC cost for K transformations at once.  T points to K consecutive 4x4
+// matrices and cost[m] receives the cost of the m'th matrix.  Each masked voxel is read once 
+// and sampled under all K transformations, so a line search streams the images only once.
+// The sums are kept per slice and added up in slice order after the parallel loops, so the 
+// costs do not depend on the number of threads or on K.
+//
+// For a bounded metric (SSD), a transformation is abandoned as soon as its partial cost exceeds
+// bound; its cost is then some value > bound.  To abandon losing transformations early, the 
+// slices are visited in decreasing order of their cost under the best transformation of the 
+// previous call (bspans->order and fspans->order).  Pass bound=INFINITY to evaluate all costs
+// in full.  For the other metrics bound is not used.
+template <class METRIC, class INTERP>
+void cost_engine(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost)
+{
+   typedef typename METRIC::SUMS SUMS;
+
+   METRIC metric(bspans, fspans);
+   float4 Tmod[MAXBATCH][16]; //modified T
+   float4 invTmod[MAXBATCH][16]; //modified invT
+
+   if(K>MAXBATCH)
+   {
+      printf("cost_engine(): K=%d exceeds MAXBATCH=%d, aborting ...\n", K, MAXBATCH);
+      exit(1);
+   }
+
+   for(int m=0; m<K; m++) voxel_transformations(T+16*m, dimb, dimf, Tmod[m], invTmod[m]);
+
+   // For slicewise metrics, K sums per slice: the follow-up slices first, then the baseline 
+   // slices.  The other metrics sum per thread into thread_sums.
+   SUMS *slice_sums = NULL;
+   if(METRIC::slicewise) slice_sums = (SUMS *)calloc((dimf.nz + dimb.nz)*K, sizeof(SUMS));
+
+   SUMS *total = (SUMS *)calloc(K, sizeof(SUMS));
+
+   // running totals of the slices done so far, in whatever order the threads finish them
+   float8 partial[MAXBATCH];
+   int abandoned[MAXBATCH];
+   for(int m=0; m<K; m++) { partial[m]=0.0; abandoned[m]=NO; }
+
+   #pragma omp parallel num_threads(opt_threads)
+   {
+      SUMS *thread_sums = NULL;
+      if(!METRIC::slicewise) thread_sums = (SUMS *)calloc(K, sizeof(SUMS));
+
+      #pragma omp for schedule(dynamic)
+      for(int n=0; n<dimf.nz+dimb.nz; n++)
+      {
+         int k, active[MAXBATCH], nactive=0;
+         float8 done;
+         SUMS *sum = thread_sums;
+         MASKSPANS *spans;
+
+         for(int m=0; m<K; m++)
+         {
+            active[m] = YES;
+            if(METRIC::bounded)
+            {
+               #pragma omp atomic read
+               done = partial[m];
+               active[m] = (done <= bound);
+               if(!active[m])
+               {
+                  #pragma omp atomic write
+                  abandoned[m] = YES;
+               }
+            }
+            nactive += active[m];
+         }
+
+         if( n < dimf.nz )
+         {
+            k = fspans->order[n];
+            spans = fspans;
+            if(METRIC::slicewise) sum = slice_sums + k*K;
+            cost_slice<METRIC,INTERP>(metric, k, fspans, dimf, Tmod, K, active, sclbim, dimb, &bspans->src, YES, sum);
+         }
+         else
+         {
+            k = bspans->order[n-dimf.nz];
+            spans = bspans;
+            if(METRIC::slicewise) sum = slice_sums + (dimf.nz + k)*K;
+            cost_slice<METRIC,INTERP>(metric, k, bspans, dimb, invTmod, K, active, sclfim, dimf, &fspans->src, NO, sum);
+         }
+
+         #pragma omp atomic
+         profile_voxels += (long long)nactive*slice_voxels(spans, k);
+
+         if(METRIC::bounded)
+         for(int m=0; m<K; m++)
+         if(active[m])
+         {
+            done = metric.partial(sum[m]);
+            #pragma omp atomic
+            partial[m] += done;
+         }
+      }
+
+      if(!METRIC::slicewise)
+      {
+         #pragma omp critical
+         for(int m=0; m<K; m++) metric.merge(total[m], thread_sums[m]);
+
+         free(thread_sums);
+      }
+   }
+
+   profile_evals += K;
+
+   // add up the slices in slice order; abandoned slices were left at zero
+   if(METRIC::slicewise)
+   for(int k=0; k<dimf.nz+dimb.nz; k++)
+   for(int m=0; m<K; m++)
+      metric.merge(total[m], slice_sums[k*K + m]);
+
+   // the partial cost of an abandoned transformation already exceeds the bound
+   int best=-1;
+   for(int m=0; m<K; m++)
+   {
+      cost[m] = metric.cost(total[m]);
+      if(abandoned[m]) cost[m] = partial[m];
+      else if( best<0 || cost[m]<cost[best] ) best=m;
+   }
+
+   // visit the slices with the largest cost first next time
+   if(METRIC::bounded && best>=0)
+   {
+      float8 *residual = (float8 *)calloc(dimf.nz + dimb.nz, sizeof(float8));
+      for(int k=0; k<dimf.nz+dimb.nz; k++) residual[k] = metric.partial(slice_sums[k*K + best]);
+      sort_slices(fspans->order, residual, dimf.nz);
+      sort_slices(bspans->order, residual+dimf.nz, dimb.nz);
+      free(residual);
+   }
+
+   free(slice_sums);
+   free(total);
+}
+
+// Returns the METRIC cost of one transformation T, see cost_engine().
+template <class METRIC, class INTERP>
+float8 cost_engine_single(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans)
+{
+   float8 cost;
+
+   cost_engine<METRIC,INTERP>(T, 1, dimb, dimf, sclbim, sclfim, bspans, fspans, INFINITY, &cost);
+
+   return(cost);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Halfway-space cost functions (-halfway)
+//
+// Instead of a forward pass over the masked follow-up voxels and an inverse pass over the masked
+// baseline voxels, both images are sampled once at the masked voxels of the PIL brain cloud grid.
+// Tinter is split by sqrt_matrix() so that this grid sits halfway between the two images: the 
+// follow-up image is sampled at inverse(sqrt(Tinter)) and the baseline image at sqrt(Tinter), 
+// which keeps the cost unbiased toward either timepoint with half the voxel work.  The mask is 
+// the brain cloud itself, from which both image masks are derived.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+void sqrt_matrix(float4 *T, float4 *sqrtT, float4 *invsqrtT);
+
+// The halfway space.  With -halfway the search passes Tinter itself to the cost functions
+// (identity fTPIL and ibTPIL), and the PIL transformations are kept here.
+struct MIDSPACE
+{
+   DIM dim;          // brain cloud grid
+   MASKSPANS *spans; // masked brain cloud voxels (their values are not used)
+   float4 ifTPIL[16]; // PIL to follow-up
+   float4 ibTPIL[16]; // PIL to baseline
+};
+
+MIDSPACE *midspace=NULL; // set by symmetric_registration() with -halfway
+
+// Adds to sum[m] the METRIC sums of slice k of the halfway grid, where Tf[m] and Tb[m] take its
+// voxel indices to follow-up and baseline voxel indices.
+template <class METRIC, class INTERP>
+static inline void halfway_slice(METRIC &metric, int k, MASKSPANS *spans, DIM &dim, float4 (*Tf)[16], float4 (*Tb)[16], 
+int K, float4 *sclbim, DIM &dimb, float4 *sclfim, DIM &dimf, typename METRIC::SUMS *sum)
+{
+   SPAN *span;
+   float4 p0, p1, p2;
+   float4 f[MAXBATCH][3], b[MAXBATCH][3]; // row offsets
+   float4 nx2, ny2, nz2;
+   float4 fsample, bsample;
+
+   nx2 = (dim.nx-1)/2.0;
+   ny2 = (dim.ny-1)/2.0;
+   nz2 = (dim.nz-1)/2.0;
+
+   p2 = (k-nz2);
+
+   for(int s=spans->first[k]; s<spans->first[k+1]; s++)
+   {
+      span = spans->span + s;
+      p1 = (span->j-ny2);
+      for(int m=0; m<K; m++)
+      for(int r=0; r<3; r++)
+      {
+         f[m][r] = Tf[m][4*r+1]*p1 + Tf[m][4*r+2]*p2 + Tf[m][4*r+3];
+         b[m][r] = Tb[m][4*r+1]*p1 + Tb[m][4*r+2]*p2 + Tb[m][4*r+3];
+      }
+
+      for(int i=span->i0; i<=span->i1; i++)
+      {
+         p0 = (i-nx2);
+
+         for(int m=0; m<K; m++)
+         {
+            fsample = INTERP::sample(Tf[m][0]*p0 + f[m][0], Tf[m][4]*p0 + f[m][1], Tf[m][8]*p0 + f[m][2], sclfim, dimf);
+            bsample = INTERP::sample(Tb[m][0]*p0 + b[m][0], Tb[m][4]*p0 + b[m][1], Tb[m][8]*p0 + b[m][2], sclbim, dimb);
+            metric.add(sum[m], fsample, bsample);
+         }
+      }
+   }
+}
+
+// The halfway-space counterpart of cost_engine(): T points to K consecutive Tinter matrices.  
+// bspans and fspans are only used by the metrics (see MIMETRIC) and bound is not used.
+template <class METRIC, class INTERP>
+void halfway_engine(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost)
+{
+   typedef typename METRIC::SUMS SUMS;
+
+   METRIC metric(bspans, fspans);
+   MASKSPANS *spans = midspace->spans;
+   DIM dim = midspace->dim;
+   float4 Tf[MAXBATCH][16]; // halfway grid to follow-up voxel indices
+   float4 Tb[MAXBATCH][16]; // halfway grid to baseline voxel indices
+
+   if(K>MAXBATCH)
+   {
+      printf("halfway_engine(): K=%d exceeds MAXBATCH=%d, aborting ...\n", K, MAXBATCH);
+      exit(1);
+   }
+
+   for(int m=0; m<K; m++)
+   {
+      float4 sqrtT[16], invsqrtT[16], M[16], dum[16];
+      int identity=YES;
+
+      for(int e=0; e<16; e++) if( T[16*m+e] != (e%5==0 ? 1.0 : 0.0) ) identity=NO;
+
+      if(identity)
+      {
+         for(int e=0; e<16; e++) sqrtT[e]=invsqrtT[e]=T[16*m+e];
+      }
+      else
+      {
+         sqrt_matrix(T+16*m, sqrtT, invsqrtT);
+      }
+
+      multi(midspace->ifTPIL, 4, 4, invsqrtT, 4, 4, M);
+      voxel_transformations(M, dimf, dim, Tf[m], dum);
+
+      multi(midspace->ibTPIL, 4, 4, sqrtT, 4, 4, M);
+      voxel_transformations(M, dimb, dim, Tb[m], dum);
+   }
+
+   SUMS *slice_sums = NULL;
+   if(METRIC::slicewise) slice_sums = (SUMS *)calloc(dim.nz*K, sizeof(SUMS));
+
+   SUMS *total = (SUMS *)calloc(K, sizeof(SUMS));
+
+   #pragma omp parallel num_threads(opt_threads)
+   {
+      SUMS *thread_sums = NULL;
+      if(!METRIC::slicewise) thread_sums = (SUMS *)calloc(K, sizeof(SUMS));
+
+      #pragma omp for schedule(dynamic)
+      for(int k=0; k<dim.nz; k++)
+      {
+         SUMS *sum = METRIC::slicewise ? slice_sums + k*K : thread_sums;
+         halfway_slice<METRIC,INTERP>(metric, k, spans, dim, Tf, Tb, K, sclbim, dimb, sclfim, dimf, sum);
+      }
+
+      if(!METRIC::slicewise)
+      {
+         #pragma omp critical
+         for(int m=0; m<K; m++) metric.merge(total[m], thread_sums[m]);
+
+         free(thread_sums);
+      }
+   }
+
+   if(METRIC::slicewise)
+   for(int k=0; k<dim.nz; k++)
+   for(int m=0; m<K; m++)
+      metric.merge(total[m], slice_sums[k*K + m]);
+
+   for(int m=0; m<K; m++) cost[m] = metric.cost(total[m]);
+
+   profile_evals += K;
+   profile_voxels += (long long)K*spans->nval;
+
+   free(slice_sums);
+   free(total);
+}
+
+template <class METRIC, class INTERP>
+float8 halfway_engine_single(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans)
+{
+   float8 cost;
+
+   halfway_engine<METRIC,INTERP>(T, 1, dimb, dimf, sclbim, sclfim, bspans, fspans, INFINITY, &cost);
+
+   return(cost);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+float8 ssd_cost_function(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans)
+{
+   return( cost_engine_single<SSDMETRIC,TRILINEAR>(T, dimb, dimf, sclbim, sclfim, bspans, fspans) );
+}
+
+float8 ncc_cost_function(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans)
+{
+   return( cost_engine_single<NCCMETRIC,TRILINEAR>(T, dimb, dimf, sclbim, sclfim, bspans, fspans) );
+}
+
+void ssd_cost_function_batch(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost)
+{
+   cost_engine<SSDMETRIC,TRILINEAR>(T, K, dimb, dimf, sclbim, sclfim, bspans, fspans, bound, cost);
+}
+
+void ncc_cost_function_batch(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost)
+{
+   cost_engine<NCCMETRIC,TRILINEAR>(T, K, dimb, dimf, sclbim, sclfim, bspans, fspans, bound, cost);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Reference cost functions
+//
+// The original scalar SSD and NCC cost functions: every voxel of the masks is visited in order,
+// sampled with linearInterpolator() and added to a single float8 sum on one thread.  They are
+// not used by the registration.  kaiba_bench -validate compares the fast paths (-threads,
+// -simd, -fixed16, -brick, -sample) against them.
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+float8 ssd_cost_reference(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, int2 *bmsk, int2 *fmsk)
+{
+   int kmin_f=0; 
+   int kmax_f=dimf.nz-1;
+   int jmin_f=0; 
+   int jmax_f=dimf.ny-1;
+   int imin_f=0; 
+   int imax_f=dimf.nx-1;
+   int kmin_b=0;
+   int kmax_b=dimb.nz-1;
+   int jmin_b=0;
+   int jmax_b=dimb.ny-1;
+   int imin_b=0;
+   int imax_b=dimb.nx-1;
+
+   float4 *invT;
+   float4 dif;
+   float8 cost=0.0;
+   int v, slice_offset, offset;
+   float4 Tmod[16]; //modified T
+   float4 invTmod[16]; //modified invT
+
+   float4 psub0, psub1, psub2;
+   float4 nxsub2, nysub2, nzsub2; 
+
+   float4 ptrg0, ptrg1, ptrg2;
+   float4 nxtrg2, nytrg2, nztrg2;
+
+   invT = inv4(T);
+
+   nxsub2 = (dimf.nx-1)/2.0;
+   nysub2 = (dimf.ny-1)/2.0;
+   nzsub2 = (dimf.nz-1)/2.0;
+
+   nxtrg2 = (dimb.nx-1)/2.0;
+   nytrg2 = (dimb.ny-1)/2.0;
+   nztrg2 = (dimb.nz-1)/2.0;
+
+   ////////////////////////////////////////
+   Tmod[0] = T[0]*dimf.dx/dimb.dx;
+   Tmod[1] = T[1]*dimf.dy/dimb.dx;
+   Tmod[2] = T[2]*dimf.dz/dimb.dx;
+   Tmod[3] = T[3]/dimb.dx + nxtrg2;
+
+   Tmod[4] = T[4]*dimf.dx/dimb.dy;
+   Tmod[5] = T[5]*dimf.dy/dimb.dy;
+   Tmod[6] = T[6]*dimf.dz/dimb.dy;
+   Tmod[7] = T[7]/dimb.dy + nytrg2;
+
+   Tmod[8] = T[8]*dimf.dx/dimb.dz;
+   Tmod[9] = T[9]*dimf.dy/dimb.dz;
+   Tmod[10] = T[10]*dimf.dz/dimb.dz;
+   Tmod[11] = T[11]/dimb.dz + nztrg2;
+   ////////////////////////////////////////
+   invTmod[0] = invT[0]*dimb.dx/dimf.dx;
+   invTmod[1] = invT[1]*dimb.dy/dimf.dx;
+   invTmod[2] = invT[2]*dimb.dz/dimf.dx;
+   invTmod[3] = invT[3]/dimf.dx + nxsub2;
+
+   invTmod[4] = invT[4]*dimb.dx/dimf.dy;
+   invTmod[5] = invT[5]*dimb.dy/dimf.dy;
+   invTmod[6] = invT[6]*dimb.dz/dimf.dy;
+   invTmod[7] = invT[7]/dimf.dy + nysub2;
+
+   invTmod[8] = invT[8]*dimb.dx/dimf.dz;
+   invTmod[9] = invT[9]*dimb.dy/dimf.dz;
+   invTmod[10] = invT[10]*dimb.dz/dimf.dz;
+   invTmod[11] = invT[11]/dimf.dz + nzsub2;
+   ////////////////////////////////////////
+   
+   float4 t2, t6, t10;
+   float4 t1, t5, t9;
+
+   for(int k=kmin_f; k<=kmax_f; k++)
+   {
+      slice_offset = k*dimf.np;
+      psub2 = (k-nzsub2);
+      t2  = Tmod[2]*psub2  + Tmod[3];
+      t6  = Tmod[6]*psub2  + Tmod[7];
+      t10 = Tmod[10]*psub2 + Tmod[11];
+      for(int j=jmin_f; j<=jmax_f; j++)
+      {
+         offset = slice_offset + j*dimf.nx;
+         psub1 = (j-nysub2);
+         t1 = Tmod[1]*psub1;
+         t5 = Tmod[5]*psub1;
+         t9 = Tmod[9]*psub1;
+         for(int i=imin_f; i<=imax_f; i++)
+         {
+            v = offset + i;
+
+            if( fmsk[v]>0)
+            {
+               psub0 = (i-nxsub2);
+
+               ptrg0 = Tmod[0]*psub0 + t1 + t2;
+               ptrg1 = Tmod[4]*psub0 + t5 + t6;
+               ptrg2 = Tmod[8]*psub0 + t9 + t10;
+
+               dif = sclfim[v] - linearInterpolator(ptrg0, ptrg1, ptrg2, sclbim, dimb.nx, dimb.ny, dimb.nz, dimb.np);
+               cost += (dif*dif);
+            }
+         }
+      }
+   }
+
+   for(int k=kmin_b; k<=kmax_b; k++)
+   {
+      slice_offset = k*dimb.np;
+      ptrg2 = (k-nztrg2);
+      t2  = invTmod[2]*ptrg2  + invTmod[3];
+      t6  = invTmod[6]*ptrg2  + invTmod[7];
+      t10 = invTmod[10]*ptrg2 + invTmod[11];
+      for(int j=jmin_b; j<=jmax_b; j++)
+      {
+         offset = slice_offset + j*dimb.nx;
+         ptrg1 = (j-nytrg2);
+         t1 = invTmod[1]*ptrg1;
+         t5 = invTmod[5]*ptrg1;
+         t9 = invTmod[9]*ptrg1;
+         for(int i=imin_b; i<=imax_b; i++)
+         {
+            v = offset + i;
+
+            if( bmsk[v]>0)
+            {
+               ptrg0 = (i-nxtrg2);
+
+               psub0 = invTmod[0]*ptrg0 + t1 + t2;
+               psub1 = invTmod[4]*ptrg0 + t5 + t6;
+               psub2 = invTmod[8]*ptrg0 + t9 + t10;
+
+               dif = sclbim[v] - linearInterpolator(psub0, psub1, psub2, sclfim, dimf.nx, dimf.ny, dimf.nz, dimf.np);
+               cost += (dif*dif);
+            }
+         }
+      }
+   }
+
+   free(invT);
+   return(cost);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+float8 ncc_cost_reference(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, int2 *bmsk, int2 *fmsk)
+{
+   int kmin_f=0; 
+   int kmax_f=dimf.nz-1;
+   int jmin_f=0; 
+   int jmax_f=dimf.ny-1;
+   int imin_f=0; 
+   int imax_f=dimf.nx-1;
+   int kmin_b=0;
+   int kmax_b=dimb.nz-1;
+   int jmin_b=0;
+   int jmax_b=dimb.ny-1;
+   int imin_b=0;
+   int imax_b=dimb.nx-1;
+
+   int n=0; // number of voxels that take part in the NCC calculation
+   float8 sum1, sum2, sum11, sum22, sum12;
+   float4 subject_image_value, target_image_value;
+
+   float4 *invT;
+   float4 dif;
+   float8 cost=0.0;
+   int v, slice_offset, offset;
+   float4 Tmod[16]; //modified T
+   float4 invTmod[16]; //modified invT
+
+   float4 psub0, psub1, psub2;
+   float4 nxsub2, nysub2, nzsub2; 
+
+   float4 ptrg0, ptrg1, ptrg2;
+   float4 nxtrg2, nytrg2, nztrg2;
+
+   invT = inv4(T);
+
+   nxsub2 = (dimf.nx-1)/2.0;
+   nysub2 = (dimf.ny-1)/2.0;
+   nzsub2 = (dimf.nz-1)/2.0;
+
+   nxtrg2 = (dimb.nx-1)/2.0;
+   nytrg2 = (dimb.ny-1)/2.0;
+   nztrg2 = (dimb.nz-1)/2.0;
+
+   ////////////////////////////////////////
+   Tmod[0] = T[0]*dimf.dx/dimb.dx;
+   Tmod[1] = T[1]*dimf.dy/dimb.dx;
+   Tmod[2] = T[2]*dimf.dz/dimb.dx;
+   Tmod[3] = T[3]/dimb.dx + nxtrg2;
+
+   Tmod[4] = T[4]*dimf.dx/dimb.dy;
+   Tmod[5] = T[5]*dimf.dy/dimb.dy;
+   Tmod[6] = T[6]*dimf.dz/dimb.dy;
+   Tmod[7] = T[7]/dimb.dy + nytrg2;
+
+   Tmod[8] = T[8]*dimf.dx/dimb.dz;
+   Tmod[9] = T[9]*dimf.dy/dimb.dz;
+   Tmod[10] = T[10]*dimf.dz/dimb.dz;
+   Tmod[11] = T[11]/dimb.dz + nztrg2;
+   ////////////////////////////////////////
+   invTmod[0] = invT[0]*dimb.dx/dimf.dx;
+   invTmod[1] = invT[1]*dimb.dy/dimf.dx;
+   invTmod[2] = invT[2]*dimb.dz/dimf.dx;
+   invTmod[3] = invT[3]/dimf.dx + nxsub2;
+
+   invTmod[4] = invT[4]*dimb.dx/dimf.dy;
+   invTmod[5] = invT[5]*dimb.dy/dimf.dy;
+   invTmod[6] = invT[6]*dimb.dz/dimf.dy;
+   invTmod[7] = invT[7]/dimf.dy + nysub2;
+
+   invTmod[8] = invT[8]*dimb.dx/dimf.dz;
+   invTmod[9] = invT[9]*dimb.dy/dimf.dz;
+   invTmod[10] = invT[10]*dimb.dz/dimf.dz;
+   invTmod[11] = invT[11]/dimf.dz + nzsub2;
+   ////////////////////////////////////////
+   
+   float4 t2, t6, t10;
+   float4 t1, t5, t9;
+
+   // initialize sums to zero
+   sum1=sum2=sum11=sum22=sum12=0.0;
+
+   for(int k=kmin_f; k<=kmax_f; k++)
+   {
+      slice_offset = k*dimf.np;
+      psub2 = (k-nzsub2);
+      t2  = Tmod[2]*psub2  + Tmod[3];
+      t6  = Tmod[6]*psub2  + Tmod[7];
+      t10 = Tmod[10]*psub2 + Tmod[11];
       for(int j=jmin_f; j<=jmax_f; j++)
       {
-         offset = slice_offset + j*dimf.nx;
-         psub1 = (j-nysub2);
-         t1 = Tmod[1]*psub1;
-         t5 = Tmod[5]*psub1;
-         t9 = Tmod[9]*psub1;
-         for(int i=imin_f; i<=imax_f; i++)
-         {
-            v = offset + i;
+         offset = slice_offset + j*dimf.nx;
+         psub1 = (j-nysub2);
+         t1 = Tmod[1]*psub1;
+         t5 = Tmod[5]*psub1;
+         t9 = Tmod[9]*psub1;
+         for(int i=imin_f; i<=imax_f; i++)
+         {
+            v = offset + i;
+
+            if( fmsk[v]>0)
+            {
+               n++;
+
+               psub0 = (i-nxsub2);
+
+               ptrg0 = Tmod[0]*psub0 + t1 + t2;
+               ptrg1 = Tmod[4]*psub0 + t5 + t6;
+               ptrg2 = Tmod[8]*psub0 + t9 + t10;
+
+               subject_image_value = sclfim[v];
+               target_image_value = linearInterpolator(ptrg0, ptrg1, ptrg2, sclbim, dimb.nx, dimb.ny, dimb.nz, dimb.np);
+               sum1 += subject_image_value;
+               sum2 += target_image_value;
+               sum12 += (subject_image_value*target_image_value);
+               sum11 += (subject_image_value*subject_image_value);
+               sum22 += (target_image_value*target_image_value);
+            }
+         }
+      }
+   }
+
+   for(int k=kmin_b; k<=kmax_b; k++)
+   {
+      slice_offset = k*dimb.np;
+      ptrg2 = (k-nztrg2);
+      t2  = invTmod[2]*ptrg2  + invTmod[3];
+      t6  = invTmod[6]*ptrg2  + invTmod[7];
+      t10 = invTmod[10]*ptrg2 + invTmod[11];
+      for(int j=jmin_b; j<=jmax_b; j++)
+      {
+         offset = slice_offset + j*dimb.nx;
+         ptrg1 = (j-nytrg2);
+         t1 = invTmod[1]*ptrg1;
+         t5 = invTmod[5]*ptrg1;
+         t9 = invTmod[9]*ptrg1;
+         for(int i=imin_b; i<=imax_b; i++)
+         {
+            v = offset + i;
+
+            if( bmsk[v]>0)
+            {
+               n++;
+
+               ptrg0 = (i-nxtrg2);
+
+               psub0 = invTmod[0]*ptrg0 + t1 + t2;
+               psub1 = invTmod[4]*ptrg0 + t5 + t6;
+               psub2 = invTmod[8]*ptrg0 + t9 + t10;
+
+               subject_image_value = linearInterpolator(psub0, psub1, psub2, sclfim, dimf.nx, dimf.ny, dimf.nz, dimf.np);
+               target_image_value = sclbim[v];
+
+               sum1 += subject_image_value;
+               sum2 += target_image_value;
+               sum12 += (subject_image_value*target_image_value);
+               sum11 += (subject_image_value*subject_image_value);
+               sum22 += (target_image_value*target_image_value);
+            }
+         }
+      }
+   }
+
+   free(invT);
+
+   if( n > 0 )
+   {
+//      cost = (sum12 - sum1*sum2/n);
+      cost = -(sum12 - sum1*sum2/n);  // since it is a minimization problem
+      cost /= sqrt( sum11 - sum1*sum1/n ); 
+      cost /= sqrt( sum22 - sum2*sum2/n ); 
+   }
+
+   return(cost);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef float8 (*COSTFUNCTION)(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans);
+typedef void (*BATCHCOSTFUNCTION)(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost);
+
+// When set, register_images() searches with these instead of the cost functions of 
+// select_cost_function().  kaiba_bench -validate sets them to the scalar reference cost functions.
+COSTFUNCTION registration_cost_function=NULL;
+BATCHCOSTFUNCTION registration_batch_cost_function=NULL;
+
+template <class METRIC>
+static void select_interpolator(int interp, COSTFUNCTION &cost_function, BATCHCOSTFUNCTION &batch_cost_function)
+{
+   if(opt_halfway)
+   {
+      if(interp==INTERP_NEAREST)
+      {
+         cost_function = halfway_engine_single<METRIC,NEAREST>;
+         batch_cost_function = halfway_engine<METRIC,NEAREST>;
+      }
+      else
+      {
+         cost_function = halfway_engine_single<METRIC,TRILINEAR>;
+         batch_cost_function = halfway_engine<METRIC,TRILINEAR>;
+      }
+      return;
+   }
+
+   if(interp==INTERP_NEAREST)
+   {
+      cost_function = cost_engine_single<METRIC,NEAREST>;
+      batch_cost_function = cost_engine<METRIC,NEAREST>;
+   }
+   else
+   {
+      cost_function = cost_engine_single<METRIC,TRILINEAR>;
+      batch_cost_function = cost_engine<METRIC,TRILINEAR>;
+   }
+}
+
+// Sets cost_function and batch_cost_function to the specialization of cost_engine(), or of 
+// halfway_engine() with -halfway, for the given metric and interpolator.
+void select_cost_function(int metric, int interp, COSTFUNCTION &cost_function, BATCHCOSTFUNCTION &batch_cost_function)
+{
+   switch(metric)
+   {
+      case COST_NCC:
+         select_interpolator<NCCMETRIC>(interp, cost_function, batch_cost_function);
+         break;
+      case COST_MI:
+         select_interpolator< MIMETRIC<NO> >(interp, cost_function, batch_cost_function);
+         break;
+      case COST_NMI:
+         select_interpolator< MIMETRIC<YES> >(interp, cost_function, batch_cost_function);
+         break;
+      default:
+         select_interpolator<SSDMETRIC>(interp, cost_function, batch_cost_function);
+   }
+}
+
+// Sets opt_metric and opt_interp from the argument of -cost, e.g. "ncc" or "ssd:nearest".
+void parse_cost_option(const char *arg)
+{
+   char metric[64]="", interp[64]="trilinear";
+
+   sscanf(arg, "%63[^:]:%63s", metric, interp);
+
+   if( strcmp(metric,"ssd")==0 ) opt_metric=COST_SSD;
+   else if( strcmp(metric,"ncc")==0 ) opt_metric=COST_NCC;
+   else if( strcmp(metric,"mi")==0 ) opt_metric=COST_MI;
+   else if( strcmp(metric,"nmi")==0 ) opt_metric=COST_NMI;
+   else
+   {
+      printf("Unknown cost function metric: %s\n", metric);
+      exit(1);
+   }
+
+   if( strcmp(interp,"trilinear")==0 ) opt_interp=INTERP_TRILINEAR;
+   else if( strcmp(interp,"nearest")==0 ) opt_interp=INTERP_NEAREST;
+   else
+   {
+      printf("Unknown cost function interpolator: %s\n", interp);
+      exit(1);
+   }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// This function computes and returns a 4x4 transformation matrix T.
+// Applying this transformation to a point p=(x',y',z') in the image
+// coordinates system (ICS) yields the coordinates (x,y,z) of the same point with
+// respect to the magnet coordinates system.  That is: (x,y,z)=T(x',y',z').
+// In ART, the origin of the ICS is the center of the image
+// volume.  The x-axis in the ICS is pointing to the right of the image
+// (which is not necessarily the right of the subject!).  The y-axis in the
+// ICS is pointing down.  The z-axis is determined by the right-hand-rule.
+void transformation_to_magnet_coordinates(nifti_1_header hdr, float4 *T)
+{
+   float4 rowvec[3];
+   float4 columnvec[3];
+   float4 normalvec[3];
+   float4 centervec[3];
+
+   //printf("sizeof_hdr = %d\n", hdr.sizeof_hdr);
+   //printf("number of dimensions = %d\n", hdr.dim[0]);
+   //printf("matrix size = %d x %d x %d\n", hdr.dim[1], hdr.dim[2], hdr.dim[3]);
+   //printf("voxel size = %8.6f x %8.6f x %8.6f\n", hdr.pixdim[1], hdr.pixdim[2], hdr.pixdim[3]);
+   //printf("datatype = %d\n",hdr.datatype);
+   //printf("vox_offset = %d\n", (int)hdr.vox_offset);
+   //printf("qform_code = %d\n", hdr.qform_code);
+   //printf("sform_code = %d\n", hdr.sform_code);
+   //printf("magic code = %s\n", hdr.magic);
+   //printf("srow_x: %f %f %f %f\n", hdr.srow_x[0],hdr.srow_x[1],hdr.srow_x[2],hdr.srow_x[3]);
+   //printf("srow_y: %f %f %f %f\n", hdr.srow_y[0],hdr.srow_y[1],hdr.srow_y[2],hdr.srow_y[3]);
+   //printf("srow_z: %f %f %f %f\n", hdr.srow_z[0],hdr.srow_z[1],hdr.srow_z[2],hdr.srow_z[3]);
+   //printf("quatern_b = %f\n", hdr.quatern_b);
+   //printf("quatern_c = %f\n", hdr.quatern_c);
+   //printf("quatern_d = %f\n", hdr.quatern_d);
+   //printf("qoffset_x = %f\n",hdr.qoffset_x);
+   //printf("qoffset_y = %f\n",hdr.qoffset_y);
+   //printf("qoffset_z = %f\n",hdr.qoffset_z);
+
+   int nx,ny,nz;
+   float4 dx,dy,dz;
+
+   nx = hdr.dim[1];
+   ny = hdr.dim[2];
+   nz = hdr.dim[3];
+
+   dx=hdr.pixdim[1];
+   dy=hdr.pixdim[2];
+   dz=hdr.pixdim[3];
+
+   if(hdr.qform_code>0 )
+   {
+      float4 dum;
+      mat44 R;
+   
+      R=nifti_quatern_to_mat44( hdr.quatern_b, hdr.quatern_c, hdr.quatern_d,
+      hdr.qoffset_x, hdr.qoffset_y, hdr.qoffset_z, dx, dy, dz, hdr.pixdim[0]);
+
+      dum = R.m[0][0]*R.m[0][0] + R.m[1][0]*R.m[1][0] + R.m[2][0]*R.m[2][0];
+      dum = sqrtf(dum);
+
+      if(dum != 0.0)
+      {
+         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+         rowvec[0]=-R.m[0][0]/dum;
+         rowvec[1]=R.m[1][0]/dum;
+         rowvec[2]=-R.m[2][0]/dum;
+      }
+      else
+      {
+         rowvec[0]=1.0;
+         rowvec[1]=0.0;
+         rowvec[2]=0.0;
+      }
+
+      dum = R.m[0][1]*R.m[0][1] + R.m[1][1]*R.m[1][1] + R.m[2][1]*R.m[2][1];
+      dum = sqrtf(dum);
+
+      if(dum != 0.0)
+      {
+         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+         columnvec[0]=-R.m[0][1]/dum;
+         columnvec[1]=R.m[1][1]/dum;
+         columnvec[2]=-R.m[2][1]/dum;
+      }
+      else
+      {
+         columnvec[0]=0.0;
+         columnvec[1]=1.0;
+         columnvec[2]=0.0;
+      }
+
+      dum = R.m[0][2]*R.m[0][2] + R.m[1][2]*R.m[1][2] + R.m[2][2]*R.m[2][2];
+      dum = sqrtf(dum);
+
+      if(dum != 0.0)
+      {
+         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+         normalvec[0]=-R.m[0][2]/dum;
+         normalvec[1]=R.m[1][2]/dum;
+         normalvec[2]=-R.m[2][2]/dum;
+      }
+      else
+      {
+         normalvec[0]=0.0;
+         normalvec[1]=0.0;
+         normalvec[2]=1.0;
+      }
+
+      // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+      centervec[0] = -R.m[0][3] +
+      rowvec[0] * dx*(nx-1.0)/2.0 +
+      columnvec[0] * dy*(ny-1.0)/2.0;
+
+      centervec[1] = R.m[1][3] +
+      rowvec[1] * dx*(nx-1.0)/2.0 +
+      columnvec[1] * dy*(ny-1.0)/2.0;
+
+      centervec[2] = -R.m[2][3] +
+      rowvec[2] * dx*(nx-1.0)/2.0 +
+      columnvec[2] * dy*(ny-1.0)/2.0; 
+   }
+   else if(hdr.sform_code>0)
+   {
+      float4 dum;
+
+      dum = hdr.srow_x[0]*hdr.srow_x[0] + hdr.srow_y[0]*hdr.srow_y[0] + hdr.srow_z[0]*hdr.srow_z[0];
+      dum = sqrtf(dum);
+
+      if(dum != 0.0)
+      {
+         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+         rowvec[0]=-hdr.srow_x[0]/dum;
+         rowvec[1]=hdr.srow_y[0]/dum;
+         rowvec[2]=-hdr.srow_z[0]/dum;
+      }
+      else
+      {
+         rowvec[0]=1.0;
+         rowvec[1]=0.0;
+         rowvec[2]=0.0;
+      }
+
+      dum= hdr.srow_x[1]*hdr.srow_x[1] + hdr.srow_y[1]*hdr.srow_y[1] + hdr.srow_z[1]*hdr.srow_z[1];
+      dum = sqrtf(dum);
+
+      if(dum != 0.0)
+      {
+         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+         columnvec[0]=-hdr.srow_x[1]/dum;
+         columnvec[1]=hdr.srow_y[1]/dum;
+         columnvec[2]=-hdr.srow_z[1]/dum;
+      }
+      else
+      {
+         columnvec[0]=0.0;
+         columnvec[1]=1.0;
+         columnvec[2]=0.0;
+      }
+
+      dum= hdr.srow_x[2]*hdr.srow_x[2] + hdr.srow_y[2]*hdr.srow_y[2] + hdr.srow_z[2]*hdr.srow_z[2];
+      dum = sqrtf(dum);
+
+      if(dum != 0.0)
+      {
+         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+         normalvec[0]=-hdr.srow_x[2]/dum;
+         normalvec[1]=hdr.srow_y[2]/dum;
+         normalvec[2]=-hdr.srow_z[2]/dum;
+      }
+      else
+      {
+         normalvec[0]=0.0;
+         normalvec[1]=0.0;
+         normalvec[2]=1.0;
+      }
+
+      // note that the -tive signs converts from NIFTI's RAS to ART's LAI
+      centervec[0] = -hdr.srow_x[3] +
+      rowvec[0] * dx*(nx-1.0)/2.0 +
+      columnvec[0] * dy*(ny-1.0)/2.0;
+
+      centervec[1] = hdr.srow_y[3] +
+      rowvec[1] * dx*(nx-1.0)/2.0 +
+      columnvec[1] * dy*(ny-1.0)/2.0;
+
+      centervec[2] = -hdr.srow_z[3] +
+      rowvec[2] * dx*(nx-1.0)/2.0 +
+      columnvec[2] * dy*(ny-1.0)/2.0; 
+   }
+   else
+   {
+      printf("\n**WARNING**: NIFTI header did not contain image orientation information.\n\n");
+   }
+
+   //printf("Center Vector = (%7.5lf %7.5lf %7.5lf)\n", centervec[0],centervec[1], centervec[2]);
+   //printf("Normal Vector = (%7.5lf %7.5lf %7.5lf)\n", normalvec[0],normalvec[1], normalvec[2]);
+   //printf("Row Vector = (%7.5lf %7.5lf %7.5lf)\n", rowvec[0],rowvec[1], rowvec[2]);
+   //printf("Column Vector = (%7.5lf %7.5lf %7.5lf)\n", columnvec[0],columnvec[1], columnvec[2]);
+
+   for(int i=0; i<16; i++) T[i]=0.0;
+
+   // The fifteenth element (i.e., element 4,4) is always 1.0.
+   T[15]=1.0;
+   
+   T[0] = rowvec[0];
+   T[4] = rowvec[1];
+   T[8] = rowvec[2];
+
+   T[1] = columnvec[0];
+   T[5] = columnvec[1];
+   T[9] = columnvec[2];
+
+   T[2] = normalvec[0];
+   T[6] = normalvec[1];
+   T[10]= normalvec[2];
+
+   T[3] = centervec[0] + (dz*(nz-1.0)/2.0)*normalvec[0];
+   T[7] = centervec[1] + (dz*(nz-1.0)/2.0)*normalvec[1];
+   T[11]= centervec[2] + (dz*(nz-1.0)/2.0)*normalvec[2];
+
+   return;
+}
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+void atra_to_fsl(float4 *Matra, float4 *Mfsl, DIM dimf, DIM trg_dim)
+{
+   float4 Tsub[16], Ttrg[16];
+   float4 *inv_Tsub;
+
+   Tsub[0]=1.0;  Tsub[1]=0.0;  Tsub[2]=0.0;  Tsub[3]=(dimf.nx-1.0)*dimf.dx/2.0;
+   Tsub[4]=0.0;  Tsub[5]=1.0;  Tsub[6]=0.0;  Tsub[7]=(dimf.ny-1.0)*dimf.dy/2.0;
+   Tsub[8]=0.0;  Tsub[9]=0.0;  Tsub[10]=1.0; Tsub[11]=(dimf.nz-1.0)*dimf.dz/2.0;
+   Tsub[12]=0.0; Tsub[13]=0.0; Tsub[14]=0.0; Tsub[15]=1.0;
+
+   Ttrg[0]=1.0;  Ttrg[1]=0.0;  Ttrg[2]=0.0;  Ttrg[3]=(trg_dim.nx-1.0)*trg_dim.dx/2.0;
+   Ttrg[4]=0.0;  Ttrg[5]=1.0;  Ttrg[6]=0.0;  Ttrg[7]=(trg_dim.ny-1.0)*trg_dim.dy/2.0;
+   Ttrg[8]=0.0;  Ttrg[9]=0.0;  Ttrg[10]=1.0; Ttrg[11]=(trg_dim.nz-1.0)*trg_dim.dz/2.0;
+   Ttrg[12]=0.0; Ttrg[13]=0.0; Ttrg[14]=0.0; Ttrg[15]=1.0;
+
+   inv_Tsub = inv4(Tsub);
+
+   multi(Ttrg,4,4,Matra,4,4,Mfsl);
+   multi(Mfsl,4,4,inv_Tsub,4,4, Mfsl);
+
+   free(inv_Tsub);
+}
+
+/////////////////////////////////////////////////
+// find sqrt(T) and inverse_sqrt(T)
+/////////////////////////////////////////////////
+void sqrt_matrix(float4 *T, float4 *sqrtT, float4 *invsqrtT)
+{
+   float4 w[3], v[3];
+   float4 theta;
+
+   SE3_to_se3(T, w, v, theta);
+
+   theta /= 2.0;
+   se3_to_SE3(sqrtT, w, v, theta);
+
+   theta *= -1.0;
+   se3_to_SE3(invsqrtT, w, v, theta);
+
+   return;
+}
+
+/////////////////////////////////////////////////
+// Multi-resolution pyramid
+/////////////////////////////////////////////////
+
+// Linear interpolation of line[] at non-integer index x, with clamping at the two ends.
+static inline float4 interpolate_line(float4 *line, int n, int stride, float4 x)
+{
+   int i;
+   float4 w;
+
+   if(x<=0.0) return(line[0]);
+   if(x>=n-1) return(line[(n-1)*stride]);
+
+   i = (int)x;
+   w = x-i;
+
+   return( (1.0-w)*line[i*stride] + w*line[(i+1)*stride] );
+}
+
+// Halves the number of samples on a line of n samples.  The output sample i is centered 
+// at x = (n-1)/2 + 2*(i - (nout-1)/2) of the input line and is the average of the input 
+// interpolated at x-0.5 and x+0.5.  This way the centers of the input and output lines, 
+// which are the origin of the ICS, coincide for both even and odd n.
+static void halve_line(float4 *in, int n, int instride, float4 *out, int nout, int outstride)
+{
+   float4 x;
+
+   for(int i=0; i<nout; i++)
+   {
+      x = (n-1)/2.0 + 2.0*(i - (nout-1)/2.0);
+      out[i*outstride] = 0.5*( interpolate_line(in, n, instride, x-0.5) + interpolate_line(in, n, instride, x+0.5) );
+   }
+}
+
+// Returns a copy of im downsampled by a factor of 2 along each axis.  The dimensions 
+// of the returned image are set in dsdim.
+float4 *downsample_image(float4 *im, DIM dim, DIM &dsdim)
+{
+   float4 *tmp1, *tmp2, *dsim;
+
+   dsdim.nx = (dim.nx+1)/2;
+   dsdim.ny = (dim.ny+1)/2;
+   dsdim.nz = (dim.nz+1)/2;
+   dsdim.np = dsdim.nx*dsdim.ny;
+   dsdim.nv = dsdim.np*dsdim.nz;
+   dsdim.dx = 2.0*dim.dx;
+   dsdim.dy = 2.0*dim.dy;
+   dsdim.dz = 2.0*dim.dz;
+
+   tmp1 = (float4 *)calloc(dsdim.nx*dim.ny*dim.nz, sizeof(float4));
+   tmp2 = (float4 *)calloc(dsdim.nx*dsdim.ny*dim.nz, sizeof(float4));
+   dsim = (float4 *)calloc(dsdim.nv, sizeof(float4));
+
+   // x-direction: (nx,ny,nz) -> (dsnx,ny,nz)
+   for(int k=0; k<dim.nz; k++)
+   for(int j=0; j<dim.ny; j++)
+      halve_line(im + k*dim.np + j*dim.nx, dim.nx, 1, tmp1 + (k*dim.ny + j)*dsdim.nx, dsdim.nx, 1);
+
+   // y-direction: (dsnx,ny,nz) -> (dsnx,dsny,nz)
+   for(int k=0; k<dim.nz; k++)
+   for(int i=0; i<dsdim.nx; i++)
+      halve_line(tmp1 + k*dim.ny*dsdim.nx + i, dim.ny, dsdim.nx, tmp2 + k*dsdim.np + i, dsdim.ny, dsdim.nx);
+
+   // z-direction: (dsnx,dsny,nz) -> (dsnx,dsny,dsnz)
+   for(int v=0; v<dsdim.np; v++)
+      halve_line(tmp2 + v, dim.nz, dsdim.np, dsim + v, dsdim.nz, dsdim.np);
+
+   free(tmp1);
+   free(tmp2);
+
+   return(dsim);
+}
+
+// Returns a copy of the mask msk downsampled by a factor of 2 along each axis.  A voxel
+// of the returned mask is set if at least half of the region it covers was in msk.
+int2 *downsample_mask(int2 *msk, DIM dim, DIM &dsdim)
+{
+   float4 *fmsk, *dsfmsk;
+   int2 *dsmsk;
+
+   fmsk = (float4 *)calloc(dim.nv, sizeof(float4));
+   for(int v=0; v<dim.nv; v++) fmsk[v] = (msk[v]>0) ? 1.0 : 0.0;
+
+   dsfmsk = downsample_image(fmsk, dim, dsdim);
+
+   dsmsk = (int2 *)calloc(dsdim.nv, sizeof(int2));
+   for(int v=0; v<dsdim.nv; v++) dsmsk[v] = (dsfmsk[v]>=0.5) ? 100 : 0;
+
+   free(fmsk);
+   free(dsfmsk);
+
+   return(dsmsk);
+}
+
+/////////////////////////////////////////////////
+
+// Costs already evaluated by coordinate_search(), keyed on the exact parameter vector P.
+// Costs above the bound of the batched cost function may have been abandoned early and are
+// only lower bounds.  They still rule their P out, since mincost never increases.
+struct COSTCACHE
+{
+   int n;
+   int hits, misses;
+   float4 P[COSTCACHE_SIZE][6];
+   float8 cost[COSTCACHE_SIZE];
+   char used[COSTCACHE_SIZE];
+};
+
+static unsigned int cost_cache_slot(float4 *P)
+{
+   unsigned int h=2166136261u;
+   unsigned char *b;
+   float4 x;
+
+   for(int j=0; j<6; j++)
+   {
+      x = P[j] + 0.0f; // -0 and +0 give the same transformation
+      b = (unsigned char *)&x;
+      for(int c=0; c<(int)sizeof(float4); c++) { h ^= b[c]; h *= 16777619u; }
+   }
+
+   return( h & (COSTCACHE_SIZE-1) );
+}
+
+// Returns the slot of P in the cache, or of the empty slot where it belongs.
+static int cost_cache_find(COSTCACHE *cache, float4 *P)
+{
+   unsigned int s = cost_cache_slot(P);
+
+   while( cache->used[s] )
+   {
+      if( P[0]+0.0f==cache->P[s][0] && P[1]+0.0f==cache->P[s][1] && P[2]+0.0f==cache->P[s][2] && 
+          P[3]+0.0f==cache->P[s][3] && P[4]+0.0f==cache->P[s][4] && P[5]+0.0f==cache->P[s][5] ) break;
+      s = (s+1) & (COSTCACHE_SIZE-1);
+   }
+
+   return(s);
+}
+
+// Returns 1 and the cost of P in cost if P is in the cache.
+static int cost_cache_lookup(COSTCACHE *cache, float4 *P, float8 &cost)
+{
+   int s = cost_cache_find(cache, P);
+
+   if( !cache->used[s] ) 
+   {
+      cache->misses++;
+      return(0);
+   }
+
+   cache->hits++;
+   cost = cache->cost[s];
+   return(1);
+}
+
+// Adds the cost of P to the cache.  The cache stops growing when half full, to keep the probe
+// sequences short.
+static void cost_cache_store(COSTCACHE *cache, float4 *P, float8 cost)
+{
+   int s;
+
+   if( 2*cache->n >= COSTCACHE_SIZE ) return;
+
+   s = cost_cache_find(cache, P);
+   if( cache->used[s] ) return;
+
+   for(int j=0; j<6; j++) cache->P[s][j] = P[j]+0.0f;
+   cache->cost[s] = cost;
+   cache->used[s] = YES;
+   cache->n++;
+}
+
+// Minimizes the registration cost over the six rigid-body parameters P of Tinter ("ZXYT"
+// convention) by a coordinate-wise grid search with the given stepsize and interval iP.
+// The search starts from the values in P and the solution is returned in P.
+// The transformation T = ibTPIL * Tinter * fTPIL takes the follow-up to the baseline image.
+float8 coordinate_search(float4 *P, float4 *stepsize, float4 *iP, float4 *fTPIL, float4 *ibTPIL, 
+DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans,
+float8 (*cost_function)(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans),
+void (*batch_cost_function)(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost),
+int verbose)
+{
+   float8 relative_change;
+   float8 mincost, oldmincost;
+   float4 Pbatch[MAXBATCH]; // values of P[i] of one batch
+   float8 costbatch[MAXBATCH]; // corresponding costs
+   int slot[MAXBATCH]; // index of P[i] among the transformations evaluated, -1 if cached
+   float4 Tbatch[16*MAXBATCH]; // transformation matrices of the batch not found in the cache
+   float8 costeval[MAXBATCH]; // and their costs
+   float4 Pmax, Pkey[6];
+   int K, N;
+   COSTCACHE *cache;
+   float4 Pmin[6];
+   float4 T[16];
+   float4 Tinter[16];
+
+   for(int j=0; j<6; j++) Pmin[j]=P[j];
+
+   set_transformation(P[0], P[1], P[2], P[3], P[4], P[5], "ZXYT", Tinter);
+   multi(Tinter, 4, 4,  fTPIL, 4,  4, T);
+   multi(ibTPIL, 4, 4,  T, 4,  4, T);
+   oldmincost = mincost = cost_function(T, dimb, dimf, sclbim, sclfim, bspans, fspans);
+
+   // The cost of a parameter vector is only computed once per search.
+   cache = (COSTCACHE *)calloc(1, sizeof(COSTCACHE));
+   cost_cache_store(cache, P, mincost);
+
+   if(verbose)
+   {
+      printf("Tolerance = %3.1e\n",TOLERANCE);
+      printf("Initial cost = %f\n", mincost);
+   }
+
+   for(int iter=1; iter<=MAXITER; iter++)
+   {
+      int stage = profile_begin("grid search iteration %d", iter);
+
+      if(verbose)
+      {
+         printf("Iteration %d ...\n",iter);
+      }
 
-            if( fmsk[v]>0)
+      for(int i=0; i<6; i++)
+      {
+         // The samples of P[i] are evaluated in batches with one pass over the images.
+         // Since the search interval moves with Pmin[i], the samples beyond the
+         // interval of the current batch are picked up by the next batch, and those of a batch
+         // beyond the interval of a new minimum are evaluated but not visited.
+         P[i] = Pmin[i]-iP[i];
+         while( P[i]<=Pmin[i]+iP[i] )
+         {
+            Pmax = Pmin[i]+iP[i];
+            for(N=0, K=0; N<MAXBATCH && P[i]<=Pmax; N++, P[i]+=stepsize[i] )
             {
-               n++;
+               Pbatch[N]=P[i];
+               slot[N] = -1;
+               if( cost_cache_lookup(cache, P, costbatch[N]) ) continue;
 
-               psub0 = (i-nxsub2);
+               slot[N] = K;
+               set_transformation(P[0], P[1], P[2], P[3], P[4], P[5], "ZXYT", Tinter);
+               multi(Tinter, 4, 4,  fTPIL, 4,  4, T);
+               multi(ibTPIL, 4, 4,  T, 4,  4, Tbatch+16*K);
+               K++;
+            }
 
-               ptrg0 = Tmod[0]*psub0 + t1 + t2;
-               ptrg1 = Tmod[4]*psub0 + t5 + t6;
-               ptrg2 = Tmod[8]*psub0 + t9 + t10;
+            // only the costs below mincost matter, so the others may be abandoned early
+            if(K>0) batch_cost_function(Tbatch, K, dimb, dimf, sclbim, sclfim, bspans, fspans, mincost, costeval);
 
-               subject_image_value = sclfim[v];
-               target_image_value = linearInterpolator(ptrg0, ptrg1, ptrg2, sclbim, dimb.nx, dimb.ny, dimb.nz, dimb.np);
-               sum1 += subject_image_value;
-               sum2 += target_image_value;
-               sum12 += (subject_image_value*target_image_value);
-               sum11 += (subject_image_value*subject_image_value);
-               sum22 += (target_image_value*target_image_value);
+            for(int j=0; j<6; j++) Pkey[j]=P[j];
+            for(int m=0; m<N; m++)
+            {
+               if( slot[m]<0 ) continue;
+               costbatch[m] = costeval[slot[m]];
+               Pkey[i] = Pbatch[m];
+               cost_cache_store(cache, Pkey, costbatch[m]);
+            }
+
+            // The samples are accepted in order, and the scan ends as soon as a sample lies 
+            // beyond the interval of the current Pmin[i], as in a sample-by-sample scan.
+            for(int m=0; m<N; m++)
+            {
+               if( Pbatch[m] > Pmin[i]+iP[i] ) break;
+
+               if( costbatch[m] < mincost )
+               {
+                  Pmin[i]=Pbatch[m];
+                  mincost = costbatch[m];
+               }
             }
          }
+         P[i]=Pmin[i];
+
+         if(verbose)
+         {
+            printf("P0=%f P1=%f P2=%f P3=%f P4=%f P5=%f\n", Pmin[0], Pmin[1], Pmin[2], Pmin[3], Pmin[4], Pmin[5]);
+         }
+      }
+
+      if(oldmincost != 0.0)
+      {
+        relative_change=(oldmincost-mincost)/fabs(oldmincost);
+      }
+      else
+      {
+        relative_change=0.0;
+      }
+
+      if(verbose)
+      {
+         printf("Cost = %f\n", mincost);
+         printf("Relative change = %3.1e x 100%\n", relative_change );
       }
+
+      profile_end(stage);
+
+      if( oldmincost==0.0 || relative_change <= TOLERANCE )
+         break;
+      else
+         oldmincost = mincost;
    }
 
-   for(int k=kmin_b; k<=kmax_b; k++)
+   if(verbose)
    {
-      slice_offset = k*dimb.np;
-      ptrg2 = (k-nztrg2);
-      t2  = invTmod[2]*ptrg2  + invTmod[3];
-      t6  = invTmod[6]*ptrg2  + invTmod[7];
-      t10 = invTmod[10]*ptrg2 + invTmod[11];
-      for(int j=jmin_b; j<=jmax_b; j++)
+      printf("Cost cache: %d hits, %d misses\n", cache->hits, cache->misses);
+   }
+
+   free(cache);
+
+   return(mincost);
+}
+
+/////////////////////////////////////////////////
+// Gauss-Newton optimization with analytic gradients
+/////////////////////////////////////////////////
+
+// Returns the x, y and z derivatives of im (in voxel units) as three images computed 
+// by central differences, with one-sided differences on the faces of the volume.
+float4 **image_gradient(float4 *im, DIM dim)
+{
+   float4 **g;
+   int v;
+
+   g = (float4 **)calloc(3, sizeof(float4 *));
+   for(int d=0; d<3; d++) g[d] = (float4 *)calloc(dim.nv, sizeof(float4));
+
+   for(int k=0; k<dim.nz; k++)
+   for(int j=0; j<dim.ny; j++)
+   for(int i=0; i<dim.nx; i++)
+   {
+      v = k*dim.np + j*dim.nx + i;
+
+      if(dim.nx>1)
       {
-         offset = slice_offset + j*dimb.nx;
-         ptrg1 = (j-nytrg2);
-         t1 = invTmod[1]*ptrg1;
-         t5 = invTmod[5]*ptrg1;
-         t9 = invTmod[9]*ptrg1;
-         for(int i=imin_b; i<=imax_b; i++)
+         if(i==0) g[0][v] = im[v+1]-im[v];
+         else if(i==dim.nx-1) g[0][v] = im[v]-im[v-1];
+         else g[0][v] = (im[v+1]-im[v-1])/2.0;
+      }
+
+      if(dim.ny>1)
+      {
+         if(j==0) g[1][v] = im[v+dim.nx]-im[v];
+         else if(j==dim.ny-1) g[1][v] = im[v]-im[v-dim.nx];
+         else g[1][v] = (im[v+dim.nx]-im[v-dim.nx])/2.0;
+      }
+
+      if(dim.nz>1)
+      {
+         if(k==0) g[2][v] = im[v+dim.np]-im[v];
+         else if(k==dim.nz-1) g[2][v] = im[v]-im[v-dim.np];
+         else g[2][v] = (im[v+dim.np]-im[v-dim.np])/2.0;
+      }
+   }
+
+   return(g);
+}
+
+void free_image_gradient(float4 **g)
+{
+   for(int d=0; d<3; d++) free(g[d]);
+   free(g);
+}
+
+// Scales the derivative dT of a transformation T (see voxel_transformations) to the 
+// derivative of Tmod.  The centering terms of Tmod are constant and drop out.
+static void voxel_derivative(float4 *dT, DIM dimb, DIM dimf, float4 *dTmod)
+{
+   dTmod[0] = dT[0]*dimf.dx/dimb.dx;
+   dTmod[1] = dT[1]*dimf.dy/dimb.dx;
+   dTmod[2] = dT[2]*dimf.dz/dimb.dx;
+   dTmod[3] = dT[3]/dimb.dx;
+
+   dTmod[4] = dT[4]*dimf.dx/dimb.dy;
+   dTmod[5] = dT[5]*dimf.dy/dimb.dy;
+   dTmod[6] = dT[6]*dimf.dz/dimb.dy;
+   dTmod[7] = dT[7]/dimb.dy;
+
+   dTmod[8] = dT[8]*dimf.dx/dimb.dz;
+   dTmod[9] = dT[9]*dimf.dy/dimb.dz;
+   dTmod[10] = dT[10]*dimf.dz/dimb.dz;
+   dTmod[11] = dT[11]/dimb.dz;
+}
+
+// Partial sums of one slice in ssd_cost_gradient: the cost, J^T r and J^T J.
+struct GNSUMS
+{
+   float8 cost;
+   float8 JTr[6];
+   float8 JTJ[36];
+};
+
+// Adds the contribution of one voxel with residual r and Jacobian J (d r/d P) to s.
+static inline void add_gn_voxel(GNSUMS &s, float4 r, float4 *J)
+{
+   s.cost += r*r;
+   for(int a=0; a<6; a++)
+   {
+      s.JTr[a] += J[a]*r;
+      for(int b=a; b<6; b++) s.JTJ[a*6+b] += J[a]*J[b];
+   }
+}
+
+// Computes the SSD cost of ssd_cost_function together with J^T r and the Gauss-Newton 
+// approximation J^T J of its Hessian, where r is the vector of voxel residuals and J its 
+// derivative with respect to the six rigid-body parameters.  dT[16*a] is the derivative 
+// of T with respect to parameter a.  bgrad and fgrad are the image gradients of sclbim 
+// and sclfim returned by image_gradient().  The cost gradient is 2 J^T r.
+float8 ssd_cost_gradient(float4 *T, float4 *dT, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim,
+float4 **bgrad, float4 **fgrad, MASKSPANS *bspans, MASKSPANS *fspans, float8 *JTr, float8 *JTJ)
+{
+   float4 Tmod[16]; //modified T
+   float4 invTmod[16]; //modified invT
+   float4 dTmod[6][16]; // derivatives of Tmod
+   float4 dinvTmod[6][16]; // derivatives of invTmod
+   float4 *invT;
+   float8 cost=0.0;
+
+   float4 nxsub2, nysub2, nzsub2; 
+   float4 nxtrg2, nytrg2, nztrg2;
+
+   nxsub2 = (dimf.nx-1)/2.0;
+   nysub2 = (dimf.ny-1)/2.0;
+   nzsub2 = (dimf.nz-1)/2.0;
+
+   nxtrg2 = (dimb.nx-1)/2.0;
+   nytrg2 = (dimb.ny-1)/2.0;
+   nztrg2 = (dimb.nz-1)/2.0;
+
+   voxel_transformations(T, dimb, dimf, Tmod, invTmod);
+
+   // d(invT) = -invT dT invT
+   invT = inv4(T);
+   for(int a=0; a<6; a++)
+   {
+      float4 dinvT[16];
+
+      voxel_derivative(dT+16*a, dimb, dimf, dTmod[a]);
+
+      multi(invT, 4, 4, dT+16*a, 4, 4, dinvT);
+      multi(dinvT, 4, 4, invT, 4, 4, dinvT);
+      for(int e=0; e<16; e++) dinvT[e] = -dinvT[e];
+      voxel_derivative(dinvT, dimf, dimb, dinvTmod[a]);
+   }
+   free(invT);
+
+   // Partial sums are kept per slice and added up in slice order, as in ssd_cost_function.
+   GNSUMS *slice_sums;
+   slice_sums = (GNSUMS *)calloc(dimf.nz + dimb.nz, sizeof(GNSUMS));
+
+   #pragma omp parallel for schedule(dynamic) num_threads(opt_threads)
+   for(int k=0; k<dimf.nz; k++)
+   {
+      SPAN *span;
+      float4 *val;
+      float4 dif, gx, gy, gz;
+      float4 psub0, psub1, psub2;
+      float4 ptrg0, ptrg1, ptrg2;
+      float4 J[6];
+      GNSUMS &s = slice_sums[k];
+
+      psub2 = (k-nzsub2);
+      for(int sp=fspans->first[k]; sp<fspans->first[k+1]; sp++)
+      {
+         span = fspans->span + sp;
+         val = fspans->val + span->vstart;
+         psub1 = (span->j-nysub2);
+         for(int i=span->i0; i<=span->i1; i++)
          {
-            v = offset + i;
+            psub0 = (i-nxsub2);
 
-            if( bmsk[v]>0)
+            ptrg0 = Tmod[0]*psub0 + Tmod[1]*psub1 + Tmod[2]*psub2 + Tmod[3];
+            ptrg1 = Tmod[4]*psub0 + Tmod[5]*psub1 + Tmod[6]*psub2 + Tmod[7];
+            ptrg2 = Tmod[8]*psub0 + Tmod[9]*psub1 + Tmod[10]*psub2 + Tmod[11];
+
+            dif = val[i-span->i0] - linearInterpolator(ptrg0, ptrg1, ptrg2, sclbim, dimb.nx, dimb.ny, dimb.nz, dimb.np);
+            gx = linearInterpolator(ptrg0, ptrg1, ptrg2, bgrad[0], dimb.nx, dimb.ny, dimb.nz, dimb.np);
+            gy = linearInterpolator(ptrg0, ptrg1, ptrg2, bgrad[1], dimb.nx, dimb.ny, dimb.nz, dimb.np);
+            gz = linearInterpolator(ptrg0, ptrg1, ptrg2, bgrad[2], dimb.nx, dimb.ny, dimb.nz, dimb.np);
+
+            // r = F(p) - B(Tmod p), so dr/dP = -grad(B).(dTmod p)
+            for(int a=0; a<6; a++)
             {
-               n++;
+               float4 *D = dTmod[a];
+               J[a] = -( gx*(D[0]*psub0 + D[1]*psub1 + D[2]*psub2 + D[3]) +
+                         gy*(D[4]*psub0 + D[5]*psub1 + D[6]*psub2 + D[7]) +
+                         gz*(D[8]*psub0 + D[9]*psub1 + D[10]*psub2 + D[11]) );
+            }
 
-               ptrg0 = (i-nxtrg2);
+            add_gn_voxel(s, dif, J);
+         }
+      }
+   }
 
-               psub0 = invTmod[0]*ptrg0 + t1 + t2;
-               psub1 = invTmod[4]*ptrg0 + t5 + t6;
-               psub2 = invTmod[8]*ptrg0 + t9 + t10;
+   #pragma omp parallel for schedule(dynamic) num_threads(opt_threads)
+   for(int k=0; k<dimb.nz; k++)
+   {
+      SPAN *span;
+      float4 *val;
+      float4 dif, gx, gy, gz;
+      float4 psub0, psub1, psub2;
+      float4 ptrg0, ptrg1, ptrg2;
+      float4 J[6];
+      GNSUMS &s = slice_sums[dimf.nz + k];
 
-               subject_image_value = linearInterpolator(psub0, psub1, psub2, sclfim, dimf.nx, dimf.ny, dimf.nz, dimf.np);
-               target_image_value = sclbim[v];
+      ptrg2 = (k-nztrg2);
+      for(int sp=bspans->first[k]; sp<bspans->first[k+1]; sp++)
+      {
+         span = bspans->span + sp;
+         val = bspans->val + span->vstart;
+         ptrg1 = (span->j-nytrg2);
+         for(int i=span->i0; i<=span->i1; i++)
+         {
+            ptrg0 = (i-nxtrg2);
 
-               sum1 += subject_image_value;
-               sum2 += target_image_value;
-               sum12 += (subject_image_value*target_image_value);
-               sum11 += (subject_image_value*subject_image_value);
-               sum22 += (target_image_value*target_image_value);
+            psub0 = invTmod[0]*ptrg0 + invTmod[1]*ptrg1 + invTmod[2]*ptrg2 + invTmod[3];
+            psub1 = invTmod[4]*ptrg0 + invTmod[5]*ptrg1 + invTmod[6]*ptrg2 + invTmod[7];
+            psub2 = invTmod[8]*ptrg0 + invTmod[9]*ptrg1 + invTmod[10]*ptrg2 + invTmod[11];
+
+            dif = val[i-span->i0] - linearInterpolator(psub0, psub1, psub2, sclfim, dimf.nx, dimf.ny, dimf.nz, dimf.np);
+            gx = linearInterpolator(psub0, psub1, psub2, fgrad[0], dimf.nx, dimf.ny, dimf.nz, dimf.np);
+            gy = linearInterpolator(psub0, psub1, psub2, fgrad[1], dimf.nx, dimf.ny, dimf.nz, dimf.np);
+            gz = linearInterpolator(psub0, psub1, psub2, fgrad[2], dimf.nx, dimf.ny, dimf.nz, dimf.np);
+
+            // r = B(p) - F(invTmod p), so dr/dP = -grad(F).(dinvTmod p)
+            for(int a=0; a<6; a++)
+            {
+               float4 *D = dinvTmod[a];
+               J[a] = -( gx*(D[0]*ptrg0 + D[1]*ptrg1 + D[2]*ptrg2 + D[3]) +
+                         gy*(D[4]*ptrg0 + D[5]*ptrg1 + D[6]*ptrg2 + D[7]) +
+                         gz*(D[8]*ptrg0 + D[9]*ptrg1 + D[10]*ptrg2 + D[11]) );
             }
+
+            add_gn_voxel(s, dif, J);
          }
       }
    }
 
-   free(invT);
+   for(int a=0; a<6; a++) JTr[a]=0.0;
+   for(int a=0; a<36; a++) JTJ[a]=0.0;
 
-   if( n > 0 )
+   for(int k=0; k<dimf.nz+dimb.nz; k++)
    {
-//      cost = (sum12 - sum1*sum2/n);
-      cost = -(sum12 - sum1*sum2/n);  // since it is a minimization problem
-      cost /= sqrt( sum11 - sum1*sum1/n ); 
-      cost /= sqrt( sum22 - sum2*sum2/n ); 
+      cost += slice_sums[k].cost;
+      for(int a=0; a<6; a++) JTr[a] += slice_sums[k].JTr[a];
+      for(int a=0; a<36; a++) JTJ[a] += slice_sums[k].JTJ[a];
    }
 
-   return(cost);
-}
-
-//////////////////////////////////////////////////////////////////////////////////////////////////
-
-// This function computes and returns a 4x4 transformation matrix T.
-// Applying this transformation to a point p=(x',y',z') in the image
-// coordinates system (ICS) yields the coordinates (x,y,z) of the same point with
-// respect to the magnet coordinates system.  That is: (x,y,z)=T(x',y',z').
-// In ART, the origin of the ICS is the center of the image
-// volume.  The x-axis in the ICS is pointing to the right of the image
-// (which is not necessarily the right of the subject!).  The y-axis in the
-// ICS is pointing down.  The z-axis is determined by the right-hand-rule.
-void transformation_to_magnet_coordinates(nifti_1_header hdr, float4 *T)
-{
-   float4 rowvec[3];
-   float4 columnvec[3];
-   float4 normalvec[3];
-   float4 centervec[3];
+   // only the upper triangle was accumulated
+   for(int a=0; a<6; a++)
+   for(int b=0; b<a; b++)
+      JTJ[a*6+b] = JTJ[b*6+a];
 
-   //printf("sizeof_hdr = %d\n", hdr.sizeof_hdr);
-   //printf("number of dimensions = %d\n", hdr.dim[0]);
-   //printf("matrix size = %d x %d x %d\n", hdr.dim[1], hdr.dim[2], hdr.dim[3]);
-   //printf("voxel size = %8.6f x %8.6f x %8.6f\n", hdr.pixdim[1], hdr.pixdim[2], hdr.pixdim[3]);
-   //printf("datatype = %d\n",hdr.datatype);
-   //printf("vox_offset = %d\n", (int)hdr.vox_offset);
-   //printf("qform_code = %d\n", hdr.qform_code);
-   //printf("sform_code = %d\n", hdr.sform_code);
-   //printf("magic code = %s\n", hdr.magic);
-   //printf("srow_x: %f %f %f %f\n", hdr.srow_x[0],hdr.srow_x[1],hdr.srow_x[2],hdr.srow_x[3]);
-   //printf("srow_y: %f %f %f %f\n", hdr.srow_y[0],hdr.srow_y[1],hdr.srow_y[2],hdr.srow_y[3]);
-   //printf("srow_z: %f %f %f %f\n", hdr.srow_z[0],hdr.srow_z[1],hdr.srow_z[2],hdr.srow_z[3]);
-   //printf("quatern_b = %f\n", hdr.quatern_b);
-   //printf("quatern_c = %f\n", hdr.quatern_c);
-   //printf("quatern_d = %f\n", hdr.quatern_d);
-   //printf("qoffset_x = %f\n",hdr.qoffset_x);
-   //printf("qoffset_y = %f\n",hdr.qoffset_y);
-   //printf("qoffset_z = %f\n",hdr.qoffset_z);
+   profile_evals++;
+   profile_voxels += fspans->nval + bspans->nval;
 
-   int nx,ny,nz;
-   float4 dx,dy,dz;
+   free(slice_sums);
+   return(cost);
+}
 
-   nx = hdr.dim[1];
-   ny = hdr.dim[2];
-   nz = hdr.dim[3];
+// Computes T = ibTPIL * Tinter(P) * fTPIL and, if dT is not NULL, its derivatives with respect 
+// to the six parameters P.  Tinter is built by set_transformation(), so its derivatives are 
+// taken by central differences of that (cheap) 4x4 matrix; the image part of the gradient is 
+// analytic.
+static void parameters_to_transformation(float4 *P, float4 *fTPIL, float4 *ibTPIL, float4 *T, float4 *dT)
+{
+   float4 Tinter[16];
+   float4 Tp[16], Tm[16];
+   float4 Q[6];
+   const float4 h=0.01; // degrees or mm
 
-   dx=hdr.pixdim[1];
-   dy=hdr.pixdim[2];
-   dz=hdr.pixdim[3];
+   set_transformation(P[0], P[1], P[2], P[3], P[4], P[5], "ZXYT", Tinter);
+   multi(Tinter, 4, 4,  fTPIL, 4,  4, T);
+   multi(ibTPIL, 4, 4,  T, 4,  4, T);
 
-   if(hdr.qform_code>0 )
+   if(dT==NULL) return;
+
+   for(int a=0; a<6; a++)
    {
-      float4 dum;
-      mat44 R;
-   
-      R=nifti_quatern_to_mat44( hdr.quatern_b, hdr.quatern_c, hdr.quatern_d,
-      hdr.qoffset_x, hdr.qoffset_y, hdr.qoffset_z, dx, dy, dz, hdr.pixdim[0]);
+      for(int b=0; b<6; b++) Q[b]=P[b];
 
-      dum = R.m[0][0]*R.m[0][0] + R.m[1][0]*R.m[1][0] + R.m[2][0]*R.m[2][0];
-      dum = sqrtf(dum);
+      Q[a] = P[a]+h;
+      set_transformation(Q[0], Q[1], Q[2], Q[3], Q[4], Q[5], "ZXYT", Tp);
+      Q[a] = P[a]-h;
+      set_transformation(Q[0], Q[1], Q[2], Q[3], Q[4], Q[5], "ZXYT", Tm);
 
-      if(dum != 0.0)
+      for(int e=0; e<16; e++) Tinter[e] = (Tp[e]-Tm[e])/(2.0*h);
+      Tinter[15]=0.0;
+
+      multi(Tinter, 4, 4,  fTPIL, 4,  4, dT+16*a);
+      multi(ibTPIL, 4, 4,  dT+16*a, 4,  4, dT+16*a);
+   }
+}
+
+// Solves the 6x6 system A x = b by Gaussian elimination with partial pivoting.
+// Returns 0 if A is singular.
+static int solve6(float8 *A, float8 *b, float8 *x)
+{
+   float8 M[6][7];
+   float8 f;
+   int p;
+
+   for(int i=0; i<6; i++)
+   {
+      for(int j=0; j<6; j++) M[i][j]=A[i*6+j];
+      M[i][6]=b[i];
+   }
+
+   for(int c=0; c<6; c++)
+   {
+      p=c;
+      for(int r=c+1; r<6; r++) if( fabs(M[r][c]) > fabs(M[p][c]) ) p=r;
+      if( M[p][c]==0.0 ) return(0);
+      for(int j=0; j<7; j++) { f=M[c][j]; M[c][j]=M[p][j]; M[p][j]=f; }
+
+      for(int r=c+1; r<6; r++)
       {
-         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-         rowvec[0]=-R.m[0][0]/dum;
-         rowvec[1]=R.m[1][0]/dum;
-         rowvec[2]=-R.m[2][0]/dum;
+         f = M[r][c]/M[c][c];
+         for(int j=c; j<7; j++) M[r][j] -= f*M[c][j];
       }
-      else
+   }
+
+   for(int i=5; i>=0; i--)
+   {
+      x[i]=M[i][6];
+      for(int j=i+1; j<6; j++) x[i] -= M[i][j]*x[j];
+      x[i] /= M[i][i];
+   }
+
+   return(1);
+}
+
+// Minimizes the SSD cost over the six rigid-body parameters P of Tinter with a 
+// Levenberg-Marquardt damped Gauss-Newton method that uses the analytic gradients of 
+// ssd_cost_gradient().  This is an alternative to coordinate_search() and takes the 
+// same arguments, except for the grid parameters.
+float8 gauss_newton_search(float4 *P, float4 *fTPIL, float4 *ibTPIL, DIM dimb, DIM dimf, 
+float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans, int verbose)
+{
+   float4 T[16];
+   float4 dT[6*16];
+   float4 Pnew[6];
+   float8 JTr[6], JTJ[36], A[36], step[6];
+   float8 cost, newcost, relative_change, maxstep;
+   float8 lambda=1.0e-3; // damping factor
+   float4 **bgrad, **fgrad;
+
+   bgrad = image_gradient(sclbim, dimb);
+   fgrad = image_gradient(sclfim, dimf);
+
+   parameters_to_transformation(P, fTPIL, ibTPIL, T, dT);
+   cost = ssd_cost_gradient(T, dT, dimb, dimf, sclbim, sclfim, bgrad, fgrad, bspans, fspans, JTr, JTJ);
+
+   if(verbose)
+   {
+      printf("Tolerance = %3.1e\n",TOLERANCE);
+      printf("Initial cost = %f\n", cost);
+   }
+
+   for(int iter=1; iter<=MAXGNITER; iter++)
+   {
+      int stage = profile_begin("Gauss-Newton iteration %d", iter);
+
+      // (J^T J + lambda diag(J^T J)) step = -J^T r
+      for(int a=0; a<36; a++) A[a]=JTJ[a];
+      for(int a=0; a<6; a++) 
       {
-         rowvec[0]=1.0;
-         rowvec[1]=0.0;
-         rowvec[2]=0.0;
+         A[a*6+a] += lambda*JTJ[a*6+a];
+         step[a] = -JTr[a];
       }
 
-      dum = R.m[0][1]*R.m[0][1] + R.m[1][1]*R.m[1][1] + R.m[2][1]*R.m[2][1];
-      dum = sqrtf(dum);
+      if( !solve6(A, step, step) ) { profile_end(stage); break; }
 
-      if(dum != 0.0)
+      // stop when the update is far below the precision of the grid search 
+      maxstep=0.0;
+      for(int a=0; a<6; a++) if( fabs(step[a]) > maxstep ) maxstep=fabs(step[a]);
+      if( maxstep < GNMINSTEP ) { profile_end(stage); break; }
+
+      for(int a=0; a<6; a++) Pnew[a] = P[a] + step[a];
+
+      parameters_to_transformation(Pnew, fTPIL, ibTPIL, T, NULL);
+      newcost = ssd_cost_function(T, dimb, dimf, sclbim, sclfim, bspans, fspans);
+
+      if(verbose)
       {
-         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-         columnvec[0]=-R.m[0][1]/dum;
-         columnvec[1]=R.m[1][1]/dum;
-         columnvec[2]=-R.m[2][1]/dum;
+         printf("Iteration %d: cost = %f lambda = %3.1e\n", iter, newcost, lambda);
       }
-      else
+
+      if( newcost < cost )
       {
-         columnvec[0]=0.0;
-         columnvec[1]=1.0;
-         columnvec[2]=0.0;
-      }
+         relative_change = (cost-newcost)/fabs(cost);
 
-      dum = R.m[0][2]*R.m[0][2] + R.m[1][2]*R.m[1][2] + R.m[2][2]*R.m[2][2];
-      dum = sqrtf(dum);
+         for(int a=0; a<6; a++) P[a]=Pnew[a];
+         lambda /= 10.0;
 
-      if(dum != 0.0)
-      {
-         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-         normalvec[0]=-R.m[0][2]/dum;
-         normalvec[1]=R.m[1][2]/dum;
-         normalvec[2]=-R.m[2][2]/dum;
+         if(verbose)
+         {
+            printf("P0=%f P1=%f P2=%f P3=%f P4=%f P5=%f\n", P[0], P[1], P[2], P[3], P[4], P[5]);
+            printf("Relative change = %3.1e x 100%\n", relative_change );
+         }
+
+         if( relative_change <= TOLERANCE ) 
+         {
+            cost = newcost;
+            profile_end(stage);
+            break;
+         }
+
+         parameters_to_transformation(P, fTPIL, ibTPIL, T, dT);
+         cost = ssd_cost_gradient(T, dT, dimb, dimf, sclbim, sclfim, bgrad, fgrad, bspans, fspans, JTr, JTJ);
       }
       else
       {
-         normalvec[0]=0.0;
-         normalvec[1]=0.0;
-         normalvec[2]=1.0;
+         lambda *= 10.0;
       }
 
-      // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-      centervec[0] = -R.m[0][3] +
-      rowvec[0] * dx*(nx-1.0)/2.0 +
-      columnvec[0] * dy*(ny-1.0)/2.0;
+      profile_end(stage);
 
-      centervec[1] = R.m[1][3] +
-      rowvec[1] * dx*(nx-1.0)/2.0 +
-      columnvec[1] * dy*(ny-1.0)/2.0;
+      if( lambda > 1.0e10 ) break;
+   }
 
-      centervec[2] = -R.m[2][3] +
-      rowvec[2] * dx*(nx-1.0)/2.0 +
-      columnvec[2] * dy*(ny-1.0)/2.0; 
+   free_image_gradient(bgrad);
+   free_image_gradient(fgrad);
+
+   return(cost);
+}
+
+// Finds Tinter, the rigid-body transformation from the follow-up PIL space to the baseline PIL
+// space that best aligns follow-up image fim with baseline image bim within masks fmsk and bmsk.
+// The transformation T = ibTPIL * Tinter * fTPIL takes the follow-up to the baseline image.
+// PILmsk is the thresholded PIL brain cloud of grid PILdim, used only with -halfway.  bim and
+// fim are modified (see trimExtremes()).
+void register_images(int2 *bim, int2 *fim, int2 *bmsk, int2 *fmsk, DIM dimb, DIM dimf, float4 *fTPIL, 
+float4 *ibTPIL, float4 *ifTPIL, int2 *PILmsk, DIM PILdim, float4 *Tinter, int verbose)
+{
+   float4 *sclfim, *sclbim;
+   int stage;
+
+   stage = profile_begin("normalize images");
+   {
+      float4 bscale;
+      float4 fscale;
+
+      trimExtremes(bim, bmsk, dimb.nv, 0.05);
+      trimExtremes(fim, fmsk, dimf.nv, 0.05);
+
+      bscale=imageMean(bim, bmsk, dimb.nv);
+      fscale=imageMean(fim, fmsk, dimf.nv);
+
+      sclfim = (float4 *)calloc(dimf.nv, sizeof(float4));
+      sclbim = (float4 *)calloc(dimb.nv, sizeof(float4));
+
+      for(int v=0; v<dimf.nv; v++) sclfim[v] = fim[v]/fscale;
+      for(int v=0; v<dimb.nv; v++) sclbim[v] = bim[v]/bscale;
    }
-   else if(hdr.sform_code>0)
+   profile_end(stage);
+
    {
-      float4 dum;
+      COSTFUNCTION cost_function;
+      BATCHCOSTFUNCTION batch_cost_function;
+      float4 P[6];
+      float4 stepsize[6]={0.25, 0.25, 0.25, 0.1, 0.1, 0.1};  // stepsize used in optimization
+      //float4 iP[6]={3.0, 3.0, 3.0, 1.5, 1.5, 1.5}; // interval used in optimization
+      // New interval makes it twice as fast with same resutls
+      float4 iP[6]={1.0, 1.0, 1.0, 1.0, 1.0, 1.0}; // interval used in optimization 
 
-      dum = hdr.srow_x[0]*hdr.srow_x[0] + hdr.srow_y[0]*hdr.srow_y[0] + hdr.srow_z[0]*hdr.srow_z[0];
-      dum = sqrtf(dum);
+      float4 I[16]={1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
+      float4 *sfTPIL=fTPIL, *sibTPIL=ibTPIL; // PIL transformations seen by the search
+      MIDSPACE mid;
 
-      if(dum != 0.0)
+      // SSD with trilinear interpolation by default, used for T1 to T1 registration
+      select_cost_function(opt_metric, opt_interp, cost_function, batch_cost_function);
+      if(registration_batch_cost_function != NULL)
       {
-         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-         rowvec[0]=-hdr.srow_x[0]/dum;
-         rowvec[1]=hdr.srow_y[0]/dum;
-         rowvec[2]=-hdr.srow_z[0]/dum;
+         cost_function = registration_cost_function;
+         batch_cost_function = registration_batch_cost_function;
       }
-      else
+
+      // the halfway cost functions take Tinter and apply the PIL transformations themselves
+      if(opt_halfway)
       {
-         rowvec[0]=1.0;
-         rowvec[1]=0.0;
-         rowvec[2]=0.0;
+         for(int i=0; i<16; i++) { mid.ifTPIL[i]=ifTPIL[i]; mid.ibTPIL[i]=ibTPIL[i]; }
+         sfTPIL = sibTPIL = I;
+         midspace = &mid;
       }
 
-      dum= hdr.srow_x[1]*hdr.srow_x[1] + hdr.srow_y[1]*hdr.srow_y[1] + hdr.srow_z[1]*hdr.srow_z[1];
-      dum = sqrtf(dum);
+      // initially assume Tinter=Identity matrix
+      for(int j=0; j<6; j++) P[j]=0.0;
 
-      if(dum != 0.0)
-      {
-         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-         columnvec[0]=-hdr.srow_x[1]/dum;
-         columnvec[1]=hdr.srow_y[1]/dum;
-         columnvec[2]=-hdr.srow_z[1]/dum;
-      }
-      else
-      {
-         columnvec[0]=0.0;
-         columnvec[1]=1.0;
-         columnvec[2]=0.0;
-      }
+      // automatically sets the step size for the first three variables
+      //if( dimf.dx<dimb.dx) stepsize[0]=dimf.dx/5.0;
+      //else stepsize[0]=dimb.dx/5.0;
+      //if( dimf.dy<dimb.dy) stepsize[1]=dimf.dy/5.0;
+      //else stepsize[1]=dimb.dy/5.0;
+      //if( dimf.dz<dimb.dz) stepsize[2]=dimf.dz/5.0;
+      //else stepsize[2]=dimb.dz/5.0;
+      //printf("Step sizes = %f %f %f %f %f %f\n",stepsize[0],stepsize[1],stepsize[2],stepsize[3],stepsize[4],stepsize[5]); 
 
-      dum= hdr.srow_x[2]*hdr.srow_x[2] + hdr.srow_y[2]*hdr.srow_y[2] + hdr.srow_z[2]*hdr.srow_z[2];
-      dum = sqrtf(dum);
+      // The image pyramid: level L is level L-1 downsampled by a factor of 2, and level 0 is the
+      // native resolution.
+      DIM pdimb[MAXPYRAMID], pdimf[MAXPYRAMID], pPILdim[MAXPYRAMID];
+      float4 *psclbim[MAXPYRAMID], *psclfim[MAXPYRAMID];
+      int2 *pbmsk[MAXPYRAMID], *pfmsk[MAXPYRAMID], *pPILmsk[MAXPYRAMID];
 
-      if(dum != 0.0)
+      pdimb[0]=dimb; psclbim[0]=sclbim; pbmsk[0]=bmsk;
+      pdimf[0]=dimf; psclfim[0]=sclfim; pfmsk[0]=fmsk;
+      pPILdim[0]=PILdim; pPILmsk[0]=PILmsk;
+
+      stage = profile_begin("build pyramid");
+      for(int level=1; level<opt_pyramid; level++)
       {
-         // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-         normalvec[0]=-hdr.srow_x[2]/dum;
-         normalvec[1]=hdr.srow_y[2]/dum;
-         normalvec[2]=-hdr.srow_z[2]/dum;
+         psclbim[level] = downsample_image(psclbim[level-1], pdimb[level-1], pdimb[level]);
+         pbmsk[level] = downsample_mask(pbmsk[level-1], pdimb[level-1], pdimb[level]);
+
+         psclfim[level] = downsample_image(psclfim[level-1], pdimf[level-1], pdimf[level]);
+         pfmsk[level] = downsample_mask(pfmsk[level-1], pdimf[level-1], pdimf[level]);
+
+         pPILdim[level] = pPILdim[level-1];
+         pPILmsk[level] = NULL;
+         if(opt_halfway) pPILmsk[level] = downsample_mask(pPILmsk[level-1], pPILdim[level-1], pPILdim[level]);
       }
-      else
+      profile_end(stage);
+
+      // Coarse-to-fine search: level L works on the images of level L of the pyramid, with the 
+      // step sizes and search intervals scaled by 2^L.  The solution of each level is the 
+      // starting point of the next finer level.
+      for(int level=opt_pyramid-1; level>=0; level--)
       {
-         normalvec[0]=0.0;
-         normalvec[1]=0.0;
-         normalvec[2]=1.0;
-      }
+         DIM ldimb=pdimb[level], ldimf=pdimf[level]; // image dimensions at this level
+         float4 *lsclbim=psclbim[level], *lsclfim=psclfim[level];
+         int2 *lbmsk=pbmsk[level], *lfmsk=pfmsk[level], *lPILmsk=pPILmsk[level];
+         DIM lPILdim=pPILdim[level];
+         float4 lstepsize[6], liP[6];
+         int levelstage = profile_begin("registration level %d", level);
 
-      // note that the -tive signs converts from NIFTI's RAS to ART's LAI
-      centervec[0] = -hdr.srow_x[3] +
-      rowvec[0] * dx*(nx-1.0)/2.0 +
-      columnvec[0] * dy*(ny-1.0)/2.0;
+         stage = profile_begin("prepare level %d", level);
 
-      centervec[1] = hdr.srow_y[3] +
-      rowvec[1] * dx*(nx-1.0)/2.0 +
-      columnvec[1] * dy*(ny-1.0)/2.0;
+         for(int j=0; j<6; j++)
+         {
+            lstepsize[j] = stepsize[j]*(1<<level);
+            liP[j] = iP[j]*(1<<level);
+         }
 
-      centervec[2] = -hdr.srow_z[3] +
-      rowvec[2] * dx*(nx-1.0)/2.0 +
-      columnvec[2] * dy*(ny-1.0)/2.0; 
-   }
-   else
-   {
-      printf("\n**WARNING**: NIFTI header did not contain image orientation information.\n\n");
-   }
+         if(verbose && opt_pyramid>1)
+         {
+            printf("Pyramid level %d: baseline %d x %d x %d, follow-up %d x %d x %d (voxels)\n", level,
+            ldimb.nx, ldimb.ny, ldimb.nz, ldimf.nx, ldimf.ny, ldimf.nz);
+         }
 
-   //printf("Center Vector = (%7.5lf %7.5lf %7.5lf)\n", centervec[0],centervec[1], centervec[2]);
-   //printf("Normal Vector = (%7.5lf %7.5lf %7.5lf)\n", normalvec[0],normalvec[1], normalvec[2]);
-   //printf("Row Vector = (%7.5lf %7.5lf %7.5lf)\n", rowvec[0],rowvec[1], rowvec[2]);
-   //printf("Column Vector = (%7.5lf %7.5lf %7.5lf)\n", columnvec[0],columnvec[1], columnvec[2]);
+         // The cost functions visit only the masked voxels, through these span lists.
+         MASKSPANS bspans, fspans;
+         build_cost_spans(lbmsk, lsclbim, ldimb, bspans);
+         build_cost_spans(lfmsk, lsclfim, ldimf, fspans);
 
-   for(int i=0; i<16; i++) T[i]=0.0;
+         if(verbose)
+         {
+            printf("Masked voxels: baseline %d in %d spans, follow-up %d in %d spans\n",
+            bspans.nval, bspans.nspan, fspans.nval, fspans.nspan);
+         }
 
-   // The fifteenth element (i.e., element 4,4) is always 1.0.
-   T[15]=1.0;
-   
-   T[0] = rowvec[0];
-   T[4] = rowvec[1];
-   T[8] = rowvec[2];
+         MASKSPANS hspans;
+         float4 *hzero=NULL; // stands in for the values of the halfway grid, which are not used
+         if(opt_halfway)
+         {
+            hzero = (float4 *)calloc(lPILdim.nv, sizeof(float4));
+            build_mask_spans(lPILmsk, hzero, lPILdim, hspans);
+            mid.dim = lPILdim;
+            mid.spans = &hspans;
 
-   T[1] = columnvec[0];
-   T[5] = columnvec[1];
-   T[9] = columnvec[2];
+            if(verbose) printf("Masked voxels: halfway space %d in %d spans\n", hspans.nval, hspans.nspan);
+         }
 
-   T[2] = normalvec[0];
-   T[6] = normalvec[1];
-   T[10]= normalvec[2];
+         profile_end(stage);
 
-   T[3] = centervec[0] + (dz*(nz-1.0)/2.0)*normalvec[0];
-   T[7] = centervec[1] + (dz*(nz-1.0)/2.0)*normalvec[1];
-   T[11]= centervec[2] + (dz*(nz-1.0)/2.0)*normalvec[2];
+         // With -sample, the search first runs on a random subset of the masked voxels.  Each
+         // time the search converges the subset is doubled in size, and the last search always 
+         // uses all masked voxels.
+         for(float4 fraction=opt_sample; ; fraction*=2.0)
+         {
+            MASKSPANS bsample, fsample, hsample;
+            MASKSPANS *bs=&bspans, *fs=&fspans;
 
-   return;
-}
-//////////////////////////////////////////////////////////////////////////////////////////////////
+            if(fraction<1.0)
+            {
+               sample_mask_spans(bspans, fraction, SAMPLE_SEED, bsample);
+               sample_mask_spans(fspans, fraction, SAMPLE_SEED+1, fsample);
+               bs = &bsample;
+               fs = &fsample;
 
-void atra_to_fsl(float4 *Matra, float4 *Mfsl, DIM dimf, DIM trg_dim)
-{
-   float4 Tsub[16], Ttrg[16];
-   float4 *inv_Tsub;
+               if(opt_halfway)
+               {
+                  sample_mask_spans(hspans, fraction, SAMPLE_SEED+2, hsample);
+                  mid.spans = &hsample;
+               }
 
-   Tsub[0]=1.0;  Tsub[1]=0.0;  Tsub[2]=0.0;  Tsub[3]=(dimf.nx-1.0)*dimf.dx/2.0;
-   Tsub[4]=0.0;  Tsub[5]=1.0;  Tsub[6]=0.0;  Tsub[7]=(dimf.ny-1.0)*dimf.dy/2.0;
-   Tsub[8]=0.0;  Tsub[9]=0.0;  Tsub[10]=1.0; Tsub[11]=(dimf.nz-1.0)*dimf.dz/2.0;
-   Tsub[12]=0.0; Tsub[13]=0.0; Tsub[14]=0.0; Tsub[15]=1.0;
+               if(verbose)
+               {
+                  printf("Voxel sample fraction = %f: baseline %d, follow-up %d voxels\n", fraction, bs->nval, fs->nval);
+               }
+            }
+
+            if(opt_gn)
+               gauss_newton_search(P, fTPIL, ibTPIL, ldimb, ldimf, lsclbim, lsclfim, bs, fs, verbose);
+            else
+               coordinate_search(P, lstepsize, liP, sfTPIL, sibTPIL, ldimb, ldimf, lsclbim, lsclfim, bs, fs, 
+               cost_function, batch_cost_function, verbose);
+
+            if(fraction>=1.0) break;
+
+            free_mask_spans(bsample);
+            free_mask_spans(fsample);
+
+            if(opt_halfway)
+            {
+               free_mask_spans(hsample);
+               mid.spans = &hspans;
+            }
+         }
 
-   Ttrg[0]=1.0;  Ttrg[1]=0.0;  Ttrg[2]=0.0;  Ttrg[3]=(trg_dim.nx-1.0)*trg_dim.dx/2.0;
-   Ttrg[4]=0.0;  Ttrg[5]=1.0;  Ttrg[6]=0.0;  Ttrg[7]=(trg_dim.ny-1.0)*trg_dim.dy/2.0;
-   Ttrg[8]=0.0;  Ttrg[9]=0.0;  Ttrg[10]=1.0; Ttrg[11]=(trg_dim.nz-1.0)*trg_dim.dz/2.0;
-   Ttrg[12]=0.0; Ttrg[13]=0.0; Ttrg[14]=0.0; Ttrg[15]=1.0;
+         if(opt_halfway)
+         {
+            free_mask_spans(hspans);
+            free(hzero);
+         }
 
-   inv_Tsub = inv4(Tsub);
+         free_cost_spans(bspans, lsclbim);
+         free_cost_spans(fspans, lsclfim);
 
-   multi(Ttrg,4,4,Matra,4,4,Mfsl);
-   multi(Mfsl,4,4,inv_Tsub,4,4, Mfsl);
+         if(lsclbim != sclbim) free(lsclbim);
+         if(lsclfim != sclfim) free(lsclfim);
+         if(lbmsk != bmsk) free(lbmsk);
+         if(lfmsk != fmsk) free(lfmsk);
+         if(lPILmsk != PILmsk) free(lPILmsk);
 
-   free(inv_Tsub);
-}
+         profile_end(levelstage);
+      }
 
-/////////////////////////////////////////////////
-// find sqrt(T) and inverse_sqrt(T)
-/////////////////////////////////////////////////
-void sqrt_matrix(float4 *T, float4 *sqrtT, float4 *invsqrtT)
-{
-   float4 w[3], v[3];
-   float4 theta;
+      midspace = NULL;
 
-   SE3_to_se3(T, w, v, theta);
+      set_transformation(P[0], P[1], P[2], P[3], P[4], P[5], "ZXYT", Tinter);
+   }
 
-   theta /= 2.0;
-   se3_to_SE3(sqrtT, w, v, theta);
+   free(sclbim);
+   free(sclfim);
+}
 
-   theta *= -1.0;
-   se3_to_SE3(invsqrtT, w, v, theta);
+// Computes Tf and Tb, which take the follow-up and baseline images to the midpoint PIL space,
+// from Tinter, fTPIL and bTPIL.
+void midpoint_transformations(float4 *Tinter, float4 *fTPIL, float4 *bTPIL, float4 *Tf, float4 *Tb)
+{
+   float4 sqrtTinter[16];
+   float4 invsqrtTinter[16];
 
-   return;
+   if( Tinter[0]!=1.0 || Tinter[1]!=0.0 || Tinter[2]!=0.0 || Tinter[3]!=0.0 ||
+   Tinter[4]!=0.0 || Tinter[5]!=1.0 || Tinter[6]!=0.0 || Tinter[7]!=0.0 ||
+   Tinter[8]!=0.0 || Tinter[9]!=0.0 || Tinter[10]!=1.0 || Tinter[11]!=0.0 ||
+   Tinter[12]!=0.0 || Tinter[13]!=0.0 || Tinter[14]!=0.0 || Tinter[15]!=1.0)
+   {
+      // Tinter does not equal identity matrix
+      sqrt_matrix(Tinter, sqrtTinter, invsqrtTinter);
+   }
+   {
+      // Tinter equals identity matrix
+      for(int i=0; i<16; i++) sqrtTinter[i]=invsqrtTinter[i]=Tinter[i];
+   }
+   multi(sqrtTinter, 4, 4,  fTPIL, 4,  4, Tf);
+   multi(invsqrtTinter, 4, 4,  bTPIL, 4,  4, Tb);
 }
 
 // bfile: baseline image filename
 // ffile: follow-up image filename
-void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffile, const char *blmfile,const char *flmfile, int verbose)
+// bpilT, fpilT: return the transformations of the baseline and follow-up images to the midpoint
+// PIL space (also saved as <prefix>_PIL.mrx)
+void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffile, const char *blmfile,const char *flmfile, 
+float4 *bpilT, float4 *fpilT, int verbose)
 {
    char cmnd[1024]="";  // to stores the command to run with system
    int2 *fmsk, *bmsk;
-   float4 *sclfim, *sclbim;
+   const ATLASIMAGE *cloud;
    int2 *PILbraincloud;
+   int2 *PILmsk=NULL; // thresholded brain cloud, the mask of the halfway space (-halfway)
    DIM PILbraincloud_dim;
    nifti_1_header PILbraincloud_hdr; 
 
@@ -685,30 +5157,22 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
    DIM dimb; // baseline image dimensions structure
    char bprefix[1024]=""; //baseline image prefix
    char fprefix[1024]=""; //follow-up image prefix
-   float4 T[16]; // The unknown transformation matrix that takes points from the follow-up to baseline space 
    float4 Tf[16]; // The unknown transformation matrix that takes points from the follow-up to mid PIL space 
    float4 Tb[16]; // The unknown transformation matrix that takes points from the baseline to mid PIL space 
    float4 Tinter[16]; // Transforms points from the follow-up PIL to baseline PIL spaces
    float4 *invT;  // inverse of T
-   float4 sqrtTinter[16];
-   float4 invsqrtTinter[16];
+   int stage;
 
    /////////////////////////////////////////////////////////////////////////////////////////////
-   // read PILbraincloud.nii from the $ARTHOME directory
+   // PILbrain.nii from the $ARTHOME directory
    /////////////////////////////////////////////////////////////////////////////////////////////
-   sprintf(filename,"%s/PILbrain.nii",ARTHOME);
-
-   PILbraincloud = (int2 *)read_nifti_image(filename, &PILbraincloud_hdr);
-
-   if(PILbraincloud==NULL)
-   {
-      printf("Error reading %s, aborting ...\n", filename);
-      exit(1);
-   }
+   cloud = atlas_image("PILbrain.nii");
+   PILbraincloud = cloud->v; // read-only
+   PILbraincloud_hdr = cloud->hdr;
 
    if(verbose)
    {
-      printf("PIL brain cloud: %s\n",filename);
+      printf("PIL brain cloud: %s\n",cloud->filename);
       printf("PIL brain cloud threshold level = %d\%\n",CLOUD_THRESH);
       printf("PIL brain cloud matrix size = %d x %d x %d (voxels)\n", 
       PILbraincloud_hdr.dim[1], PILbraincloud_hdr.dim[2], PILbraincloud_hdr.dim[3]);
@@ -724,6 +5188,16 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
       printf("Starting unbiased symmetric registration ...\n");
       printf("ARTHOME: %s\n",ARTHOME);
       printf("Maximum number of iterations = %d\n", MAXITER);
+      printf("Number of threads = %d\n", opt_threads);
+      printf("Number of resolution levels = %d\n", opt_pyramid);
+      printf("Optimizer = %s\n", opt_gn ? "Gauss-Newton" : "grid search");
+      printf("Cost function = %s, %s interpolation\n", opt_metric==COST_NCC ? "NCC" : 
+      (opt_metric==COST_MI ? "MI" : (opt_metric==COST_NMI ? "NMI" : "SSD")), 
+      opt_interp==INTERP_NEAREST ? "nearest neighbour" : "trilinear");
+      printf("Initial voxel sample fraction = %f\n", opt_sample);
+      printf("Cost function image precision = %s\n", opt_fixed16 ? "16-bit fixed point" : "float");
+      printf("Cost function image layout = %s\n", opt_brick ? "bricked" : "linear");
+      printf("Cost function space = %s\n", opt_halfway ? "halfway (PIL brain cloud grid)" : "forward and inverse");
       printf("Baseline image: %s\n",bfile);
       printf("Follow-up image: %s\n",ffile);
    }
@@ -758,6 +5232,7 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
    float4 *ifTPIL; // inverse of fTPIL
 
    if(verbose) printf("Computing baseline image PIL transformation ...\n");
+   stage = profile_begin("baseline PIL transformation");
    if(!opt_newPIL)
       standard_PIL_transformation(bfile, blmfile, verbose, bTPIL);
    else
@@ -770,10 +5245,12 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
          sprintf(cmnd,"pnmtopng %s_ACPC_sagittal.ppm > %s_ACPC_sagittal.png",bprefix,bprefix); system(cmnd);
       }
    }
+   profile_end(stage);
 
    ibTPIL= inv4(bTPIL);
 
    if(verbose) printf("Computing follow-up image PIL transformation ...\n");
+   stage = profile_begin("follow-up PIL transformation");
    if(!opt_newPIL)
       standard_PIL_transformation(ffile, flmfile, verbose, fTPIL);
    else
@@ -786,6 +5263,7 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
          sprintf(cmnd,"pnmtopng %s_ACPC_sagittal.ppm > %s_ACPC_sagittal.png",fprefix,fprefix); system(cmnd);
       }
    }
+   profile_end(stage);
 
    ifTPIL= inv4(fTPIL);
 
@@ -797,7 +5275,10 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
    nifti_1_header bhdr;  // baseline image NIFTI header
    nifti_1_header fhdr;  // follow-up image NIFTI header
 
-   bim = (int2 *)read_nifti_image(bfile, &bhdr);
+   stage = profile_begin("read images");
+
+   // private views: register_images() modifies them
+   bim = map_nifti_image(bfile, &bhdr, YES);
 
    if(bim==NULL)
    {
@@ -807,7 +5288,7 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
 
    set_dim(dimb, bhdr);
 
-   fim = (int2 *)read_nifti_image(ffile, &fhdr);
+   fim = map_nifti_image(ffile, &fhdr, YES);
 
    if(fim==NULL)
    {
@@ -816,11 +5297,14 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
    }
 
    set_dim(dimf, fhdr);
+
+   profile_end(stage);
    ///////////////////////////////////////////////////////////////////////////////////////////////
 
    ///////////////////////////////////////////////////////////////////////////////////////////////
    // determine subject and target masks
    ///////////////////////////////////////////////////////////////////////////////////////////////
+   stage = profile_begin("reslice masks");
    {
       float4 Tdum[16];
 
@@ -833,229 +5317,47 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
       fmsk = resliceImage(PILbraincloud, PILbraincloud_dim, dimf, Tdum, LIN);
       for(int v=0; v<dimf.nv; v++) if(fmsk[v]<CLOUD_THRESH) fmsk[v]=0;
       //save_nifti_image("fmsk.nii", fmsk, &fhdr);
-      
-      delete PILbraincloud;
-   }
-   ///////////////////////////////////////////////////////////////////////////////////////////////
-   
-   ///////////////////////////////////////////////////////////////////////////////////////////////
-   {
-      float4 bscale;
-      float4 fscale;
-
-      trimExtremes(bim, bmsk, dimb.nv, 0.05);
-      trimExtremes(fim, fmsk, dimf.nv, 0.05);
-
-      bscale=imageMean(bim, bmsk, dimb.nv);
-      fscale=imageMean(fim, fmsk, dimf.nv);
-
-      sclfim = (float4 *)calloc(dimf.nv, sizeof(float4));
-      sclbim = (float4 *)calloc(dimb.nv, sizeof(float4));
-
-      for(int v=0; v<dimf.nv; v++) sclfim[v] = fim[v]/fscale;
-      for(int v=0; v<dimb.nv; v++) sclbim[v] = bim[v]/bscale;
-   }
-
-#if 0
-// for this to work kmin's and kmax's should be defined as global variables and removed as 
-// local variables in the cost functions
-   ///////////////////////////////////////////////////////////////////////////////////////////////
-   // determine mask limits, to limit loop indices in cost_function
-   // seems to save 1-2% processing time
-   {
-      int ii, jj, kk;
-      imin_f=dimf.nx; imax_f=0;
-      jmin_f=dimf.ny; jmax_f=0;
-      kmin_f=dimf.nz; kmax_f=0;
-      for(int v=0; v<dimf.nv; v++)
-      if( fmsk[v]>0)
-      {
-         kk = v/dimf.np;
-         if( kk<kmin_f) kmin_f=kk;
-         if( kk>kmax_f) kmax_f=kk;
-
-         jj = (v%dimf.np)/dimf.nx;
-         if( jj<jmin_f) jmin_f=jj;
-         if( jj>jmax_f) jmax_f=jj;
 
-         ii = (v%dimf.np)%dimf.nx;
-         if( ii<imin_f) imin_f=ii;
-         if( ii>imax_f) imax_f=ii;
-      }
-
-      imin_b=dimb.nx; imax_b=0;
-      jmin_b=dimb.ny; jmax_b=0;
-      kmin_b=dimb.nz; kmax_b=0;
-      for(int v=0; v<dimb.nv; v++)
-      if( bmsk[v]>0)
-      {
-         kk = v/dimb.np;
-         if( kk<kmin_b) kmin_b=kk;
-         if( kk>kmax_b) kmax_b=kk;
-
-         jj = (v%dimb.np)/dimb.nx;
-         if( jj<jmin_b) jmin_b=jj;
-         if( jj>jmax_b) jmax_b=jj;
-
-         ii = (v%dimb.np)%dimb.nx;
-         if( ii<imin_b) imin_b=ii;
-         if( ii>imax_b) imax_b=ii;
-      }
+      if(opt_halfway) PILmsk = atlas_brain_mask()->v; // read-only
    }
+   profile_end(stage);
    ///////////////////////////////////////////////////////////////////////////////////////////////
-#endif
-   
-   {
-      float8 relative_change;
-      float8 mincost, oldmincost, cost;
-      float8 (*cost_function)(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim,int2 *bmsk, int2 *fmsk);
-      float4 P[6];
-      float4 Pmin[6];
-      float4 stepsize[6]={0.25, 0.25, 0.25, 0.1, 0.1, 0.1};  // stepsize used in optimization
-      //float4 iP[6]={3.0, 3.0, 3.0, 1.5, 1.5, 1.5}; // interval used in optimization
-      // New interval makes it twice as fast with same resutls
-      float4 iP[6]={1.0, 1.0, 1.0, 1.0, 1.0, 1.0}; // interval used in optimization 
-
-      cost_function=ssd_cost_function; // used for T1 to T1 registration
-//      cost_function=ncc_cost_function; 
-      set_to_I(Tinter,4);
-
-      // initially assume Tinter=Identity matrix
-      multi(ibTPIL, 4, 4,  fTPIL, 4,  4, T);
-      oldmincost = mincost = cost_function(T, dimb, dimf, sclbim, sclfim,bmsk,fmsk);
-
-      for(int j=0; j<6; j++) P[j]=Pmin[j]=0.0;
-
-      // automatically sets the step size for the first three variables
-      //if( dimf.dx<dimb.dx) stepsize[0]=dimf.dx/5.0;
-      //else stepsize[0]=dimb.dx/5.0;
-      //if( dimf.dy<dimb.dy) stepsize[1]=dimf.dy/5.0;
-      //else stepsize[1]=dimb.dy/5.0;
-      //if( dimf.dz<dimb.dz) stepsize[2]=dimf.dz/5.0;
-      //else stepsize[2]=dimb.dz/5.0;
-      //printf("Step sizes = %f %f %f %f %f %f\n",stepsize[0],stepsize[1],stepsize[2],stepsize[3],stepsize[4],stepsize[5]); 
-
-      if(verbose)
-      {
-         printf("Tolerance = %3.1e\n",TOLERANCE);
-         printf("Initial cost = %f\n", mincost);
-      }
-
-      for(int iter=1; iter<=MAXITER; iter++)
-      {
-         if(verbose)
-         {
-            printf("Iteration %d ...\n",iter);
-         }
-
-         for(int i=0; i<6; i++)
-         {
-            for(P[i] = Pmin[i]-iP[i]; P[i]<=Pmin[i]+iP[i]; P[i]+=stepsize[i] )
-            {
-               set_transformation(P[0], P[1], P[2], P[3], P[4], P[5], "ZXYT", Tinter);
-               multi(Tinter, 4, 4,  fTPIL, 4,  4, T);
-               multi(ibTPIL, 4, 4,  T, 4,  4, T);
-   
-               cost = cost_function(T, dimb, dimf, sclbim, sclfim,bmsk,fmsk);
-   
-               if( cost < mincost )
-               {
-                  Pmin[i]=P[i];
-                  mincost = cost;
-               }
-            }
-            P[i]=Pmin[i];
-
-            if(verbose)
-            {
-               printf("P0=%f P1=%f P2=%f P3=%f P4=%f P5=%f\n", Pmin[0], Pmin[1], Pmin[2], Pmin[3], Pmin[4], Pmin[5]);
-            }
-         }
-
-         if(oldmincost != 0.0)
-         {
-           relative_change=(oldmincost-mincost)/fabs(oldmincost);
-         }
-         else
-         {
-           relative_change=0.0;
-         }
-
-         if(verbose)
-         {
-            printf("Cost = %f\n", mincost);
-            printf("Relative change = %3.1e x 100%\n", relative_change );
-         }
    
-         if( oldmincost==0.0 || relative_change <= TOLERANCE )
-            break;
-         else
-            oldmincost = mincost;
-      }
-
-      set_transformation(P[0], P[1], P[2], P[3], P[4], P[5], "ZXYT", Tinter);
+   ///////////////////////////////////////////////////////////////////////////////////////////////
+   register_images(bim, fim, bmsk, fmsk, dimb, dimf, fTPIL, ibTPIL, ifTPIL, PILmsk, PILbraincloud_dim, Tinter, verbose);
 
-      if( Tinter[0]!=1.0 || Tinter[1]!=0.0 || Tinter[2]!=0.0 || Tinter[3]!=0.0 ||
-      Tinter[4]!=0.0 || Tinter[5]!=1.0 || Tinter[6]!=0.0 || Tinter[7]!=0.0 ||
-      Tinter[8]!=0.0 || Tinter[9]!=0.0 || Tinter[10]!=1.0 || Tinter[11]!=0.0 ||
-      Tinter[12]!=0.0 || Tinter[13]!=0.0 || Tinter[14]!=0.0 || Tinter[15]!=1.0)
-      {
-         // Tinter does not equal identity matrix
-         sqrt_matrix(Tinter, sqrtTinter, invsqrtTinter);
-      }
-      {
-         // Tinter equals identity matrix
-         for(int i=0; i<16; i++) sqrtTinter[i]=invsqrtTinter[i]=Tinter[i];
-      }
-      multi(sqrtTinter, 4, 4,  fTPIL, 4,  4, Tf);
-      multi(invsqrtTinter, 4, 4,  bTPIL, 4,  4, Tb);
-   }
+   midpoint_transformations(Tinter, fTPIL, bTPIL, Tf, Tb);
    
    /////////////////////////////////////////////////
    // save transformation matrices
    /////////////////////////////////////////////////
+   stage = profile_begin("save transformations");
    {
-      FILE *fp;
+      char comment[1024];
 
-      ////////////////////////////////////////////////////////////////////////////////////////////
       //sprintf(filename,"%s_to_midpoint.mrx",fprefix);
       sprintf(filename,"%s_PIL.mrx",fprefix);
-      fp = fopen(filename,"w");
-      if(fp != NULL)
-      {
-         fprintf(fp,"# %s to midpoint rigid-body registration matrix computed by KAIBA",ffile);
-         printMatrix(Tf, 4, 4, "", fp);
-         fclose(fp);
-      }
-      else
-      {
-         printf("Warning: cound not write to %s\n", filename);
-      }
-      ////////////////////////////////////////////////////////////////////////////////////////////
+      sprintf(comment,"# %s to midpoint rigid-body registration matrix computed by KAIBA",ffile);
+      queue_output_matrix(filename, comment, Tf);
 
-      ////////////////////////////////////////////////////////////////////////////////////////////
       //sprintf(filename,"%s_to_midpoint.mrx",bprefix);
       sprintf(filename,"%s_PIL.mrx",bprefix);
-      fp = fopen(filename,"w");
-      if(fp != NULL)
-      {
-         fprintf(fp,"# %s to midpoint rigid-body registration matrix computed by KAIBA",bfile);
-         printMatrix(Tb, 4, 4, "", fp);
-         fclose(fp);
-      }
-      else
+      sprintf(comment,"# %s to midpoint rigid-body registration matrix computed by KAIBA",bfile);
+      queue_output_matrix(filename, comment, Tb);
+
+      for(int i=0; i<16; i++) 
       {
-         printf("Warning: cound not write to %s\n", filename);
+         bpilT[i] = Tb[i];
+         fpilT[i] = Tf[i];
       }
-      ////////////////////////////////////////////////////////////////////////////////////////////
-      
-      free(invT);
    }
+   profile_end(stage);
    /////////////////////////////////////////////////
 
    /////////////////////////////////////////////////
    // save registred images
    /////////////////////////////////////////////////
+   stage = profile_begin("save registered images");
    {
       SHORTIM bimpil; // baseline image after transformation to standard PIL space
       SHORTIM fimpil; // follow-up image after transformation to standard PIL space
@@ -1064,16 +5366,16 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
       fimpil.v= resliceImage(fim, dimf, PILbraincloud_dim, invT, LIN);
       set_dim(fimpil, PILbraincloud_dim);
       sprintf(PILbraincloud_hdr.descrip,"Created by ART's KAIBA module");
-      sprintf(filename,"%s_PIL.nii",fprefix);
-      save_nifti_image(filename, fimpil.v, &PILbraincloud_hdr);
+      output_image_name(filename, fprefix, "_PIL");
+      queue_output_image(filename, fimpil.v, &PILbraincloud_hdr);
       free(invT);
 
       invT = inv4(Tb);
       bimpil.v = resliceImage(bim, dimb, PILbraincloud_dim, invT, LIN);
       set_dim(bimpil, PILbraincloud_dim);
       sprintf(PILbraincloud_hdr.descrip,"Created by ART's KAIBA module");
-      sprintf(filename,"%s_PIL.nii",bprefix);
-      save_nifti_image(filename, bimpil.v, &PILbraincloud_hdr);
+      output_image_name(filename, bprefix, "_PIL");
+      queue_output_image(filename, bimpil.v, &PILbraincloud_hdr);
       free(invT);
 
       set_dim(aimpil, PILbraincloud_dim);
@@ -1084,38 +5386,28 @@ void symmetric_registration(SHORTIM &aimpil, const char *bfile, const char *ffil
       delete bimpil.v;
       delete fimpil.v;
    }
+   profile_end(stage);
    /////////////////////////////////////////////////
 
-   delete sclbim;
-   delete sclfim;
    delete bmsk;
    delete fmsk;
+
+   release_nifti_image(bim);
+   release_nifti_image(fim);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-void compute_lm_transformation(char *lmfile, SHORTIM im, float4 *A)
+void compute_lm_transformation(const LMMODEL *mdl, SHORTIM im, float4 *A)
 {
-   FILE *fp;
-   int NLM;
-   int r;
-   int R;
+   int NLM=mdl->NLM;
+   int r=mdl->r;
+   int R=mdl->R;
    float4 *LM; // 4xNLM matrix
    float4 *CM; // 4xNLM matrix
    int cm[3]; // landmarks center of mass
    int lm[3];
 
-   fp=fopen(lmfile, "r");
-
-   if(fp==NULL) 
-   {
-      printf("Could not find %s, aborting ...\n",lmfile);
-      exit(0);
-   }
-
-   fread(&NLM, sizeof(int), 1, fp);
-   fread(&r, sizeof(int), 1, fp);
-   fread(&R, sizeof(int), 1, fp);
    SPH searchsph(R);
    SPH testsph(r);
    SPH refsph(r);
@@ -1125,16 +5417,16 @@ void compute_lm_transformation(char *lmfile, SHORTIM im, float4 *A)
    if(opt_v)
    {
       printf("\nLandmark detection ...\n");
-      printf("Landmarks file: %s\n", lmfile);
+      printf("Landmarks file: %s\n", mdl->filename);
       printf("Number of landmarks sought = %d\n", NLM);
    }
 
+   int stage = profile_begin("detect_lm %d landmarks", NLM);
+
    for(int n=0; n<NLM; n++)
    {
-      fread(&cm[0], sizeof(int), 1, fp);
-      fread(&cm[1], sizeof(int), 1, fp);
-      fread(&cm[2], sizeof(int), 1, fp);
-      fread(refsph.v, sizeof(float4), refsph.n, fp);
+      for(int i=0; i<3; i++) cm[i] = mdl->cm[3*n+i];
+      memcpy(refsph.v, mdl->ref+(size_t)n*mdl->nref, refsph.n*sizeof(float4));
 
       CM[0*NLM + n]=(cm[0] - (im.nx-1)/2.0)*im.dx; 
       CM[1*NLM + n]=(cm[1] - (im.ny-1)/2.0)*im.dy;
@@ -1149,7 +5441,7 @@ void compute_lm_transformation(char *lmfile, SHORTIM im, float4 *A)
       LM[3*NLM + n]=1;
    }
 
-   fclose(fp);
+   profile_end(stage);
 
    float4 *invLMLMT;
    float4 LMLMT[16];
@@ -1167,7 +5459,9 @@ void compute_lm_transformation(char *lmfile, SHORTIM im, float4 *A)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-void find_roi(nifti_1_header *subimhdr, SHORTIM pilim, float4 pilT[],const char *side, const char *prefix)
+// Returns the fuzzy ROI of side (lhc3 or rhc3) in the native space of the image of header 
+// subimhdr (allocated), which is also saved as <prefix>_LHROI or _RHROI.
+int2 *find_roi(nifti_1_header *subimhdr, SHORTIM pilim, float4 pilT[],const char *side, const char *prefix)
 {
    DIM subdim;
 
@@ -1197,8 +5491,8 @@ void find_roi(nifti_1_header *subimhdr, SHORTIM pilim, float4 pilT[],const char
    // hcT is an affine transformation from subim to hcim
    float4 hcT[16];
 
-   sprintf(filename,"%s/%s.mdl",ARTHOME,side);
-   compute_lm_transformation(filename, pilim, hcT);
+   sprintf(filename,"%s.mdl",side);
+   compute_lm_transformation(atlas_model(filename), pilim, hcT);
    multi(hcT,4,4, pilT, 4,4, hcT);
 
    //sprintf(filename,"%s_%s.mrx",prefix,side);
@@ -1211,10 +5505,13 @@ void find_roi(nifti_1_header *subimhdr, SHORTIM pilim, float4 pilT[],const char
    SHORTIM msk; 
    nifti_1_header mskhdr;
    
-   sprintf(filename,"%s/%s.nii",ARTHOME,side);
-   msk.v = (int2 *)read_nifti_image(filename, &mskhdr);
+   sprintf(filename,"%s.nii",side);
+   {
+      const ATLASIMAGE *atlas = atlas_image(filename);
 
-   if(msk.v==NULL) exit(0);
+      msk.v = atlas->v; // read-only
+      mskhdr = atlas->hdr;
+   }
 
    msk.nx = mskhdr.dim[1];
    msk.ny = mskhdr.dim[2];
@@ -1230,14 +5527,14 @@ void find_roi(nifti_1_header *subimhdr, SHORTIM pilim, float4 pilT[],const char
    //number of atlases: (mskhdr.dim[4]-1)/2;
 
    ////////////////////////////////////////////////////////////////////////////////////////////
+   int2 *ntv_spc_roi;
    {
-      int2 *ntv_spc_roi;
       float4 T[16];
 
       if( side[0]=='r')
-         sprintf(filename,"%s_RHROI.nii",prefix);
+         output_image_name(filename, prefix, "_RHROI");
       if( side[0]=='l')
-         sprintf(filename,"%s_LHROI.nii",prefix);
+         output_image_name(filename, prefix, "_LHROI");
 
       for(int n=0; n<hcim.nv; n++) stndrd_roi[n] = 0;
 
@@ -1253,12 +5550,12 @@ void find_roi(nifti_1_header *subimhdr, SHORTIM pilim, float4 pilT[],const char
       ntv_spc_roi = resliceImage(stndrd_roi, hcim.nx, hcim.ny, hcim.nz, hcim.dx, hcim.dy, hcim.dz,
       subdim.nx, subdim.ny, subdim.nz, subdim.dx, subdim.dy, subdim.dz, T, LIN);
 
-      save_nifti_image(filename, ntv_spc_roi, subimhdr);
+      queue_output_image(filename, ntv_spc_roi, subimhdr);
 
-      free(ntv_spc_roi); free(stndrd_roi);
+      free(stndrd_roi);
    }
 
-   return;
+   return(ntv_spc_roi);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
@@ -1308,47 +5605,19 @@ void setMX(int2 *image, int2 *msk, int nv, int *high, float4 percent)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-float8 compute_hi(char *imfile, char *roifile)
+// Returns the HI of image im within the fuzzy ROI roi, both of nv voxels.  im is modified.
+float8 compute_hi(int2 *im, int2 *roi, int nv)
 {
    float4 fuzzy_parenchymasize=0.0;
    int gm_pk_srch_strt;
    int roisize; // number of non-zero voxels in roi
    float4 fuzzy_roisize=0.0;
-   int2 *roi;
-   int2 *im;
-   nifti_1_header hdr;
-   int nx, ny, nz, np, nv;
-   float4 dx, dy, dz;
    int2 roimin, roimax; // minimum and maximum voxels values in the ROI image
    int mx;
    int nbin;
 
-   //if(opt_v)
-   //{
-   //   printf("Computing HI ...\n");
-   //   printf("Image file: %s\n", imfile);
-   //   printf("ROI file: %s\n", roifile);
-   //}
-
-   roi = (int2 *)read_nifti_image(roifile, &hdr);
-   nx = hdr.dim[1];
-   ny = hdr.dim[2];
-   nz = hdr.dim[3];
-   dx = hdr.pixdim[1];
-   dy = hdr.pixdim[2];
-   dz = hdr.pixdim[3];
-   nv = nx*ny*nz;
-   np = nx*ny;
-
    minmax(roi,nv,roimin,roimax);
 
-   //if(opt_v)
-   //{
-   //   printf("Matrix size = %d x %d x %d\n", nx, ny, nz);
-   //   printf("Voxel size = %f x %f x %f\n", dx, dy, dz);
-   //   printf("Min = %d Max = %d\n", roimin, roimax);
-   //}
-
    roisize = 0;
    fuzzy_roisize=0.0;
    for(int i=0; i<nv; i++) 
@@ -1364,7 +5633,6 @@ float8 compute_hi(char *imfile, char *roifile)
       //printf("Fuzzy ROI size = %f\n", fuzzy_roisize);
    //}
 
-   im = (int2 *)read_nifti_image(imfile, &hdr);
    setMX(im, roi, nv, &mx, HISTCUTOFF);
 
    //if(opt_v)
@@ -1492,8 +5760,28 @@ float8 compute_hi(char *imfile, char *roifile)
    return(1.0-csfvol);
 }
 
+// Returns the HI of the image im within the fuzzy ROI roi, both of nv voxels, without modifying
+// im (for example a read-only view of map_nifti_image()).
+float8 image_hi(const int2 *im, int2 *roi, int nv)
+{
+   int2 *tmp;
+   float8 hi;
+
+   tmp = (int2 *)malloc((size_t)nv*sizeof(int2));
+   memcpy(tmp, im, (size_t)nv*sizeof(int2));
+
+   hi = compute_hi(tmp, roi, nv);
+
+   free(tmp);
+
+   return(hi);
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
+// the tools kaiba_bench.cxx and kaiba_pack.cxx include this file with KAIBA_NO_MAIN defined and 
+// provide their own main()
+#ifndef KAIBA_NO_MAIN
 int main(int argc, char **argv)
 {
    char cmnd[1024]=""; // stores the command to run with system
@@ -1553,6 +5841,54 @@ int main(int argc, char **argv)
          case 'f':
             sprintf(ffile,"%s",optarg);
             break;
+         case 't':
+            opt_threads=atoi(optarg);
+            if(opt_threads<1) opt_threads=1;
+            break;
+         case 'y':
+            opt_pyramid=atoi(optarg);
+            if(opt_pyramid<1) opt_pyramid=1;
+            if(opt_pyramid>MAXPYRAMID) opt_pyramid=MAXPYRAMID;
+            break;
+         case 's':
+            opt_simd=YES;
+            break;
+         case 'G':
+            opt_gn=YES;
+            break;
+         case 'S':
+            opt_sample=atof(optarg);
+            if(opt_sample<=0.0 || opt_sample>1.0) opt_sample=1.0;
+            break;
+         case 'x':
+            opt_fixed16=YES;
+            opt_simd=YES;
+            break;
+         case 'k':
+            opt_brick=YES;
+            opt_simd=YES;
+            break;
+         case 'c':
+            parse_cost_option(optarg);
+            break;
+         case 'H':
+            opt_halfway=YES;
+            break;
+         case 'P':
+            sprintf(opt_profile,"%s",optarg);
+            break;
+         case 'C':
+            opt_counters=YES;
+            break;
+         case 'K':
+            sprintf(opt_pack,"%s",optarg);
+            break;
+         case 'z':
+            opt_gz=YES;
+            break;
+         case 'N':
+            opt_nosave=YES;
+            break;
          case '?':
             print_help_and_exit();
       }
@@ -1560,6 +5896,52 @@ int main(int argc, char **argv)
 
    getARTHOME();
 
+   if(opt_pack[0]!='\0')
+   {
+      if( !open_atlas_pack(opt_pack) )
+      {
+         printf("Error reading atlas pack %s, aborting ...\n", opt_pack);
+         exit(1);
+      }
+   }
+   else
+   {
+      sprintf(opt_pack,"%s/kaiba.pack",ARTHOME);
+      if( !open_atlas_pack(opt_pack) ) opt_pack[0]='\0';
+   }
+
+   if(opt_v && opt_pack[0]!='\0') printf("Atlas pack: %s\n", opt_pack);
+
+   if( opt_gn && (opt_metric!=COST_SSD || opt_interp!=INTERP_TRILINEAR) )
+   {
+      printf("-gn requires the default cost function (-cost ssd:trilinear).\n");
+      exit(1);
+   }
+
+   if( opt_gn && opt_halfway )
+   {
+      printf("-gn cannot be used with -halfway.\n");
+      exit(1);
+   }
+
+   if( opt_counters && opt_profile[0]=='\0' )
+   {
+      printf("-counters requires -profile.\n");
+      exit(1);
+   }
+
+   if( opt_counters && !open_counters() )
+   {
+      printf("Warning: hardware performance counters are not available (see perf_event_paranoid)\n");
+      opt_counters=NO;
+   }
+
+   if(opt_simd)
+   {
+      const char *isa = select_row_kernels();
+      if(opt_v) printf("Cost function kernels: %s\n", isa);
+   }
+
    // Ensure that an output prefix has been specified at the command line.
    if( opprefix[0]=='\0' )
    {
@@ -1578,28 +5960,19 @@ int main(int argc, char **argv)
       exit(0);
    }
 
-   float4 pilT[16];
+   int runstage, stage;
+
+   runstage = profile_begin("kaiba");
 
    /////////////////////////////////////////////////////////////////////////////////////////////
-   // read PILbraincloud.nii from the $ARTHOME directory
-   // The only reason this is done is to read dimensions of PILbrain.nii
+   // PILbrain.nii from the $ARTHOME directory, for its dimensions.  It stays in the atlas cache
+   // for symmetric_registration().
    /////////////////////////////////////////////////////////////////////////////////////////////
-   int2 *PILbraincloud;
    DIM PILbraincloud_dim;
    nifti_1_header PILbraincloud_hdr; 
 
-   sprintf(filename,"%s/PILbrain.nii",ARTHOME);
-
-   PILbraincloud = (int2 *)read_nifti_image(filename, &PILbraincloud_hdr);
-
-   if(PILbraincloud==NULL)
-   {
-         printf("Error reading %s, aborting ...\n", filename);
-         exit(1);
-   }
-
+   PILbraincloud_hdr = atlas_image("PILbrain.nii")->hdr;
    set_dim(PILbraincloud_dim, PILbraincloud_hdr);
-   delete PILbraincloud;
    /////////////////////////////////////////////////////////////////////////////////////////////
       
    sprintf(filename,"%s.csv",opprefix);
@@ -1611,11 +5984,16 @@ int main(int argc, char **argv)
    if( bfile[0]!='\0' && ffile[0]!='\0')
    {
       SHORTIM aimpil; // average of baseline and follow-up images after transformation to standard PIL space
+      float4 bpilT[16]; // baseline to midpoint PIL space
+      float4 fpilT[16]; // follow-up to midpoint PIL space
+      int2 *rhroi, *lhroi;
 
       if( niftiFilename(bprefix, bfile)==0 ) exit(0);
       if( niftiFilename(fprefix, ffile)==0 ) exit(0);
 
-      symmetric_registration(aimpil, bfile, ffile, blmfile, flmfile, opt_v);
+      stage = profile_begin("symmetric_registration");
+      symmetric_registration(aimpil, bfile, ffile, blmfile, flmfile, bpilT, fpilT, opt_v);
+      profile_end(stage);
 
       ///////////////////////////////////////////////////////////////////////////////////////////////
       // processing baseline image
@@ -1623,7 +6001,9 @@ int main(int argc, char **argv)
       SHORTIM bim; // baseline image
       nifti_1_header bim_hdr;  // baseline image NIFTI header
 
-      bim.v = (int2 *)read_nifti_image(bfile, &bim_hdr);
+      stage = profile_begin("read baseline image");
+      bim.v = map_nifti_image(bfile, &bim_hdr, NO);
+      profile_end(stage);
 
       if(bim.v==NULL)
       {
@@ -1631,21 +6011,28 @@ int main(int argc, char **argv)
          exit(1);
       }
 
-      sprintf(filename,"%s_PIL.mrx",bprefix);
-      loadTransformation(filename, pilT);
+      stage = profile_begin("find_roi baseline");
+      lhroi = find_roi(&bim_hdr, aimpil, bpilT, "lhc3", bprefix);
+      rhroi = find_roi(&bim_hdr, aimpil, bpilT, "rhc3", bprefix);
+      profile_end(stage);
 
-      find_roi(&bim_hdr, aimpil, pilT, "lhc3", bprefix);
-      find_roi(&bim_hdr, aimpil, pilT, "rhc3", bprefix);
+      stage = profile_begin("compute_hi baseline");
+      {
+         int nv = bim_hdr.dim[1]*bim_hdr.dim[2]*bim_hdr.dim[3];
 
-      free(bim.v);
+         output_image_name(roifile, bprefix, "_RHROI");
+         hi=image_hi(bim.v, rhroi, nv);
+         fprintf(fp,"%s, %s, %lf\n",bfile,roifile,hi);
 
-      sprintf(roifile,"%s_RHROI.nii",bprefix);
-      hi=compute_hi(bfile, roifile);
-      fprintf(fp,"%s, %s, %lf\n",bfile,roifile,hi);
+         output_image_name(roifile, bprefix, "_LHROI");
+         hi=image_hi(bim.v, lhroi, nv);
+         fprintf(fp,"%s, %s, %lf\n",bfile,roifile,hi);
+      }
+      profile_end(stage);
 
-      sprintf(roifile,"%s_LHROI.nii",bprefix);
-      hi=compute_hi(bfile, roifile);
-      fprintf(fp,"%s, %s, %lf\n",bfile,roifile,hi);
+      free(rhroi);
+      free(lhroi);
+      release_nifti_image(bim.v);
       ///////////////////////////////////////////////////////////////////////////////////////////////
 
       ///////////////////////////////////////////////////////////////////////////////////////////////
@@ -1654,7 +6041,9 @@ int main(int argc, char **argv)
       SHORTIM fim; // followup image
       nifti_1_header fim_hdr;  // followup image NIFTI header
 
-      fim.v = (int2 *)read_nifti_image(ffile, &fim_hdr);
+      stage = profile_begin("read follow-up image");
+      fim.v = map_nifti_image(ffile, &fim_hdr, NO);
+      profile_end(stage);
 
       if(fim.v==NULL)
       {
@@ -1662,21 +6051,28 @@ int main(int argc, char **argv)
          exit(1);
       }
 
-      sprintf(filename,"%s_PIL.mrx",fprefix);
-      loadTransformation(filename, pilT);
+      stage = profile_begin("find_roi follow-up");
+      lhroi = find_roi(&fim_hdr, aimpil, fpilT, "lhc3", fprefix);
+      rhroi = find_roi(&fim_hdr, aimpil, fpilT, "rhc3", fprefix);
+      profile_end(stage);
 
-      find_roi(&fim_hdr, aimpil, pilT, "lhc3", fprefix);
-      find_roi(&fim_hdr, aimpil, pilT, "rhc3", fprefix);
+      stage = profile_begin("compute_hi follow-up");
+      {
+         int nv = fim_hdr.dim[1]*fim_hdr.dim[2]*fim_hdr.dim[3];
 
-      free(fim.v);
+         output_image_name(roifile, fprefix, "_RHROI");
+         hi=image_hi(fim.v, rhroi, nv);
+         fprintf(fp,"%s, %s, %lf\n",ffile,roifile,hi);
 
-      sprintf(roifile,"%s_RHROI.nii",fprefix);
-      hi=compute_hi(ffile, roifile);
-      fprintf(fp,"%s, %s, %lf\n",ffile,roifile,hi);
+         output_image_name(roifile, fprefix, "_LHROI");
+         hi=image_hi(fim.v, lhroi, nv);
+         fprintf(fp,"%s, %s, %lf\n",ffile,roifile,hi);
+      }
+      profile_end(stage);
 
-      sprintf(roifile,"%s_LHROI.nii",fprefix);
-      hi=compute_hi(ffile, roifile);
-      fprintf(fp,"%s, %s, %lf\n",ffile,roifile,hi);
+      free(rhroi);
+      free(lhroi);
+      release_nifti_image(fim.v);
       ///////////////////////////////////////////////////////////////////////////////////////////////
 
       delete aimpil.v;
@@ -1698,7 +6094,9 @@ int main(int argc, char **argv)
       nifti_1_header bhdr;  // baseline image NIFTI header
       DIM dimb; // baseline image dimensions structure
 
-      bim.v = (int2 *)read_nifti_image(bfile, &bhdr);
+      stage = profile_begin("read baseline image");
+      bim.v = map_nifti_image(bfile, &bhdr, NO);
+      profile_end(stage);
 
       if(bim.v==NULL)
       {
@@ -1714,6 +6112,7 @@ int main(int argc, char **argv)
       float4 bTPIL[16]; // takes the baseline image to standard PIL orientation 
       float4 *invT;
       if(opt_v) printf("Computing baseline image PIL transformation ...\n");
+      stage = profile_begin("baseline PIL transformation");
       if(!opt_newPIL)
          standard_PIL_transformation(bfile, blmfile, opt_v, bTPIL);
       else
@@ -1727,27 +6126,55 @@ int main(int argc, char **argv)
          }
       }
 
+      profile_end(stage);
+
+      stage = profile_begin("save registered image");
       invT = inv4(bTPIL);
       bimpil.v = resliceImage(bim.v, dimb, PILbraincloud_dim, invT, LIN);
       set_dim(bimpil, PILbraincloud_dim);
       free(invT);
 
       sprintf(PILbraincloud_hdr.descrip,"Created by ART's KAIBA module");
-      sprintf(filename,"%s_PIL.nii",bprefix);
-      save_nifti_image(filename, bimpil.v, &PILbraincloud_hdr);
+      output_image_name(filename, bprefix, "_PIL");
+      queue_output_image(filename, bimpil.v, &PILbraincloud_hdr);
+      profile_end(stage);
+
+      int2 *rhroi, *lhroi;
 
-      find_roi(&bhdr, bimpil, bTPIL, "lhc3", bprefix);
-      find_roi(&bhdr, bimpil, bTPIL, "rhc3", bprefix);
+      stage = profile_begin("find_roi baseline");
+      lhroi = find_roi(&bhdr, bimpil, bTPIL, "lhc3", bprefix);
+      rhroi = find_roi(&bhdr, bimpil, bTPIL, "rhc3", bprefix);
+      profile_end(stage);
 
       delete bimpil.v;
 
-      sprintf(roifile,"%s_RHROI.nii",bprefix);
-      hi=compute_hi(bfile, roifile);
+      stage = profile_begin("compute_hi baseline");
+
+      output_image_name(roifile, bprefix, "_RHROI");
+      hi=image_hi(bim.v, rhroi, dimb.nv);
       fprintf(fp,"%s, %s, %lf\n",bfile,roifile,hi);
 
-      sprintf(roifile,"%s_LHROI.nii",bprefix);
-      hi=compute_hi(bfile, roifile);
+      output_image_name(roifile, bprefix, "_LHROI");
+      hi=image_hi(bim.v, lhroi, dimb.nv);
       fprintf(fp,"%s, %s, %lf\n",bfile,roifile,hi);
+
+      profile_end(stage);
+
+      free(rhroi);
+      free(lhroi);
+      release_nifti_image(bim.v);
    }
    fclose(fp);
+
+   stage = profile_begin("finish outputs");
+   finish_outputs();
+   profile_end(stage);
+
+   free_image_maps();
+   free_atlases();
+
+   profile_end(runstage);
+
+   if(opt_profile[0]!='\0') write_profile(opt_profile);
 }
+#endif
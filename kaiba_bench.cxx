@@ -0,0 +1,945 @@
+// kaiba_bench: microbenchmarks of the KAIBA cost functions, reslicing and histogramming on
+// synthetic phantoms generated in memory, so that no ARTHOME data or patient scans are needed.
+// Built and run by "make bench".
+//
+// Every kernel is timed on phantoms of 1 mm, 0.8 mm and 0.5 mm voxels (a 192 x 224 x 192 mm
+// field of view) and reported in voxels per second and GB/s.  The GB/s figures count the
+// smallest possible memory traffic of each kernel (every input and output voxel read or
+// written once), so they are a lower bound on the actual bandwidth.
+//
+// With -e2e, it instead runs the registration of kaiba -b -f on a synthetic baseline and a
+// follow-up made from it by a known rigid-body transformation and intensity scaling, and
+// reports the time of each stage and the error of the registration against the known
+// transformation.  The PIL transformations are taken to be the identity.
+//
+// With -validate, it runs the fast paths selected on the command line and the scalar reference
+// on the same synthetic images, and reports the largest deviation of the SSD and NCC costs from
+// ssd_cost_reference() and ncc_cost_reference(), and the differences in the final Tf and Tb and
+// in the HI, each against a tolerance.  The reference registration searches with
+// ssd_cost_reference() itself, so that it does not share the mask spans, early abandon or 
+// cost engine of the fast paths.
+
+#define KAIBA_NO_MAIN
+#include "kaiba.cxx"
+#include "hist2D_line.c"
+
+// field of view of the phantoms (mm)
+#define FOVX 192.0
+#define FOVY 224.0
+#define FOVZ 192.0
+
+int opt_reps=5; // number of timed repetitions of each kernel
+float4 opt_rot=5.0; // rotation (degrees) about each axis of the transformation used by the kernels
+int opt_e2e=NO; // flag for the end-to-end registration benchmark
+float4 opt_vs=1.0; // voxel size (mm) of the end-to-end benchmark
+float4 opt_shift=3.0; // translation (mm) along each axis of the end-to-end benchmark
+float4 opt_scale=1.1; // intensity scaling of the follow-up of the end-to-end benchmark
+float4 opt_maxerr=1.0; // largest acceptable displacement error (mm) of the end-to-end benchmark
+int opt_validate=NO; // flag for the validation of the fast paths
+float4 opt_costtol=1.0e-4; // largest acceptable relative deviation of the fast cost functions
+float4 opt_Ttol=0.1; // largest acceptable displacement (mm) between the reference and fast Tf and Tb
+float4 opt_hitol=1.0e-3; // largest acceptable difference between the reference and fast HI
+
+static struct option bench_options[] =
+{
+   {"-reps",1,'r'},
+   {"-rot",1,'a'},
+   {"-threads",1,'t'},
+   {"-simd",0,'s'},
+   {"-e2e",0,'e'},
+   {"-validate",0,'V'},
+   {"-costtol",1,'o'},
+   {"-Ttol",1,'T'},
+   {"-hitol",1,'q'},
+   {"-fixed16",0,'x'},
+   {"-brick",0,'k'},
+   {"-vs",1,'d'},
+   {"-shift",1,'u'},
+   {"-scale",1,'i'},
+   {"-maxerr",1,'m'},
+   {"-pyramid",1,'y'},
+   {"-gn",0,'G'},
+   {"-sample",1,'S'},
+   {"-cost",1,'c'},
+   {"-halfway",0,'H'},
+   {"-profile",1,'P'},
+   {"-v",0,'v'},
+   {"-h",0,'h'},
+   {0,0,0}
+};
+
+void print_bench_help_and_exit()
+{
+   printf("\nUsage: kaiba_bench [options]\n"
+   "\nOptions:\n"
+   "   -reps <N>: Number of timed repetitions of each kernel (default: 5)\n"
+   "   -rot <degrees>: Rotation about each axis of the transformation applied by the cost\n"
+   "   functions and resliceImage (default: 5)\n"
+   "   -threads <N>: Number of threads used by the cost functions (default: 1)\n"
+   "   -simd : Uses the fast row kernels in the cost functions\n"
+   "\nEnd-to-end registration benchmark:\n"
+   "   -e2e : Registers a synthetic follow-up, rotated by -rot degrees about each axis and\n"
+   "   translated by -shift mm along each axis, to a synthetic baseline and reports the time of\n"
+   "   each stage and the registration error.  Exits with status 1 if the largest displacement\n"
+   "   error within the brain exceeds -maxerr.\n"
+   "   -vs <mm>: Voxel size of the synthetic images (default: 1)\n"
+   "   -shift <mm>: Translation along each axis (default: 3)\n"
+   "   -scale <s>: Intensity scaling of the follow-up (default: 1.1)\n"
+   "   -maxerr <mm>: Largest acceptable displacement error (default: 1)\n"
+   "   -pyramid <N>, -gn, -sample <f>, -cost <metric[:interp]>, -halfway : Registration\n"
+   "   options, as in kaiba\n"
+   "   -profile <filename>: Also saves the stages in Chrome trace format (see kaiba -profile)\n"
+   "   -v : Enables verbose mode\n"
+   "\nValidation of the fast paths:\n"
+   "   -validate : Runs the fast paths selected by -threads, -simd, -fixed16, -brick, -sample,\n"
+   "   -pyramid, -gn, -cost and -halfway and the scalar reference on the same synthetic images\n"
+   "   (-vs, -rot, -shift, -scale) and compares the SSD and NCC costs, the final Tf and Tb and the\n"
+   "   HI.  The reference registration uses ssd_cost_reference() (-cost ssd:trilinear) in the\n"
+   "   native space.  Exits with status 1 if any difference exceeds its tolerance.\n"
+   "   -fixed16 : 16-bit fixed-point images in the cost functions (implies -simd)\n"
+   "   -brick : Bricked image layout in the cost functions (implies -simd)\n"
+   "   -costtol <r>: Largest relative deviation of the costs (default: 1e-4)\n"
+   "   -Ttol <mm>: Largest displacement within the brain between the Tf (or Tb) of the two\n"
+   "   paths (default: 0.1)\n"
+   "   -hitol <h>: Largest difference in HI (default: 1e-3)\n"
+   "\n");
+
+   exit(0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Synthetic phantoms
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+// Inside of the ellipsoid centered at (cx,cy,cz) with semi-axes (ax,ay,az), as the square of
+// the normalized radius (< 1 inside).
+static inline float4 ellipsoid(float4 x, float4 y, float4 z, float4 cx, float4 cy, float4 cz, float4 ax, float4 ay, float4 az)
+{
+   x = (x-cx)/ax;
+   y = (y-cy)/ay;
+   z = (z-cz)/az;
+
+   return( x*x + y*y + z*z );
+}
+
+// Intensity of the synthetic head at (x,y,z) mm from its center, with roughly the contrast of
+// a T1W scan: scalp, CSF, a folded gray matter ribbon, white matter, ventricles and two
+// hippocampus-like gray matter structures.  brain receives YES inside the brain.
+static int2 phantom_intensity(float4 x, float4 y, float4 z, int &brain)
+{
+   float4 r, fold;
+
+   brain = NO;
+
+   r = ellipsoid(x, y, z, 0.0, 0.0, 0.0, 75.0, 95.0, 70.0);
+   if( r >= 1.0 ) return(0);
+   if( r >= 0.86 ) return(300); // scalp
+   if( r >= 0.77 ) return(100); // CSF
+
+   brain = YES;
+
+   fold = 0.06*sin(x/6.0)*sin(y/7.0)*sin(z/5.0);
+   if( r >= 0.52+fold ) return(600); // gray matter
+
+   if( ellipsoid(fabs(x), y, z, 8.0, 5.0, 10.0, 5.0, 20.0, 8.0) < 1.0 ) return(120); // ventricles
+   if( ellipsoid(fabs(x), y, z, 28.0, -20.0, -15.0, 6.0, 15.0, 6.0) < 1.0 ) return(620); // hippocampi
+
+   return(900); // white matter
+}
+
+// Sets dim to the phantom grid of voxel size vs and returns the phantom sampled at T p for the
+// voxels p (mm from the center of the grid), intensities scaled by scale plus uniform noise of
+// amplitude noise.  msk receives the brain mask (100 inside) if it is not NULL.  T=NULL is the
+// identity.
+int2 *synthetic_head(DIM &dim, float4 vs, float4 *T, float4 scale, float4 noise, unsigned int seed, int2 *&msk)
+{
+   int2 *im;
+
+   dim.nx = (int)(FOVX/vs + 0.5);
+   dim.ny = (int)(FOVY/vs + 0.5);
+   dim.nz = (int)(FOVZ/vs + 0.5);
+   dim.np = dim.nx*dim.ny;
+   dim.nv = dim.np*dim.nz;
+   dim.dx = dim.dy = dim.dz = vs;
+
+   im = (int2 *)calloc(dim.nv, sizeof(int2));
+   msk = (int2 *)calloc(dim.nv, sizeof(int2));
+
+   #pragma omp parallel for num_threads(opt_threads)
+   for(int k=0; k<dim.nz; k++)
+   for(int j=0; j<dim.ny; j++)
+   for(int i=0; i<dim.nx; i++)
+   {
+      int v = k*dim.np + j*dim.nx + i;
+      int brain;
+      float4 p[3], q[3];
+
+      p[0] = (i - (dim.nx-1)/2.0)*dim.dx;
+      p[1] = (j - (dim.ny-1)/2.0)*dim.dy;
+      p[2] = (k - (dim.nz-1)/2.0)*dim.dz;
+
+      for(int a=0; a<3; a++)
+         q[a] = (T==NULL) ? p[a] : T[4*a]*p[0] + T[4*a+1]*p[1] + T[4*a+2]*p[2] + T[4*a+3];
+
+      im[v] = phantom_intensity(q[0], q[1], q[2], brain);
+      if(im[v]>0) im[v] = (int2)( scale*im[v] + noise*(2.0*voxel_random(seed, v)-1.0) + 0.5 );
+      if(im[v]<0) im[v] = 0;
+      if(brain) msk[v] = 100;
+   }
+
+   return(im);
+}
+
+// Returns a fuzzy ROI (0 to 100) around the left hippocampus of the phantom grid dim.
+int2 *synthetic_roi(DIM dim)
+{
+   int2 *roi;
+   float4 r;
+
+   roi = (int2 *)calloc(dim.nv, sizeof(int2));
+
+   for(int k=0; k<dim.nz; k++)
+   for(int j=0; j<dim.ny; j++)
+   for(int i=0; i<dim.nx; i++)
+   {
+      r = ellipsoid((i-(dim.nx-1)/2.0)*dim.dx, (j-(dim.ny-1)/2.0)*dim.dy, (k-(dim.nz-1)/2.0)*dim.dz,
+      28.0, -20.0, -15.0, 10.0, 20.0, 10.0);
+
+      if( r < 1.0 ) roi[k*dim.np + j*dim.nx + i] = (int2)(100.0*(1.0-r) + 0.5);
+   }
+
+   return(roi);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+static double bench_clock()
+{
+   return( profile_clock(CLOCK_MONOTONIC) );
+}
+
+// Prints one result line: the best time of the repetitions, and the voxels and bytes of one
+// repetition.
+static void report(const char *kernel, float4 vs, DIM dim, double t, double voxels, double bytes)
+{
+   printf("%-24s %4.2f mm %4d x %4d x %4d %10.3f ms %10.2f Mvoxel/s %8.2f GB/s\n", kernel, vs,
+   dim.nx, dim.ny, dim.nz, 1.0e3*t, 1.0e-6*voxels/t, 1.0e-9*bytes/t);
+}
+
+void bench_size(float4 vs)
+{
+   DIM dim;
+   int2 *bim, *fim, *bmsk, *fmsk;
+   float4 *sclbim, *sclfim;
+   float4 T[16];
+   float4 Tbatch[16*MAXBATCH];
+   float8 cost[MAXBATCH];
+   double t, best;
+   MASKSPANS bspans, fspans;
+
+   // the follow-up is the baseline moved by T, so that the cost functions sample realistic data
+   set_transformation(opt_rot, opt_rot, opt_rot, 2.0, -3.0, 1.5, "ZXYT", T);
+
+   bim = synthetic_head(dim, vs, NULL, 1.0, 20.0, 1, bmsk);
+   fim = synthetic_head(dim, vs, T, 1.05, 20.0, 2, fmsk);
+
+   sclbim = (float4 *)calloc(dim.nv, sizeof(float4));
+   sclfim = (float4 *)calloc(dim.nv, sizeof(float4));
+   {
+      float4 bscale = imageMean(bim, bmsk, dim.nv);
+      float4 fscale = imageMean(fim, fmsk, dim.nv);
+
+      for(int v=0; v<dim.nv; v++) sclbim[v] = bim[v]/bscale;
+      for(int v=0; v<dim.nv; v++) sclfim[v] = fim[v]/fscale;
+   }
+
+   build_mask_spans(bmsk, sclbim, dim, bspans);
+   build_mask_spans(fmsk, sclfim, dim, fspans);
+
+   double nval = bspans.nval + fspans.nval;
+
+   ////////////////////////////////////////////////////////////////////////////////////////
+   // cost functions: one 4-byte packed value and one 4-byte sample per masked voxel
+   ////////////////////////////////////////////////////////////////////////////////////////
+   best=1.0e30;
+   for(int r=0; r<opt_reps; r++)
+   {
+      t = bench_clock();
+      ssd_cost_function(T, dim, dim, sclbim, sclfim, &bspans, &fspans);
+      t = bench_clock()-t;
+      if(t<best) best=t;
+   }
+   report("ssd_cost_function", vs, dim, best, nval, 8.0*nval);
+
+   best=1.0e30;
+   for(int r=0; r<opt_reps; r++)
+   {
+      t = bench_clock();
+      ncc_cost_function(T, dim, dim, sclbim, sclfim, &bspans, &fspans);
+      t = bench_clock()-t;
+      if(t<best) best=t;
+   }
+   report("ncc_cost_function", vs, dim, best, nval, 8.0*nval);
+
+   // a full batch of a line search, evaluated in full
+   for(int m=0; m<MAXBATCH; m++)
+      set_transformation(opt_rot, opt_rot, opt_rot + 0.1*m, 2.0, -3.0, 1.5, "ZXYT", Tbatch+16*m);
+
+   best=1.0e30;
+   for(int r=0; r<opt_reps; r++)
+   {
+      t = bench_clock();
+      ssd_cost_function_batch(Tbatch, MAXBATCH, dim, dim, sclbim, sclfim, &bspans, &fspans, INFINITY, cost);
+      t = bench_clock()-t;
+      if(t<best) best=t;
+   }
+   report("ssd_cost_function_batch", vs, dim, best, MAXBATCH*nval, 4.0*nval + 4.0*MAXBATCH*nval);
+
+   ////////////////////////////////////////////////////////////////////////////////////////
+   // resliceImage: one 2-byte input and one 2-byte output voxel per voxel
+   ////////////////////////////////////////////////////////////////////////////////////////
+   best=1.0e30;
+   for(int r=0; r<opt_reps; r++)
+   {
+      int2 *out;
+
+      t = bench_clock();
+      out = resliceImage(fim, dim, dim, T, LIN);
+      t = bench_clock()-t;
+      if(t<best) best=t;
+
+      free(out);
+   }
+   report("resliceImage", vs, dim, best, dim.nv, 4.0*dim.nv);
+
+   ////////////////////////////////////////////////////////////////////////////////////////
+   // compute_hi histogramming and EM fit: 2-byte image and ROI voxels
+   ////////////////////////////////////////////////////////////////////////////////////////
+   {
+      int2 *roi = synthetic_roi(dim);
+      int2 *im = (int2 *)calloc(dim.nv, sizeof(int2));
+
+      best=1.0e30;
+      for(int r=0; r<opt_reps; r++)
+      {
+         for(int v=0; v<dim.nv; v++) im[v]=bim[v]; // compute_hi() modifies im
+
+         t = bench_clock();
+         compute_hi(im, roi, dim.nv);
+         t = bench_clock()-t;
+         if(t<best) best=t;
+      }
+      report("compute_hi", vs, dim, best, dim.nv, 4.0*dim.nv);
+
+      free(im);
+      free(roi);
+   }
+
+   ////////////////////////////////////////////////////////////////////////////////////////
+   // hist2D_line: 2D histogram (2-byte baseline, follow-up and weight voxels) and line fit
+   ////////////////////////////////////////////////////////////////////////////////////////
+   {
+      int2 *rfim; // follow-up resliced to the baseline, as in PIL space
+      int *hist;
+      int highb, highf;
+      int n;
+      double *x0, *x1, *w, *w_const;
+      double u[2], d;
+      float4 *invT = inv4(T);
+
+      rfim = resliceImage(fim, dim, dim, invT, LIN);
+      free(invT);
+
+      best=1.0e30;
+      for(int r=0; r<opt_reps; r++)
+      {
+         t = bench_clock();
+         hist = hist2D(bim, rfim, bmsk, dim.nv, highb, highf);
+         t = bench_clock()-t;
+         if(t<best) best=t;
+         if(r<opt_reps-1) free(hist);
+      }
+      report("hist2D", vs, dim, best, dim.nv, 6.0*dim.nv);
+
+      // the fit uses the whole histogram, as hist2D_line() does within its display range
+      n = (highb+1)*(highf+1);
+      x0 = (double *)calloc(n, sizeof(double));
+      x1 = (double *)calloc(n, sizeof(double));
+      w = (double *)calloc(n, sizeof(double));
+      w_const = (double *)calloc(n, sizeof(double));
+
+      best=1.0e30;
+      for(int r=0; r<opt_reps; r++)
+      {
+         for(int j=0, i=0; j<=highf; j++)
+         for(int b=0; b<=highb; b++, i++)
+         {
+            x0[i]=b;
+            x1[i]=j;
+            w_const[i]=hist[i]/100.0;
+            w[i]=1.0;
+         }
+
+         t = bench_clock();
+         fit_hist2D_line(x0, x1, w, w_const, n, u, d);
+         t = bench_clock()-t;
+         if(t<best) best=t;
+      }
+      report("fit_hist2D_line", vs, dim, best, n, 32.0*n);
+
+      free(x0); free(x1); free(w); free(w_const);
+      free(hist);
+      free(rfim);
+   }
+
+   free_mask_spans(bspans);
+   free_mask_spans(fspans);
+   free(sclbim); free(sclfim);
+   free(bim); free(fim);
+   free(bmsk); free(fmsk);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// End-to-end registration benchmark
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+// Prints the stages recorded by the profiler, except the optimizer iterations, which are
+// summarized by the cost function evaluations of the stage that contains them.
+static void print_stages()
+{
+   printf("\n%-40s %12s %12s %10s %14s\n", "Stage", "wall (ms)", "cpu (ms)", "evals", "Mvoxel/s");
+
+   for(int n=0; n<profile_nstage; n++)
+   {
+      STAGE *s = profile_stage + n;
+      char name[128];
+
+      if( strstr(s->name, "iteration") != NULL ) continue;
+
+      snprintf(name, sizeof(name), "%*s%s", 2*s->depth, "", s->name);
+      printf("%-40s %12.3f %12.3f %10lld %14.2f\n", name, 1.0e3*s->wall, 1.0e3*s->cpu, s->evals,
+      s->wall>0.0 ? 1.0e-6*s->voxels/s->wall : 0.0);
+   }
+}
+
+// Measures how far transformation T is from Tref: angle (degrees) and translation (mm) of
+// inverse(Tref)*T, and the RMS and maximum distance (mm) between T p and Tref p over the n
+// voxels p of msk (mm from the center of grid dim).
+void transformation_error(float4 *T, float4 *Tref, int2 *msk, DIM dim, double &angle, double &translation,
+double &rms, double &maxerr, int &n)
+{
+   float4 *invTref, E[16];
+
+   // E is the identity when T equals Tref
+   invTref = inv4(Tref);
+   multi(invTref, 4, 4, T, 4, 4, E);
+   free(invTref);
+
+   // rotation angle of E from its trace (cosine) and antisymmetric part (sine), which unlike 
+   // acos() of the trace alone stays accurate for small angles
+   {
+      double c = (E[0]+E[5]+E[10]-1.0)/2.0;
+      double s = 0.5*sqrt( (E[9]-E[6])*(E[9]-E[6]) + (E[2]-E[8])*(E[2]-E[8]) + (E[4]-E[1])*(E[4]-E[1]) );
+
+      angle = atan2(s,c)*180.0/M_PI;
+      translation = sqrt(E[3]*E[3] + E[7]*E[7] + E[11]*E[11]);
+   }
+
+   rms = maxerr = 0.0;
+   n = 0;
+
+   for(int k=0; k<dim.nz; k++)
+   for(int j=0; j<dim.ny; j++)
+   for(int i=0; i<dim.nx; i++)
+   {
+      float4 p[3];
+      double d, d2=0.0;
+
+      if( msk[k*dim.np + j*dim.nx + i]==0 ) continue;
+
+      p[0] = (i - (dim.nx-1)/2.0)*dim.dx;
+      p[1] = (j - (dim.ny-1)/2.0)*dim.dy;
+      p[2] = (k - (dim.nz-1)/2.0)*dim.dz;
+
+      for(int a=0; a<3; a++)
+      {
+         d = (T[4*a]-Tref[4*a])*p[0] + (T[4*a+1]-Tref[4*a+1])*p[1] + (T[4*a+2]-Tref[4*a+2])*p[2] 
+         + T[4*a+3]-Tref[4*a+3];
+         d2 += d*d;
+      }
+
+      rms += d2;
+      if(d2>maxerr) maxerr=d2;
+      n++;
+   }
+
+   if(n>0) rms = sqrt(rms/n);
+   maxerr = sqrt(maxerr);
+}
+
+// Returns 1 if the registration error is within opt_maxerr, 0 otherwise.
+int bench_e2e(int verbose)
+{
+   DIM dim;
+   int2 *bim, *fim, *bmsk, *fmsk;
+   float4 Ttrue[16]; // takes the follow-up to the baseline image (mm from the image centers)
+   float4 I[16]={1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1}; // PIL transformations
+   float4 Tinter[16], Tf[16], Tb[16], T[16];
+   float4 *invTb;
+   double mangle, mtranslation, mrms, mmaxerr;
+   double t, angle, translation, rms, maxerr;
+   int n, stage;
+
+   printf("KAIBA end-to-end registration: %.2f mm voxels, %d threads\n", opt_vs, opt_threads);
+   printf("Known transformation: rotation %.2f degrees about each axis, translation %.2f mm along each axis, intensity scaling %.2f\n",
+   opt_rot, opt_shift, opt_scale);
+
+   set_transformation(opt_rot, opt_rot, opt_rot, opt_shift, opt_shift, opt_shift, "ZXYT", Ttrue);
+
+   stage = profile_begin("synthesize images");
+   bim = synthetic_head(dim, opt_vs, NULL, 1.0, 20.0, 1, bmsk);
+   fim = synthetic_head(dim, opt_vs, Ttrue, opt_scale, 20.0, 2, fmsk);
+   profile_end(stage);
+
+   t = bench_clock();
+   stage = profile_begin("register_images");
+   // the baseline brain mask stands in for the thresholded PIL brain cloud
+   register_images(bim, fim, bmsk, fmsk, dim, dim, I, I, I, bmsk, dim, Tinter, verbose);
+   profile_end(stage);
+   t = bench_clock()-t;
+
+   // with identity PIL transformations, Tinter takes the follow-up to the baseline image
+   transformation_error(Tinter, Ttrue, fmsk, dim, angle, translation, rms, maxerr, n);
+
+   // how far the midpoint transformations saved by KAIBA are from composing back to Tinter; this
+   // is reported but not checked, since KAIBA 2.0 applies the full Tinter in both Tf and Tb
+   midpoint_transformations(Tinter, I, I, Tf, Tb);
+   invTb = inv4(Tb);
+   multi(invTb, 4, 4, Tf, 4, 4, T);
+   free(invTb);
+   transformation_error(T, Tinter, fmsk, dim, mangle, mtranslation, mrms, mmaxerr, n);
+
+   print_stages();
+
+   printf("\nRegistration time = %.3f s\n", t);
+   printf("Rotation error = %.4f degrees\n", angle);
+   printf("Translation error = %.4f mm (at the image center)\n", translation);
+   printf("Displacement error within the brain = %.4f mm RMS, %.4f mm maximum (%d voxels)\n", rms, maxerr, n);
+   printf("Midpoint transformations error = %.4f mm RMS, %.4f mm maximum\n", mrms, mmaxerr);
+   printf("%s: maximum displacement error %s %.4f mm\n", maxerr<=opt_maxerr ? "PASSED" : "FAILED",
+   maxerr<=opt_maxerr ? "<=" : ">", opt_maxerr);
+
+   free(bim); free(fim);
+   free(bmsk); free(fmsk);
+
+   return( maxerr<=opt_maxerr );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Validation of the fast paths against the scalar reference
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+// the settings of the cost functions and the registration that select the fast paths
+struct FASTPATH
+{
+   int threads, fixed16, brick, pyramid, gn;
+   int metric, interp, halfway;
+   float4 sample;
+   SSDROWKERNEL ssd_row;
+   NCCROWKERNEL ncc_row;
+};
+
+static const char *METRIC_NAMES[4]={"ssd", "ncc", "mi", "nmi"}; // indexed by COST_SSD, ...
+
+// masks of the reference registration, which the reference cost functions take instead of the
+// span lists of register_images()
+static int2 *reference_bmsk=NULL, *reference_fmsk=NULL;
+
+static float8 reference_cost(float4 *T, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, MASKSPANS *bspans, MASKSPANS *fspans)
+{
+   return( ssd_cost_reference(T, dimb, dimf, sclbim, sclfim, reference_bmsk, reference_fmsk) );
+}
+
+// The K costs are computed in full, one transformation at a time, whatever the bound.
+static void reference_batch_cost(float4 *T, int K, DIM dimb, DIM dimf, float4 *sclbim, float4 *sclfim, 
+MASKSPANS *bspans, MASKSPANS *fspans, float8 bound, float8 *cost)
+{
+   for(int m=0; m<K; m++)
+      cost[m] = ssd_cost_reference(T+16*m, dimb, dimf, sclbim, sclfim, reference_bmsk, reference_fmsk);
+}
+
+// Saves the current settings in fast and selects the reference path: ssd_cost_reference() on
+// the masks bmsk and fmsk, one thread, the reference row code, float images in the linear 
+// layout, all voxels, native resolution and grid search, without -halfway.
+static void select_reference_path(FASTPATH &fast, int2 *bmsk, int2 *fmsk)
+{
+   fast.threads = opt_threads;
+   fast.fixed16 = opt_fixed16;
+   fast.brick = opt_brick;
+   fast.pyramid = opt_pyramid;
+   fast.gn = opt_gn;
+   fast.metric = opt_metric;
+   fast.interp = opt_interp;
+   fast.halfway = opt_halfway;
+   fast.sample = opt_sample;
+   fast.ssd_row = ssd_row_kernel;
+   fast.ncc_row = ncc_row_kernel;
+
+   opt_threads = 1;
+   opt_fixed16 = opt_brick = opt_gn = opt_halfway = NO;
+   opt_metric = COST_SSD;
+   opt_interp = INTERP_TRILINEAR;
+   opt_pyramid = 1;
+   opt_sample = 1.0;
+   ssd_row_kernel = NULL;
+   ncc_row_kernel = NULL;
+
+   reference_bmsk = bmsk;
+   reference_fmsk = fmsk;
+   registration_cost_function = reference_cost;
+   registration_batch_cost_function = reference_batch_cost;
+}
+
+static void select_fast_path(FASTPATH &fast)
+{
+   opt_threads = fast.threads;
+   opt_fixed16 = fast.fixed16;
+   opt_brick = fast.brick;
+   opt_pyramid = fast.pyramid;
+   opt_gn = fast.gn;
+   opt_metric = fast.metric;
+   opt_interp = fast.interp;
+   opt_halfway = fast.halfway;
+   opt_sample = fast.sample;
+   ssd_row_kernel = fast.ssd_row;
+   ncc_row_kernel = fast.ncc_row;
+
+   registration_cost_function = NULL;
+   registration_batch_cost_function = NULL;
+}
+
+// Largest relative deviation of the cost functions of the fast path (single and batch) from
+// the reference cost functions over the K transformations T.
+static double cost_deviation(const char *name, float4 *T, int K, DIM dim, float4 *sclbim, float4 *sclfim, 
+int2 *bmsk, int2 *fmsk, MASKSPANS *bspans, MASKSPANS *fspans)
+{
+   float8 ref, fast, batch[MAXBATCH];
+   double dev, maxdev=0.0;
+   int ncc = (strcmp(name,"ncc")==0);
+
+   if(ncc)
+      ncc_cost_function_batch(T, K, dim, dim, sclbim, sclfim, bspans, fspans, INFINITY, batch);
+   else
+      ssd_cost_function_batch(T, K, dim, dim, sclbim, sclfim, bspans, fspans, INFINITY, batch);
+
+   for(int m=0; m<K; m++)
+   {
+      if(ncc)
+      {
+         ref = ncc_cost_reference(T+16*m, dim, dim, sclbim, sclfim, bmsk, fmsk);
+         fast = ncc_cost_function(T+16*m, dim, dim, sclbim, sclfim, bspans, fspans);
+      }
+      else
+      {
+         ref = ssd_cost_reference(T+16*m, dim, dim, sclbim, sclfim, bmsk, fmsk);
+         fast = ssd_cost_function(T+16*m, dim, dim, sclbim, sclfim, bspans, fspans);
+      }
+
+      dev = fabs(fast-ref)/(fabs(ref)>0.0 ? fabs(ref) : 1.0);
+      if(dev>maxdev) maxdev=dev;
+
+      dev = fabs(batch[m]-ref)/(fabs(ref)>0.0 ? fabs(ref) : 1.0);
+      if(dev>maxdev) maxdev=dev;
+
+      if(opt_v) printf("%s transformation %2d: reference %.9e, fast %.9e, batch %.9e\n", name, m, ref, fast, batch[m]);
+   }
+
+   return(maxdev);
+}
+
+// Registers copies of bim and fim and returns Tf and Tb.
+static void register_copies(int2 *bim, int2 *fim, int2 *bmsk, int2 *fmsk, DIM dim, float4 *Tf, float4 *Tb)
+{
+   float4 I[16]={1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
+   float4 Tinter[16];
+   int2 *b, *f;
+
+   // register_images() modifies the images
+   b = (int2 *)calloc(dim.nv, sizeof(int2));
+   f = (int2 *)calloc(dim.nv, sizeof(int2));
+   for(int v=0; v<dim.nv; v++) { b[v]=bim[v]; f[v]=fim[v]; }
+
+   register_images(b, f, bmsk, fmsk, dim, dim, I, I, I, bmsk, dim, Tinter, opt_v);
+   midpoint_transformations(Tinter, I, I, Tf, Tb);
+
+   free(b);
+   free(f);
+}
+
+// HI within roi of image im resliced to the halfway space by T
+static float8 halfway_hi(int2 *im, DIM dim, float4 *T, int2 *roi)
+{
+   float4 *invT;
+   int2 *rim;
+   float8 hi;
+
+   invT = inv4(T);
+   rim = resliceImage(im, dim, dim, invT, LIN);
+   free(invT);
+
+   hi = compute_hi(rim, roi, dim.nv);
+   free(rim);
+
+   return(hi);
+}
+
+static int check(const char *quantity, double value, double tolerance, const char *unit)
+{
+   printf("%-8s %-44s %12.4e %s (tolerance %.4e)\n", value<=tolerance ? "PASSED" : "FAILED", 
+   quantity, value, unit, tolerance);
+
+   return( value<=tolerance );
+}
+
+// Runs the reference and fast paths on the same synthetic images and compares the costs, the 
+// final Tf and Tb, and the HI.  Returns 1 if all differences are within tolerance, 0 otherwise.
+int bench_validate()
+{
+   DIM dim;
+   int2 *bim, *fim, *bmsk, *fmsk, *roi;
+   float4 *sclbim, *sclfim;
+   float4 Ttrue[16], T[16*MAXBATCH];
+   float4 Tfref[16], Tbref[16], Tf[16], Tb[16];
+   float8 hiref[2], hi[2];
+   double ssddev, nccdev;
+   double angle, translation, rms, maxerr, maxf, maxb;
+   int n, ok=YES;
+   FASTPATH fast;
+
+   printf("KAIBA validation: %.2f mm voxels\n", opt_vs);
+   printf("Fast path: %d threads, %s row kernels, %s images, %s layout, voxel sample fraction %.3f, %d pyramid levels, %s, %s:%s cost%s\n", 
+   opt_threads, ssd_row_kernel!=NULL ? "fast" : "reference", opt_fixed16 ? "16-bit fixed point" : "float", 
+   opt_brick ? "bricked" : "linear", opt_sample, opt_pyramid, opt_gn ? "Gauss-Newton" : "grid search",
+   METRIC_NAMES[opt_metric], opt_interp==INTERP_NEAREST ? "nearest" : "trilinear", opt_halfway ? " in the halfway space" : "");
+   printf("Reference: ssd_cost_reference() and ncc_cost_reference() for the costs; ssd_cost_reference() on 1 thread, all voxels, native resolution and grid search for the registration\n");
+
+   set_transformation(opt_rot, opt_rot, opt_rot, opt_shift, opt_shift, opt_shift, "ZXYT", Ttrue);
+
+   bim = synthetic_head(dim, opt_vs, NULL, 1.0, 20.0, 1, bmsk);
+   fim = synthetic_head(dim, opt_vs, Ttrue, opt_scale, 20.0, 2, fmsk);
+   roi = synthetic_roi(dim);
+
+   ////////////////////////////////////////////////////////////////////////////////////////
+   // cost functions at transformations from the identity to beyond Ttrue
+   ////////////////////////////////////////////////////////////////////////////////////////
+   sclbim = (float4 *)calloc(dim.nv, sizeof(float4));
+   sclfim = (float4 *)calloc(dim.nv, sizeof(float4));
+   {
+      float4 bscale = imageMean(bim, bmsk, dim.nv);
+      float4 fscale = imageMean(fim, fmsk, dim.nv);
+
+      for(int v=0; v<dim.nv; v++) sclbim[v] = bim[v]/bscale;
+      for(int v=0; v<dim.nv; v++) sclfim[v] = fim[v]/fscale;
+   }
+
+   for(int m=0; m<MAXBATCH; m++)
+   {
+      float4 a = 1.5*m/(MAXBATCH-1);
+
+      set_transformation(a*opt_rot, a*opt_rot, -a*opt_rot, a*opt_shift, -a*opt_shift, a*opt_shift, "ZXYT", T+16*m);
+   }
+
+   {
+      MASKSPANS bspans, fspans;
+
+      build_cost_spans(bmsk, sclbim, dim, bspans);
+      build_cost_spans(fmsk, sclfim, dim, fspans);
+
+      ssddev = cost_deviation("ssd", T, MAXBATCH, dim, sclbim, sclfim, bmsk, fmsk, &bspans, &fspans);
+      nccdev = cost_deviation("ncc", T, MAXBATCH, dim, sclbim, sclfim, bmsk, fmsk, &bspans, &fspans);
+
+      free_cost_spans(bspans, sclbim);
+      free_cost_spans(fspans, sclfim);
+   }
+
+   free(sclbim);
+   free(sclfim);
+
+   ////////////////////////////////////////////////////////////////////////////////////////
+   // registration and HI
+   ////////////////////////////////////////////////////////////////////////////////////////
+   select_reference_path(fast, bmsk, fmsk);
+   register_copies(bim, fim, bmsk, fmsk, dim, Tfref, Tbref);
+   hiref[0] = halfway_hi(bim, dim, Tbref, roi);
+   hiref[1] = halfway_hi(fim, dim, Tfref, roi);
+   select_fast_path(fast);
+
+   register_copies(bim, fim, bmsk, fmsk, dim, Tf, Tb);
+   hi[0] = halfway_hi(bim, dim, Tb, roi);
+   hi[1] = halfway_hi(fim, dim, Tf, roi);
+
+   printf("\n");
+   ok &= check("ssd cost, maximum relative deviation", ssddev, opt_costtol, "   ");
+   ok &= check("ncc cost, maximum relative deviation", nccdev, opt_costtol, "   ");
+
+   transformation_error(Tf, Tfref, fmsk, dim, angle, translation, rms, maxerr, n);
+   maxf = maxerr;
+   if(opt_v) printf("Tf difference: %.4f degrees, %.4f mm at the center, %.4f mm RMS\n", angle, translation, rms);
+
+   transformation_error(Tb, Tbref, bmsk, dim, angle, translation, rms, maxerr, n);
+   maxb = maxerr;
+   if(opt_v) printf("Tb difference: %.4f degrees, %.4f mm at the center, %.4f mm RMS\n", angle, translation, rms);
+
+   ok &= check("Tf, maximum displacement within the brain", maxf, opt_Ttol, "mm ");
+   ok &= check("Tb, maximum displacement within the brain", maxb, opt_Ttol, "mm ");
+
+   if(opt_v) printf("HI: reference %f (baseline) %f (follow-up), fast %f %f\n", hiref[0], hiref[1], hi[0], hi[1]);
+   ok &= check("HI difference, baseline", fabs(hi[0]-hiref[0]), opt_hitol, "   ");
+   ok &= check("HI difference, follow-up", fabs(hi[1]-hiref[1]), opt_hitol, "   ");
+
+   printf("%s\n", ok ? "PASSED" : "FAILED");
+
+   free(bim); free(fim);
+   free(bmsk); free(fmsk);
+   free(roi);
+
+   return(ok);
+}
+
+int main(int argc, char **argv)
+{
+   float4 voxelsize[3]={1.0, 0.8, 0.5};
+
+   while ((opt = getoption(argc, argv, bench_options)) != -1 )
+   {
+      switch (opt)
+      {
+         case 'r':
+            opt_reps=atoi(optarg);
+            if(opt_reps<1) opt_reps=1;
+            break;
+         case 'a':
+            opt_rot=atof(optarg);
+            break;
+         case 't':
+            opt_threads=atoi(optarg);
+            if(opt_threads<1) opt_threads=1;
+            break;
+         case 's':
+            opt_simd=YES;
+            break;
+         case 'e':
+            opt_e2e=YES;
+            break;
+         case 'V':
+            opt_validate=YES;
+            break;
+         case 'o':
+            opt_costtol=atof(optarg);
+            break;
+         case 'T':
+            opt_Ttol=atof(optarg);
+            break;
+         case 'q':
+            opt_hitol=atof(optarg);
+            break;
+         case 'x':
+            opt_fixed16=YES;
+            opt_simd=YES;
+            break;
+         case 'k':
+            opt_brick=YES;
+            opt_simd=YES;
+            break;
+         case 'd':
+            opt_vs=atof(optarg);
+            if(opt_vs<=0.0) opt_vs=1.0;
+            break;
+         case 'u':
+            opt_shift=atof(optarg);
+            break;
+         case 'i':
+            opt_scale=atof(optarg);
+            if(opt_scale<=0.0) opt_scale=1.0;
+            break;
+         case 'm':
+            opt_maxerr=atof(optarg);
+            break;
+         case 'y':
+            opt_pyramid=atoi(optarg);
+            if(opt_pyramid<1) opt_pyramid=1;
+            if(opt_pyramid>MAXPYRAMID) opt_pyramid=MAXPYRAMID;
+            break;
+         case 'G':
+            opt_gn=YES;
+            break;
+         case 'S':
+            opt_sample=atof(optarg);
+            if(opt_sample<=0.0 || opt_sample>1.0) opt_sample=1.0;
+            break;
+         case 'c':
+            parse_cost_option(optarg);
+            break;
+         case 'H':
+            opt_halfway=YES;
+            break;
+         case 'P':
+            sprintf(opt_profile,"%s",optarg);
+            break;
+         case 'v':
+            opt_v=YES;
+            break;
+         case 'h':
+         case '?':
+            print_bench_help_and_exit();
+      }
+   }
+
+   if( opt_gn && (opt_metric!=COST_SSD || opt_interp!=INTERP_TRILINEAR) )
+   {
+      printf("-gn requires the default cost function (-cost ssd:trilinear).\n");
+      exit(1);
+   }
+
+   if( opt_gn && opt_halfway )
+   {
+      printf("-gn cannot be used with -halfway.\n");
+      exit(1);
+   }
+
+   const char *isa = opt_simd ? select_row_kernels() : "reference";
+
+   if(opt_validate)
+   {
+      printf("Cost function kernels: %s\n", isa);
+      return( bench_validate() ? 0 : 1 );
+   }
+
+   if(opt_e2e)
+   {
+      char profile[1024];
+      int ok;
+
+      printf("Cost function kernels: %s\n", isa);
+
+      // profile_begin() records stages only when opt_profile is set, so it is set to a 
+      // placeholder without -profile and the stages are saved only with -profile
+      sprintf(profile,"%s",opt_profile);
+      if(opt_profile[0]=='\0') sprintf(opt_profile,"e2e");
+
+      ok = bench_e2e(opt_v);
+
+      if(profile[0]!='\0') write_profile(profile);
+
+      return( ok ? 0 : 1 );
+   }
+
+   printf("KAIBA microbenchmarks: %d threads, %d repetitions (best time), rotation %.2f degrees\n",
+   opt_threads, opt_reps, opt_rot);
+
+   if(opt_simd) printf("Cost function kernels: %s\n", isa);
+
+   for(int s=0; s<3; s++) bench_size(voxelsize[s]);
+
+   return(0);
+}
@@ -0,0 +1,70 @@
+// kaiba_pack: compiles the $ARTHOME atlases used by KAIBA (PILbrain.nii, the lhc3/rhc3 ROI
+// volumes and landmark models) into one binary pack file that kaiba maps read-only (see
+// write_atlas_pack() and open_atlas_pack() in kaiba.cxx).  Processes on the same node then share
+// a single copy of the atlases in the page cache and do no reading or parsing at startup.
+//
+// The pack is in the native byte order and structure layout, so it should be compiled on the
+// platform that runs kaiba.  It must be compiled again when the $ARTHOME files change; until
+// then kaiba reads the changed files from $ARTHOME.
+
+#define KAIBA_NO_MAIN
+#include "kaiba.cxx"
+
+static struct option pack_options[] =
+{
+   {"-o",1,'o'},
+   {"-v",0,'v'},
+   {"-h",0,'h'},
+   {0,0,0}
+};
+
+void print_pack_help_and_exit()
+{
+   printf("\nUsage: kaiba_pack [options]\n"
+   "\nOptions:\n"
+   "   -o <file>: Output pack file (default: $ARTHOME/kaiba.pack, which kaiba uses by default)\n"
+   "   -v : Enables verbose mode\n"
+   "\n");
+
+   exit(0);
+}
+
+int main(int argc, char **argv)
+{
+   char packfile[1024]="";
+
+   while ((opt = getoption(argc, argv, pack_options)) != -1 )
+   {
+      switch (opt)
+      {
+         case 'o':
+            sprintf(packfile,"%s",optarg);
+            break;
+         case 'v':
+            opt_v=YES;
+            break;
+         case 'h':
+         case '?':
+            print_pack_help_and_exit();
+      }
+   }
+
+   getARTHOME();
+
+   if(packfile[0]=='\0') sprintf(packfile,"%s/kaiba.pack",ARTHOME);
+
+   if(opt_v) printf("ARTHOME: %s\n",ARTHOME);
+
+   write_atlas_pack(packfile, opt_v);
+
+   // the pack is read back as kaiba would read it
+   if( !open_atlas_pack(packfile) )
+   {
+      printf("Error reading %s back, aborting ...\n", packfile);
+      exit(1);
+   }
+
+   free_atlases();
+
+   return(0);
+}